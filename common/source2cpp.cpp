@@ -352,6 +352,61 @@ static const uts::unordered_map<uts::string, uts::string> g_sources{
         "\n"
         "}\n"
     ),
+    std::pair<uts::string, uts::string>("phongInst.vert",
+        "#version 150\n"
+        "#extension GL_ARB_explicit_attrib_location: enable\n"
+        "\n"
+        "// vertex shader: phongInst; Phong Model lighting of instanced primitives, each with its own model transform\n"
+        "\n"
+        "layout (location=0) in vec3 vertex;\n"
+        "layout (location=1) in vec2 UV;\n"
+        "layout (location=2) in vec3 vertexNormal;\n"
+        "layout (location=3) in mat4 instanceMx; // per-instance model mx, occupies locations 3-6\n"
+        "\n"
+        "// transformations\n"
+        "uniform mat4 MV; // model-view mx\n"
+        "uniform mat4 MVproj; //model-view-projection mx\n"
+        "uniform mat3 normMx; // normal matrix\n"
+        "\n"
+        "//colours and material\n"
+        "uniform vec4 matDiffuse;\n"
+        "uniform vec4 matAmbient;\n"
+        "uniform vec4 lightpos; // in camera space\n"
+        "uniform vec4 diffuseCol;\n"
+        "uniform vec4 ambientCol;\n"
+        "\n"
+        "// per pixel values to be computed in fragment shader\n"
+        "out vec3 normal; // vertex normal\n"
+        "out vec3 lightDir; // toLight\n"
+        "out vec3 halfVector;\n"
+        "out vec4 diffuse;\n"
+        "out vec4 ambient;\n"
+        "\n"
+        "out vec2 texCoord;\n"
+        "\n"
+        "void main(void)\n"
+        "{\n"
+        "    vec3 inNormal, v;\n"
+        "\n"
+        "    texCoord = UV;\n"
+        "    v = (instanceMx * vec4(vertex, 1.0)).xyz;\n"
+        "    inNormal = transpose(inverse(mat3(instanceMx))) * vertexNormal;\n"
+        "\n"
+        "    // map to camera space for lighting etc\n"
+        "    normal = normalize(normMx * inNormal);\n"
+        "\n"
+        "    // vertex in camera coords\n"
+        "    vec4 ecPos = MV * vec4(v, 1.0);\n"
+        "\n"
+        "    lightDir  = normalize(lightpos.xyz - ecPos.xyz);\n"
+        "    halfVector = normalize(normalize(-ecPos.xyz) + lightDir);\n"
+        "\n"
+        "    diffuse = matDiffuse * diffuseCol;\n"
+        "    ambient = matAmbient * ambientCol;\n"
+        "\n"
+        "    gl_Position = MVproj * vec4(v, 1.0); // clip space position\n"
+        "}\n"
+    ),
     std::pair<uts::string, uts::string>("phongRS.vert",
         "#version 150\n"
         "#extension GL_ARB_explicit_attrib_location: enable\n"
@@ -9,6 +9,7 @@
 #include <iostream>
 #include <limits>
 #include <stack>
+#include <algorithm>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/rotate_vector.hpp>
@@ -18,6 +19,294 @@ using namespace std;
 
 GLfloat defaultCol[] = {0.243f, 0.176f, 0.75f, 1.0f};
 
+bool CSGProgram::compileNode(SceneNode * root, int depth)
+{
+    CSGInstr instr;
+    int narrow;
+
+    instr.shape = NULL;
+    instr.op = SetOp::UNION;
+    instr.jump = -1;
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        instr.code = CSGCode::LOAD;
+        instr.shape = dynamic_cast<ShapeNode*>(root)->shape;
+        instr.shape->prepareQueries();
+        code.push_back(instr);
+        maxdepth = max(maxdepth, depth + 1);
+        return true;
+    }
+
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        // left operand, narrowing, right operand and then the operator itself
+        if(!compileNode(opnode->left, depth))
+            return false;
+        instr.code = CSGCode::NARROW;
+        instr.op = opnode->op;
+        narrow = (int) code.size();
+        code.push_back(instr);
+        if(!compileNode(opnode->right, depth + 1))
+            return false;
+        instr.code = CSGCode::COMBINE;
+        code[narrow].jump = (int) code.size();
+        code.push_back(instr);
+        return true;
+    }
+
+    cerr << "Error CSGProgram::compile: unrecognised node type in csg tree" << endl;
+    return false;
+}
+
+bool CSGProgram::matchFused(SceneNode * root, bool subtract)
+{
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        BaseShape * shape = dynamic_cast<ShapeNode*>(root)->shape;
+
+        if(dynamic_cast<Sphere*>(shape) != NULL)
+        {
+            Sphere * sph = dynamic_cast<Sphere*>(shape);
+            FusedSphere fs;
+
+            fs.cx = sph->c.x; fs.cy = sph->c.y; fs.cz = sph->c.z; fs.r2 = sph->r * sph->r;
+            (subtract ? subsph : addsph).push_back(fs);
+            return true;
+        }
+        if(dynamic_cast<Cylinder*>(shape) != NULL)
+        {
+            Cylinder * cyl = dynamic_cast<Cylinder*>(shape);
+            cgp::Vector dirvec;
+            FusedCylinder fc;
+
+            dirvec.diff(cyl->s, cyl->e);
+            fc.sx = cyl->s.x; fc.sy = cyl->s.y; fc.sz = cyl->s.z;
+            fc.dx = dirvec.i; fc.dy = dirvec.j; fc.dz = dirvec.k;
+            fc.den = dirvec.sqrdlength(); fc.r2 = cyl->r * cyl->r;
+            (subtract ? subcyl : addcyl).push_back(fc);
+            return true;
+        }
+        return false;
+    }
+
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        if(opnode->op == SetOp::UNION)
+        {
+            // a union of differences is not itself of the fused form, so operands may only be further unions
+            for(SceneNode * child : {opnode->left, opnode->right})
+                if(dynamic_cast<OpNode*>(child) != NULL && dynamic_cast<OpNode*>(child)->op != SetOp::UNION)
+                    return false;
+            return matchFused(opnode->left, subtract) && matchFused(opnode->right, subtract);
+        }
+        if(opnode->op == SetOp::DIFFERENCE && !subtract) // (U - V) - W = U - (V + W)
+            return matchFused(opnode->left, false) && matchFused(opnode->right, true);
+    }
+    return false;
+}
+
+bool CSGProgram::compile(SceneNode * root, bool allowfused)
+{
+    clear();
+    if(root == NULL)
+        return false;
+    if(!compileNode(root, 0))
+    {
+        clear();
+        return false;
+    }
+    if(allowfused)
+    {
+        fused = matchFused(root, false);
+        if(!fused)
+        {
+            addsph.clear(); subsph.clear();
+            addcyl.clear(); subcyl.clear();
+        }
+    }
+    return true;
+}
+
+void CSGProgram::clear()
+{
+    code.clear();
+    maxdepth = 0;
+    fused = false;
+    addsph.clear(); subsph.clear();
+    addcyl.clear(); subcyl.clear();
+}
+
+/**
+ * Apply one set operator between the lane results and every primitive of a list, with the primitive type and
+ * operator fixed at compile time so that the containment test inlines into a loop over all 64 lanes
+ * @param prims     primitives, combined with each other by union
+ * @param px, py, pz    lane coordinates
+ * @param[in,out] in    lane results, combined as in = in op (union of prims)
+ */
+template<class Prim, SetOp op>
+static inline void fuseLanes(const std::vector<Prim> &prims, const float * px, const float * py, const float * pz,
+                             unsigned char * in)
+{
+    unsigned char hit[64];
+    int p, i;
+
+    if(op == SetOp::UNION)
+    {
+        for(p = 0; p < (int) prims.size(); p++)
+            for(i = 0; i < 64; i++)
+                in[i] |= (unsigned char) prims[p].contains(px[i], py[i], pz[i]);
+    }
+    else
+    {
+        for(i = 0; i < 64; i++)
+            hit[i] = 0;
+        for(p = 0; p < (int) prims.size(); p++)
+            for(i = 0; i < 64; i++)
+                hit[i] |= (unsigned char) prims[p].contains(px[i], py[i], pz[i]);
+        for(i = 0; i < 64; i++)
+            in[i] = (op == SetOp::INTERSECTION) ? (in[i] & hit[i]) : (in[i] & (hit[i] ^ 1));
+    }
+}
+
+void CSGProgram::fusedEvaluate(const cgp::Point * pnts, int npnts, std::uint64_t * inside)
+{
+    float px[64], py[64], pz[64];
+    unsigned char in[64];
+    std::uint64_t bits, lanes;
+    int w, nwords, base, count, i;
+
+    nwords = (npnts + 63) / 64;
+    for(w = 0; w < nwords; w++)
+    {
+        base = w * 64;
+        count = min(64, npnts - base);
+        lanes = (count == 64) ? ~0ull : ((1ull << count) - 1ull);
+
+        // gather into separate coordinate arrays, padding the last batch, so the fixed length lane loops vectorise
+        for(i = 0; i < count; i++)
+        {
+            px[i] = pnts[base + i].x; py[i] = pnts[base + i].y; pz[i] = pnts[base + i].z;
+        }
+        for(i = count; i < 64; i++)
+            px[i] = py[i] = pz[i] = 0.0f;
+        for(i = 0; i < 64; i++)
+            in[i] = 0;
+        fuseLanes<FusedSphere, SetOp::UNION>(addsph, px, py, pz, in);
+        fuseLanes<FusedCylinder, SetOp::UNION>(addcyl, px, py, pz, in);
+
+        bits = 0;
+        for(i = 0; i < 64; i++)
+            bits |= (std::uint64_t) in[i] << i;
+        if((bits & lanes) != 0 && (!subsph.empty() || !subcyl.empty())) // subtraction only matters where something is inside
+        {
+            fuseLanes<FusedSphere, SetOp::DIFFERENCE>(subsph, px, py, pz, in);
+            fuseLanes<FusedCylinder, SetOp::DIFFERENCE>(subcyl, px, py, pz, in);
+            bits = 0;
+            for(i = 0; i < 64; i++)
+                bits |= (std::uint64_t) in[i] << i;
+        }
+        inside[w] = bits & lanes;
+    }
+}
+
+void CSGProgram::evaluate(const cgp::Point * pnts, int npnts, std::uint64_t * inside)
+{
+    std::vector<std::uint64_t> stack(getStackWords());
+
+    evaluate(pnts, npnts, inside, &stack[0]);
+}
+
+void CSGProgram::evaluate(const cgp::Point * pnts, int npnts, std::uint64_t * inside, std::uint64_t * stack)
+{
+    std::uint64_t * value = stack, * active = stack + maxdepth + 1;
+    std::uint64_t lanes, bits, left;
+    int w, nwords, base, count, pc, sp, ap, i;
+
+    if(fused)
+    {
+        fusedEvaluate(pnts, npnts, inside);
+        return;
+    }
+
+    nwords = (npnts + 63) / 64;
+    for(w = 0; w < nwords; w++)
+    {
+        base = w * 64;
+        count = min(64, npnts - base);
+        lanes = (count == 64) ? ~0ull : ((1ull << count) - 1ull);
+        if(code.empty())
+        {
+            inside[w] = 0;
+            continue;
+        }
+
+        // value stack holds one word of results per operand, active stack the points still worth testing
+        sp = 0; ap = 0;
+        active[0] = lanes;
+        pc = 0;
+        while(pc < (int) code.size())
+        {
+            const CSGInstr &instr = code[pc];
+            switch(instr.code)
+            {
+            case CSGCode::LOAD:
+                bits = 0;
+                for(lanes = active[ap]; lanes != 0; lanes &= lanes - 1)
+                {
+                    i = __builtin_ctzll(lanes);
+                    if(instr.shape->pointContainment(pnts[base + i]))
+                        bits |= 1ull << i;
+                }
+                value[sp++] = bits;
+                break;
+            case CSGCode::NARROW:
+                // only points the right operand can still change need to be tested against it
+                left = value[sp-1];
+                active[ap+1] = active[ap] & ((instr.op == SetOp::UNION) ? ~left : left);
+                ap++;
+                if(active[ap] == 0) // left operand already decides every point, push a placeholder and skip
+                {
+                    value[sp++] = 0;
+                    pc = instr.jump;
+                    continue;
+                }
+                break;
+            case CSGCode::COMBINE:
+                // results at points excluded by the narrowing are decided by the left operand alone
+                sp--;
+                switch(instr.op)
+                {
+                case SetOp::UNION:
+                    value[sp-1] |= value[sp];
+                    break;
+                case SetOp::INTERSECTION:
+                    value[sp-1] &= value[sp];
+                    break;
+                case SetOp::DIFFERENCE:
+                    value[sp-1] &= ~value[sp];
+                    break;
+                }
+                ap--;
+                break;
+            }
+            pc++;
+        }
+        inside[w] = value[0] & active[0];
+    }
+}
+
+bool CSGProgram::pointContainment(cgp::Point pnt)
+{
+    std::uint64_t bits;
+
+    evaluate(&pnt, 1, &bits);
+    return (bits & 1ull) != 0;
+}
+
 // traverses tree to add leaf nodes to vector
 void Scene::traverseTree(SceneNode* root, vector<ShapeNode *> & leaves){
 	if (dynamic_cast<ShapeNode*>(root) != NULL){
@@ -37,6 +326,8 @@ bool Scene::genVizRender(View * view, ShapeDrawData &sdd)
 
     geom.clear();
     geom.setColour(defaultCol);
+    inst.clear();
+    inst.setColour(defaultCol);
 
     // TO DO HERE, traverse csg tree pushing leaf nodes (shapes) to leaves vector
     // note: this displays all the constituent shapes in the tree but doesn't apply any set operations to them
@@ -46,10 +337,11 @@ bool Scene::genVizRender(View * view, ShapeDrawData &sdd)
 	
 	//cerr << leaves.size() << endl;
 	
-    // traverse leaf shapes generating geometry
+    // traverse leaf shapes generating geometry, except for those drawn as instances of a unit primitive
     for(i = 0; i < (int) leaves.size(); i++)
     {
-        leaves[i]->shape->genGeometry(&geom, view);
+        if(!leaves[i]->shape->genInstance(&inst))
+            leaves[i]->shape->genGeometry(&geom, view);
     }
 
     // bind geometry to buffers and return drawing parameters, if possible
@@ -64,34 +356,22 @@ bool Scene::genVizRender(View * view, ShapeDrawData &sdd)
 
 bool Scene::genVoxRender(View * view, ShapeDrawData &sdd)
 {
-    int x, y, z, xdim, ydim, zdim;
-    glm::mat4 tfm, idt;
-    glm::vec3 trs;
-    cgp::Point pnt;
+    std::vector<cgp::Point> points;
+    std::vector<cgp::Vector> norms;
+    std::vector<int> faces;
+    glm::mat4 idt;
 
     geom.clear();
     geom.setColour(defaultCol);
 
+    std::lock_guard<std::mutex> guard(voxlock); // a background job may be swapping in its result
     if(voxactive)
     {
         idt = glm::mat4(1.0f); // identity matrix
 
-        vox.getDim(xdim, ydim, zdim);
-
-        // place a sphere at filled voxels but subsample to avoid generating too many spheres
-        for(x = 0; x < xdim; x+=10)
-            for(y = 0; y < ydim; y+=10)
-                for(z = 0; z < zdim; z+=10)
-                {
-                    if(vox.get(x, y, z))
-                    {
-                        pnt = vox.getVoxelPos(x, y, z); // convert from voxel space to world coordinates
-                        trs = glm::vec3(pnt.x, pnt.y, pnt.z);
-                        tfm = glm::translate(idt, trs);
-                        geom.genSphere(voxsidelen * 5.0f, 3, 3, tfm);
-                    }
-                }
-
+        // exposed voxel faces merged into rectangles
+        voxelFaces(&vox, points, norms, faces);
+        geom.genMesh(&points, &norms, &faces, idt);
     }
 
     // bind geometry to buffers and return drawing parameters, if possible
@@ -111,15 +391,26 @@ Scene::Scene()
     voldiag = cgp::Vector(20.0f, 20.0f, 20.0f);
     voxsidelen = 0.0f;
     voxactive = false;
+    numthreads = 0;
+    pool = NULL;
+    setThreads(0);
+    voxmode = VoxMode::STREAM;
+    voxbusy = false;
+    voxcancel = false;
+    voxdone = 0;
+    voxtotal = 0;
 }
 
 Scene::~Scene()
 {
     clear();
+    if(pool != NULL)
+        delete pool;
 }
 
 void Scene::clear()
 {
+    cancelVoxelise();
     geom.clear();
     vox.clear();
 
@@ -130,244 +421,2328 @@ void Scene::clear()
     
 }
 
-// recursively clears nodes from csg tree
-void Scene::clearTree(SceneNode * root){
-	if (dynamic_cast<OpNode*>(root) != NULL){
-		clearTree(dynamic_cast<OpNode*>(root)->left);
-		clearTree(dynamic_cast<OpNode*>(root)->right);
-		root = NULL;
-	}
-	else if (dynamic_cast<ShapeNode*>(root) != NULL){
-		delete root;
-	}	
+void Scene::clearTree(SceneNode * root)
+{
+    std::vector<SceneNode *> nodes, keep;
+
+    collectNodes(root, nodes);
+    deleteNodes(nodes, keep);
 }
 
+void Scene::collectNodes(SceneNode * root, std::vector<SceneNode *> &nodes)
+{
+    if(root == NULL || find(nodes.begin(), nodes.end(), root) != nodes.end())
+        return;
+    nodes.push_back(root);
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        collectNodes(dynamic_cast<OpNode*>(root)->left, nodes);
+        collectNodes(dynamic_cast<OpNode*>(root)->right, nodes);
+    }
+}
 
-bool Scene::bindGeometry(View * view, ShapeDrawData &sdd)
+void Scene::deleteNodes(std::vector<SceneNode *> &nodes, std::vector<SceneNode *> &keep)
 {
-    if(voxactive)
+    std::vector<BaseShape *> liveshapes, deadshapes;
+    int n;
+
+    for(n = 0; n < (int) keep.size(); n++)
+        if(dynamic_cast<ShapeNode*>(keep[n]) != NULL)
+            liveshapes.push_back(dynamic_cast<ShapeNode*>(keep[n])->shape);
+
+    // node destructors delete children and shapes, so detach anything deleted separately or still in use
+    for(n = 0; n < (int) nodes.size(); n++)
     {
-        return genVoxRender(view, sdd);
+        if(find(keep.begin(), keep.end(), nodes[n]) != keep.end())
+            continue;
+        if(dynamic_cast<OpNode*>(nodes[n]) != NULL)
+        {
+            dynamic_cast<OpNode*>(nodes[n])->left = NULL;
+            dynamic_cast<OpNode*>(nodes[n])->right = NULL;
+        }
+        else if(dynamic_cast<ShapeNode*>(nodes[n]) != NULL)
+        {
+            ShapeNode * leaf = dynamic_cast<ShapeNode*>(nodes[n]);
+
+            if(find(liveshapes.begin(), liveshapes.end(), leaf->shape) != liveshapes.end() ||
+               find(deadshapes.begin(), deadshapes.end(), leaf->shape) != deadshapes.end())
+                leaf->shape = NULL;
+            else
+                deadshapes.push_back(leaf->shape);
+        }
+        delete nodes[n];
     }
-    else
-        return genVizRender(view, sdd);
 }
 
-void Scene::voxSetOp(SetOp op, VoxelVolume *leftarg, VoxelVolume *rightarg)
+bool Scene::sameShape(BaseShape * a, BaseShape * b)
 {
-    // stub, needs completing
-    bool left, right;
-    //cerr<<"here"<<endl;
-    for (int i=0; i<leftarg->getdimX(); i++){
-    	for (int j=0; j<leftarg->getdimY(); j++){
-    		for (int k=0; k<leftarg->getdimZ(); k++){
-    			left = leftarg->get(i,j,k);
-    			right = rightarg->get(i,j,k);
-				if (op == SetOp::UNION){
-					leftarg->set(i,j,k, left | right); // or
-				}
-				else if (op == SetOp::INTERSECTION){
-					leftarg->set(i,j,k, left & right); // and
-				}
-				else if (op == SetOp::DIFFERENCE){
-					leftarg->set(i,j,k, left - right); // diff
-				}
-			}
-		}
+    if(a == b)
+        return true;
+    if(dynamic_cast<Sphere*>(a) != NULL && dynamic_cast<Sphere*>(b) != NULL)
+    {
+        Sphere * sa = dynamic_cast<Sphere*>(a), * sb = dynamic_cast<Sphere*>(b);
+
+        return sa->c.x == sb->c.x && sa->c.y == sb->c.y && sa->c.z == sb->c.z && sa->r == sb->r;
     }
-    
+    if(dynamic_cast<Cylinder*>(a) != NULL && dynamic_cast<Cylinder*>(b) != NULL)
+    {
+        Cylinder * ca = dynamic_cast<Cylinder*>(a), * cb = dynamic_cast<Cylinder*>(b);
+
+        return ca->s.x == cb->s.x && ca->s.y == cb->s.y && ca->s.z == cb->s.z &&
+               ca->e.x == cb->e.x && ca->e.y == cb->e.y && ca->e.z == cb->e.z && ca->r == cb->r;
+    }
+    return false;
 }
 
-// for testing purposes, I probably shouldn't have done it like this though. Sorry.
-void Scene::voxSetOp2(SetOp op, VoxelVolume *leftarg, VoxelVolume *rightarg)
+void Scene::shareLeaves(SceneNode * &root, std::vector<ShapeNode *> &unique)
 {
-    // stub, needs completing
-    bool left, right;
-    //cerr<<"here"<<endl;
-    for (int i=0; i<leftarg->getdimX(); i++){
-    	for (int j=0; j<leftarg->getdimY(); j++){
-    		for (int k=0; k<leftarg->getdimZ(); k++){
-    			left = leftarg->get(i,j,k);
-    			right = rightarg->get(i,j,k);
-				if (op == SetOp::UNION){
-					leftarg->set(i,j,k, left | right);
-				}
-				else if (op == SetOp::INTERSECTION){
-					leftarg->set(i,j,k, left & right);
-				}
-				else if (op == SetOp::DIFFERENCE){
-					leftarg->set(i,j,k, left - right);
-				}
-			}
-		}
+    int u;
+
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        ShapeNode * leaf = dynamic_cast<ShapeNode*>(root);
+
+        for(u = 0; u < (int) unique.size(); u++)
+            if(unique[u] == leaf || sameShape(unique[u]->shape, leaf->shape))
+            {
+                root = unique[u];
+                return;
+            }
+        unique.push_back(leaf);
+    }
+    else if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        shareLeaves(dynamic_cast<OpNode*>(root)->left, unique);
+        shareLeaves(dynamic_cast<OpNode*>(root)->right, unique);
     }
-    
 }
 
-// gets all opnode ops into a vector
-void Scene::traverseTree2(SceneNode* root, vector<OpNode *> & leaves){
-	if (dynamic_cast<OpNode*>(root) != NULL){
-		traverseTree2(dynamic_cast<OpNode*>(root)->left,leaves);
-		traverseTree2(dynamic_cast<OpNode*>(root)->right,leaves);
-		leaves.push_back(dynamic_cast<OpNode*>(root));
-	} 
+void Scene::unshareOps(SceneNode * &root, std::vector<OpNode *> &seen)
+{
+    if(dynamic_cast<OpNode*>(root) == NULL)
+        return;
+
+    OpNode * opnode = dynamic_cast<OpNode*>(root);
+    if(find(seen.begin(), seen.end(), opnode) != seen.end())
+    {
+        // a later parent gets its own copy, whose children are in turn copied as they have been seen already
+        OpNode * copy = new OpNode();
+        copy->op = opnode->op;
+        copy->left = opnode->left;
+        copy->right = opnode->right;
+        root = opnode = copy;
+    }
+    seen.push_back(opnode);
+    unshareOps(opnode->left, seen);
+    unshareOps(opnode->right, seen);
 }
 
-VoxelVolume* Scene::setVoxel(float voxlen){
-	VoxelVolume* vox1 = new VoxelVolume();
-	int xdim, ydim, zdim;
-	//cerr << voxlen << endl;
-    // calculate voxel volume dimensions based on voxlen
-    xdim = ceil(voldiag.i / voxlen)+2; // needs a 1 voxel border to ensure a closed mesh if shapes reach write up to the border
-    ydim = ceil(voldiag.j / voxlen)+2;
-    zdim = ceil(voldiag.k / voxlen)+2;
-    voxsidelen = voxlen;
-    voxactive = true;
+cgp::BoundBox Scene::treeBounds(SceneNode * root)
+{
+    cgp::BoundBox left, right, bbox;
 
-    cgp::Vector voxdiag = cgp::Vector((float) xdim * voxlen, (float) ydim * voxlen, (float) zdim * voxlen);
-    cgp::Point voxorigin = cgp::Point(-0.5f*voxdiag.i, -0.5f*voxdiag.j, -0.5f*voxdiag.k);
-    vox1->setDim(xdim, ydim, zdim);
-    vox1->setFrame(voxorigin, voxdiag);
-    
-    return vox1;
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+        return dynamic_cast<ShapeNode*>(root)->shape->getBounds();
+
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        left = treeBounds(opnode->left);
+        if(opnode->op == SetOp::DIFFERENCE) // subtraction can only shrink the left operand
+            return left;
+        right = treeBounds(opnode->right);
+        if(opnode->op == SetOp::UNION)
+        {
+            if(!left.empty())
+            {
+                bbox.includePnt(left.min); bbox.includePnt(left.max);
+            }
+            if(!right.empty())
+            {
+                bbox.includePnt(right.min); bbox.includePnt(right.max);
+            }
+        }
+        else if(left.overlaps(right))
+        {
+            bbox.min = cgp::Point(max(left.min.x, right.min.x), max(left.min.y, right.min.y), max(left.min.z, right.min.z));
+            bbox.max = cgp::Point(min(left.max.x, right.max.x), min(left.max.y, right.max.y), min(left.max.z, right.max.z));
+        }
+    }
+    return bbox;
 }
 
-void Scene::voxWalk(SceneNode *root, VoxelVolume *voxels)
+SceneNode * Scene::pruneTree(SceneNode * root, CSGOptStats &stats)
 {
-    // stub, needs completing
-    // will require dynamic casting of SceneNode pointers
-    
-    std::vector<ShapeNode *> leaves;
-    traverseTree(root,leaves);
-    
-    std::vector<OpNode *> nodes;
-    traverseTree2(root,nodes);
-    
-    //vector<VoxelVolume*> tempVoxVols;
-    
-    // creates voxel grids for each shape
-    for (int l=0; l<(int)leaves.size(); l++){
-    	VoxelVolume* voxelsTemp = setVoxel(0.05f);
-    	for (int i=0; i<voxelsTemp->getdimX(); i++){
-			for (int j=0; j<voxelsTemp->getdimY(); j++){
-				for (int k=0; k<voxelsTemp->getdimZ(); k++){
-					
-					if (dynamic_cast<ShapeNode*>(leaves[l])->shape->pointContainment(voxelsTemp->getVoxelPos(i,j,k))){
-						voxelsTemp->set(i,j,k,true);
-					}
-					else{
-						voxelsTemp->set(i,j,k,false);
-					}
-				}
-			}
-		}
-		voxVols.push_back(voxelsTemp);
-		//tempVoxVols.push_back(voxelsTemp);
+    std::vector<ShapeNode *> dropped;
+    SceneNode * left, * right;
+
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        if(treeBounds(root).empty()) // e.g. a mesh without triangles
+        {
+            stats.droppedleaves++;
+            return NULL;
+        }
+        return root;
     }
-    
-    // performs setop on the separate shape voxelgrids
-    for (int i=(int)nodes.size()-1; i>=0; i--){
-    	VoxelVolume* temp1 =  voxVols[0];
-    	VoxelVolume* temp2 = voxVols[1];
-    	OpNode* tempNode = nodes[i];
-    	//cerr << "did" << endl;
-    	voxSetOp(tempNode->op, temp1, temp2);
-    	voxVols.erase(voxVols.begin()+1);
-    	voxVols[0] = temp1;
+
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        left = pruneTree(opnode->left, stats);
+        right = pruneTree(opnode->right, stats);
+        if(left == NULL || right == NULL)
+        {
+            // an empty operand decides the result, dropping the other operand unless it is the union survivor
+            if(opnode->op == SetOp::UNION)
+                return (left == NULL) ? right : left;
+            if(opnode->op == SetOp::DIFFERENCE && left != NULL)
+                return left;
+            traverseTree((left == NULL) ? right : left, dropped);
+            stats.droppedleaves += (int) dropped.size();
+            return NULL;
+        }
+        if(opnode->op != SetOp::UNION && !treeBounds(left).overlaps(treeBounds(right)))
+        {
+            // disjoint operands: an intersection is empty and a difference leaves its left operand unchanged
+            traverseTree(right, dropped);
+            if(opnode->op == SetOp::DIFFERENCE)
+            {
+                stats.droppedleaves += (int) dropped.size();
+                return left;
+            }
+            traverseTree(left, dropped);
+            stats.droppedleaves += (int) dropped.size();
+            return NULL;
+        }
+        opnode->left = left;
+        opnode->right = right;
+        return opnode;
     }
-    
-    // set the voxels for the final joined shape
-    for (int i=0; i<voxVols[0]->getdimX(); i++){
-		for (int j=0; j<voxVols[0]->getdimY(); j++){
-			for (int k=0; k<voxVols[0]->getdimZ(); k++){
-				
-				if (voxVols[0]->get(i,j,k)){
-					voxels->set(i,j,k,true);
-				}
-				else{
-					voxels->set(i,j,k,false);
-				}
-			}
-		}
-	}
-    
+    return NULL;
+}
+
+float Scene::treeCost(SceneNode * root)
+{
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        BaseShape * shape = dynamic_cast<ShapeNode*>(root)->shape;
+
+        if(dynamic_cast<Sphere*>(shape) != NULL)
+            return 1.0f;
+        if(dynamic_cast<Cylinder*>(shape) != NULL)
+            return 2.0f;
+        if(dynamic_cast<Mesh*>(shape) != NULL) // ray casts and column tests grow with triangle count
+            return 8.0f + 0.01f * (float) dynamic_cast<Mesh*>(shape)->getNumTris();
+        return 4.0f;
+    }
+    if(dynamic_cast<OpNode*>(root) != NULL)
+        return treeCost(dynamic_cast<OpNode*>(root)->left) + treeCost(dynamic_cast<OpNode*>(root)->right);
+    return 0.0f;
 }
 
+void Scene::gatherOperands(SceneNode * root, SetOp op, std::vector<SceneNode *> &operands, std::vector<OpNode *> &chain)
+{
+    if(dynamic_cast<OpNode*>(root) != NULL && dynamic_cast<OpNode*>(root)->op == op)
+    {
+        gatherOperands(dynamic_cast<OpNode*>(root)->left, op, operands, chain);
+        gatherOperands(dynamic_cast<OpNode*>(root)->right, op, operands, chain);
+        chain.push_back(dynamic_cast<OpNode*>(root));
+    }
+    else
+        operands.push_back(root);
+}
 
-void Scene::voxelise(float voxlen)
+SceneNode * Scene::flattenTree(SceneNode * root, CSGOptStats &stats)
 {
-    int xdim, ydim, zdim;
-	//cerr << voxlen << endl;
-    // calculate voxel volume dimensions based on voxlen
-    xdim = ceil(voldiag.i / voxlen)+2; // needs a 1 voxel border to ensure a closed mesh if shapes reach write up to the border
-    ydim = ceil(voldiag.j / voxlen)+2;
-    zdim = ceil(voldiag.k / voxlen)+2;
-    voxsidelen = voxlen;
-    voxactive = true;
+    std::vector<SceneNode *> operands;
+    std::vector<OpNode *> chain;
+    std::vector<std::pair<float, int>> order;
+    int o;
+    bool moved;
 
-    cgp::Vector voxdiag = cgp::Vector((float) xdim * voxlen, (float) ydim * voxlen, (float) zdim * voxlen);
-    cgp::Point voxorigin = cgp::Point(-0.5f*voxdiag.i, -0.5f*voxdiag.j, -0.5f*voxdiag.k);
-    vox.setDim(xdim, ydim, zdim);
-    vox.setFrame(voxorigin, voxdiag);
+    if(dynamic_cast<OpNode*>(root) == NULL)
+        return root;
 
-    cerr << "Voxel volume dimensions = " << xdim << " x " << ydim << " x " << zdim << endl;
+    OpNode * opnode = dynamic_cast<OpNode*>(root);
+    if(opnode->op == SetOp::DIFFERENCE)
+    {
+        opnode->left = flattenTree(opnode->left, stats);
+        opnode->right = flattenTree(opnode->right, stats);
+        return opnode;
+    }
 
-    // actual recursive depth-first walk of csg tree
-    if(csgroot != NULL)
-        voxWalk(csgroot, &vox);
+    // n operands joined by n-1 binary nodes of the same associative and commutative operator
+    gatherOperands(opnode, opnode->op, operands, chain);
+    for(o = 0; o < (int) operands.size(); o++)
+    {
+        operands[o] = flattenTree(operands[o], stats);
+        order.push_back(std::pair<float, int>(treeCost(operands[o]), o));
+    }
+    stats.flattened += (int) chain.size() - 1;
+
+    // cheap operands first, so that expensive ones are skipped by early-outs wherever possible
+    stable_sort(order.begin(), order.end(), [](const std::pair<float, int> &a, const std::pair<float, int> &b)
+    {
+        return a.first < b.first;
+    });
+    moved = false;
+    for(o = 0; o < (int) order.size(); o++)
+        moved = moved || (order[o].second != o);
+    if(moved)
+        stats.reordered++;
+
+    // relink the existing operator nodes as a left-deep chain in the new order
+    chain[0]->left = operands[order[0].second];
+    chain[0]->right = operands[order[1].second];
+    for(o = 1; o < (int) chain.size(); o++)
+    {
+        chain[o]->left = chain[o-1];
+        chain[o]->right = operands[order[o+1].second];
+    }
+    return chain.back();
 }
 
-void Scene::sampleScene()
+CSGOptStats Scene::optimiseTree()
 {
-    ShapeNode * sph = new ShapeNode();
-    sph->shape = new Sphere(cgp::Point(0.0f, 0.0f, 0.0f), 4.0f);
+    std::vector<SceneNode *> before, after;
+    std::vector<ShapeNode *> unique, leaves;
+    std::vector<OpNode *> seen;
+    CSGOptStats stats;
+    int n, distinct;
 
-    ShapeNode * cyl1 = new ShapeNode();
-    cyl1->shape = new Cylinder(cgp::Point(-7.0f, -7.0f, 0.0f), cgp::Point(7.0f, 7.0f, 0.0f), 2.0f);
+    if(csgroot == NULL)
+        return stats;
+    collectNodes(csgroot, before);
 
-    ShapeNode * cyl2 = new ShapeNode();
-    cyl2->shape = new Cylinder(cgp::Point(0.0f, -7.0f, 0.0f), cgp::Point(0.0f, 7.0f, 0.0f), 2.5f);
+    shareLeaves(csgroot, unique);
+    unshareOps(csgroot, seen); // pruning and flattening relink operator nodes in place
+    collectNodes(csgroot, before); // copies may be pruned away too
+    csgroot = pruneTree(csgroot, stats);
+    csgroot = flattenTree(csgroot, stats);
 
-    OpNode * combine = new OpNode();
-    combine->op = SetOp::UNION;
-    combine->left = sph;
-    combine->right = cyl1;
+    // every leaf occurrence beyond the first of each distinct leaf is now evaluated once and reused
+    collectNodes(csgroot, after);
+    traverseTree(csgroot, leaves);
+    distinct = 0;
+    for(n = 0; n < (int) after.size(); n++)
+        if(dynamic_cast<ShapeNode*>(after[n]) != NULL)
+            distinct++;
+    stats.sharedleaves = (int) leaves.size() - distinct;
+    deleteNodes(before, after);
 
-    OpNode * diff = new OpNode();
-    diff->op = SetOp::DIFFERENCE;
-    diff->left = combine;
-    diff->right = cyl2;
+    cerr << "CSG optimiser: " << stats.sharedleaves << " shared leaves, " << stats.droppedleaves << " dropped leaves, "
+         << stats.flattened << " flattened nodes, " << stats.reordered << " reordered operand lists" << endl;
+    return stats;
+}
 
-    csgroot = diff;
+bool Scene::bindGeometry(View * view, ShapeDrawData &sdd)
+{
+    if(voxactive)
+    {
+        return genVoxRender(view, sdd);
+    }
+    else
+        return genVizRender(view, sdd);
 }
 
-void Scene::expensiveScene()
+bool Scene::bindInstances(View * view, std::vector<ShapeDrawData> &sdds)
 {
-    ShapeNode * sph = new ShapeNode();
-    sph->shape = new Sphere(cgp::Point(1.0f, -2.0f, -2.0f), 3.0f);
+    if(voxactive || !inst.bindBuffers(view))
+        return false;
+    inst.getDrawParameters(sdds);
+    return true;
+}
 
-    ShapeNode * cyl = new ShapeNode();
-    cyl->shape = new Cylinder(cgp::Point(-7.0f, -7.0f, 0.0f), cgp::Point(7.0f, 7.0f, 0.0f), 2.0f);
+void Scene::voxSetOp(SetOp op, VoxelVolume *leftarg, VoxelVolume *rightarg)
+{
+    int lx, ly, lz, rx, ry, rz, i, j, k;
+    bool left, right, result;
 
-    ShapeNode * mesh = new ShapeNode();
-    Mesh * bunny = new Mesh();
-    bunny->readSTL("../meshes/bunny.stl");
-    bunny->boxFit(10.0f);
-    mesh->shape = bunny;
+    leftarg->getDim(lx, ly, lz);
+    rightarg->getDim(rx, ry, rz);
 
-    OpNode * combine = new OpNode();
-    combine->op = SetOp::UNION;
-    combine->left = mesh;
-    combine->right = cyl;
+    if(lx == rx && ly == ry && lz == rz)
+    {
+        // identical packing so the operation can be applied a word at a time
+        voxWordOp(op, leftarg->getWords(), rightarg->getWords(), leftarg->getNumWords());
+    }
+    else
+    {
+        // mismatched volumes fall back to a voxel by voxel walk, with voxels outside rightarg treated as empty
+        cerr << "Warning Scene::voxSetOp: volume dimensions do not match, using per voxel evaluation" << endl;
+        for(i = 0; i < lx; i++)
+            for(j = 0; j < ly; j++)
+                for(k = 0; k < lz; k++)
+                {
+                    left = leftarg->get(i, j, k);
+                    right = rightarg->get(i, j, k);
+                    switch(op)
+                    {
+                    case SetOp::UNION: result = left || right; break;
+                    case SetOp::INTERSECTION: result = left && right; break;
+                    default: result = left && !right; break;
+                    }
+                    leftarg->set(i, j, k, result);
+                }
+    }
+}
 
-    OpNode * diff = new OpNode();
-    diff->op = SetOp::DIFFERENCE;
-    diff->left = combine;
-    diff->right = mesh;
+// public entry point onto voxSetOp for testing purposes
+void Scene::voxSetOp2(SetOp op, VoxelVolume *leftarg, VoxelVolume *rightarg)
+{
+    voxSetOp(op, leftarg, rightarg);
+}
 
-    csgroot = diff;
+void Scene::voxSetOp(SetOp op, SparseVoxelVolume *leftarg, SparseVoxelVolume *rightarg)
+{
+    leftarg->combine(op, rightarg);
 }
 
-SceneNode* Scene::getRoot(){
-	return csgroot;
+// gets all opnode ops into a vector
+void Scene::traverseTree2(SceneNode* root, vector<OpNode *> & leaves){
+	if (dynamic_cast<OpNode*>(root) != NULL){
+		traverseTree2(dynamic_cast<OpNode*>(root)->left,leaves);
+		traverseTree2(dynamic_cast<OpNode*>(root)->right,leaves);
+		leaves.push_back(dynamic_cast<OpNode*>(root));
+	} 
+}
+
+void Scene::setThreads(int threads)
+{
+    if(threads <= 0)
+        threads = max(1, (int) std::thread::hardware_concurrency());
+    numthreads = threads;
+}
+
+ThreadPool * Scene::getPool()
+{
+    if(pool != NULL && pool->getNumThreads() != numthreads)
+    {
+        delete pool;
+        pool = NULL;
+    }
+    if(pool == NULL)
+        pool = new ThreadPool(numthreads);
+    return pool;
+}
+
+void Scene::voxLeaf(BaseShape * shape, VoxelVolume * vox, int xstart, int xend, std::uint64_t * slabwords)
+{
+    int i, j, ydim, zdim, xdim, zwords, lo[3], hi[3];
+    long slabsize;
+    std::vector<float> spans;
+
+    vox->getDim(xdim, ydim, zdim);
+    zwords = vox->getColumnWords();
+    if(slabwords == NULL)
+        slabwords = vox->getWords(vox->getWordIndex(xstart, 0, 0));
+
+    // everything outside the shape bounds is empty, so only sweep the voxels the bounds can touch
+    slabsize = vox->getWordIndex(xend, 0, 0) - vox->getWordIndex(xstart, 0, 0);
+    memset(slabwords, 0, sizeof(std::uint64_t) * slabsize);
+    if(!vox->getBoxRange(shape->getBounds(), lo, hi))
+        return;
+
+    for(i = max(xstart, lo[0]); i < min(xend, hi[0]+1); i++)
+        for(j = lo[1]; j <= hi[1]; j++)
+            voxColumn(shape, vox, i, j, lo[2], hi[2], &slabwords[((long) (i - xstart) * (long) ydim + (long) j) * (long) zwords], spans);
+}
+
+void Scene::voxColumn(BaseShape * shape, VoxelVolume * vox, int x, int y, int zlo, int zhi, std::uint64_t * col, std::vector<float> &spans)
+{
+    int s, k, kstart, kend, xdim, ydim, zdim;
+    cgp::Point corner, pnt;
+    cgp::Vector diag;
+    double cellz;
+
+    // shapes with column spans fill a z interval at a time, voxel k has its centre at corner + (k + 0.5) * cell
+    vox->getFrame(corner, diag);
+    vox->getDim(xdim, ydim, zdim);
+    if(shape->hasColumnSpans() && diag.k > 0.0f)
+    {
+        pnt = vox->getVoxelPos(x, y, 0);
+        if(shape->columnSpans(pnt.x, pnt.y, spans))
+        {
+            cellz = (double) diag.k / (double) zdim;
+            for(s = 0; s+1 < (int) spans.size(); s += 2)
+            {
+                kstart = (int) max((double) zlo, ceil(((double) spans[s] - corner.z) / cellz - 0.5));
+                kend = (int) min((double) zhi, floor(((double) spans[s+1] - corner.z) / cellz - 0.5));
+                setColumnSpan(col, kstart, kend);
+            }
+            return;
+        }
+    }
+
+    // no spans for this column so test each voxel centre
+    for(k = zlo; k <= zhi; k++)
+        if(shape->pointContainment(vox->getVoxelPos(x, y, k)))
+            col[k >> 6] |= ((std::uint64_t) 1) << (k & 63);
+}
+
+VoxelVolume * Scene::voxCombine(SceneNode * root, int &leafidx, std::vector<int> &leafgrid, std::vector<int> &uses)
+{
+    VoxelVolume * leftvox, * rightvox, * copy;
+    int g;
+
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        // a grid shared by identical leaves is copied for all but its last use, since results are accumulated in place
+        g = leafgrid[leafidx++];
+        if(--uses[g] == 0)
+            return voxVols[g];
+        copy = new VoxelVolume();
+        copyVolume(voxVols[g], copy);
+        voxVols.push_back(copy);
+        return copy;
+    }
+    else if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+        leftvox = voxCombine(opnode->left, leafidx, leafgrid, uses);
+        rightvox = voxCombine(opnode->right, leafidx, leafgrid, uses);
+        voxSetOp(opnode->op, leftvox, rightvox);
+        return leftvox;
+    }
+    return NULL;
+}
+
+void Scene::voxWalk(SceneNode *root, VoxelVolume *voxels)
+{
+    std::vector<ShapeNode *> leaves, unique;
+    std::vector<std::pair<int, int>> jobs;
+    std::vector<int> leafgrid, uses;
+    int l, u, s, xdim, ydim, zdim, slab, leafidx;
+    cgp::Point corner;
+    cgp::Vector diag;
+    VoxelVolume * result;
+    ThreadPool * workers;
+
+    traverseTree(root, leaves);
+    if(leaves.empty())
+        return;
+
+    // release grids left over from a previous evaluation
+    for(l = 0; l < (int) voxVols.size(); l++)
+        delete voxVols[l];
+    voxVols.clear();
+
+    // one grid per distinct leaf node, matching the output volume exactly
+    voxels->getDim(xdim, ydim, zdim);
+    voxels->getFrame(corner, diag);
+    for(l = 0; l < (int) leaves.size(); l++)
+    {
+        u = (int) (find(unique.begin(), unique.end(), leaves[l]) - unique.begin());
+        if(u == (int) unique.size())
+        {
+            unique.push_back(leaves[l]);
+            uses.push_back(0);
+            voxVols.push_back(new VoxelVolume(xdim, ydim, zdim, corner, diag));
+            leaves[l]->shape->prepareQueries(); // lazily built structures are not thread safe
+        }
+        leafgrid.push_back(u);
+        uses[u]++;
+    }
+
+    // split every leaf into x-slabs, so that independent leaves and slabs of the same leaf run together
+    workers = getPool();
+    slab = max(1, xdim / (4 * workers->getNumThreads()));
+    for(l = 0; l < (int) unique.size(); l++)
+        for(s = 0; s < xdim; s += slab)
+            jobs.push_back(std::pair<int, int>(l, s));
+
+    voxBeginProgress((long) xdim * (long) unique.size());
+    workers->parallelFor(0, (int) jobs.size(), 1, [&](int jstart, int jend)
+    {
+        for(int j = jstart; j < jend && !voxCancelled(); j++)
+        {
+            voxLeaf(unique[jobs[j].first]->shape, voxVols[jobs[j].first], jobs[j].second, min(xdim, jobs[j].second + slab));
+            voxAddProgress(min(xdim, jobs[j].second + slab) - jobs[j].second);
+        }
+    });
+
+    // apply set operations bottom up
+    if(!voxCancelled())
+    {
+        leafidx = 0;
+        result = voxCombine(root, leafidx, leafgrid, uses);
+        memcpy(voxels->getWords(), result->getWords(), sizeof(std::uint64_t) * voxels->getNumWords());
+    }
+
+    // leaf grids are only needed while combining
+    for(l = 0; l < (int) voxVols.size(); l++)
+        delete voxVols[l];
+    voxVols.clear();
+}
+
+void Scene::voxSlab(SceneNode * root, VoxelVolume * vox, int xstart, int xend, std::uint64_t * slabwords,
+                    std::vector<std::vector<std::uint64_t>> &scratch, int depth, std::vector<SlabLeaf> &shared)
+{
+    long w, slabsize;
+    int l;
+    bool empty;
+
+    slabsize = vox->getWordIndex(xend, 0, 0) - vox->getWordIndex(xstart, 0, 0);
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        // leaves that occur more than once are evaluated on first use and copied afterwards
+        for(l = 0; l < (int) shared.size(); l++)
+            if(shared[l].first == root)
+            {
+                if(shared[l].second.empty())
+                {
+                    voxLeaf(dynamic_cast<ShapeNode*>(root)->shape, vox, xstart, xend, slabwords);
+                    shared[l].second.assign(slabwords, slabwords + slabsize);
+                }
+                else
+                    memcpy(slabwords, &shared[l].second[0], sizeof(std::uint64_t) * slabsize);
+                return;
+            }
+        voxLeaf(dynamic_cast<ShapeNode*>(root)->shape, vox, xstart, xend, slabwords);
+    }
+    else if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        voxSlab(opnode->left, vox, xstart, xend, slabwords, scratch, depth+1, shared);
+
+        // an empty left operand stays empty under intersection and difference
+        if(opnode->op != SetOp::UNION)
+        {
+            empty = true;
+            for(w = 0; w < slabsize && empty; w++)
+                empty = (slabwords[w] == 0);
+            if(empty)
+                return;
+        }
+
+        if((int) scratch.size() <= depth)
+            scratch.resize(depth+1);
+        scratch[depth].resize(slabsize);
+        voxSlab(opnode->right, vox, xstart, xend, &scratch[depth][0], scratch, depth+1, shared);
+        voxWordOp(opnode->op, slabwords, &scratch[depth][0], slabsize);
+    }
+}
+
+void Scene::voxStream(SceneNode *root, VoxelVolume *voxels)
+{
+    std::vector<ShapeNode *> leaves;
+    std::vector<SlabLeaf> shared;
+    int l, xdim, ydim, zdim, slab;
+    ThreadPool * workers;
+
+    traverseTree(root, leaves);
+    for(l = 0; l < (int) leaves.size(); l++)
+    {
+        leaves[l]->shape->prepareQueries();
+        if(find(leaves.begin(), leaves.begin() + l, leaves[l]) == leaves.begin() + l &&
+           find(leaves.begin() + l + 1, leaves.end(), leaves[l]) != leaves.end()) // first of several uses
+            shared.push_back(SlabLeaf(leaves[l], std::vector<std::uint64_t>()));
+    }
+
+    // thin slabs keep scratch storage small while leaving enough slabs to balance across threads
+    voxels->getDim(xdim, ydim, zdim);
+    workers = getPool();
+    slab = max(1, min(8, xdim / (4 * workers->getNumThreads())));
+
+    voxBeginProgress(xdim);
+    workers->parallelFor(0, xdim, slab, [&](int xstart, int xend)
+    {
+        std::vector<std::vector<std::uint64_t>> scratch; // owned by this slab, freed on completion
+        std::vector<SlabLeaf> slabshared = shared;
+        if(voxCancelled())
+            return;
+        voxSlab(root, voxels, xstart, xend, voxels->getWords(voxels->getWordIndex(xstart, 0, 0)), scratch, 0, slabshared);
+        voxAddProgress(xend - xstart);
+    });
+}
+
+void Scene::voxProgram(SceneNode *root, VoxelVolume *voxels)
+{
+    std::vector<ShapeNode *> leaves;
+    CSGProgram prog;
+    int l, xdim, ydim, zdim, slab;
+    ThreadPool * workers;
+
+    if(!prog.compile(root)) // malformed trees are still walked, as far as treeContainment understands them
+    {
+        traverseTree(root, leaves);
+        for(l = 0; l < (int) leaves.size(); l++)
+            leaves[l]->shape->prepareQueries();
+    }
+
+    voxels->getDim(xdim, ydim, zdim);
+    workers = getPool();
+    slab = max(1, min(8, xdim / (4 * workers->getNumThreads())));
+
+    voxBeginProgress(xdim);
+    workers->parallelFor(0, xdim, slab, [&](int xstart, int xend)
+    {
+        std::vector<cgp::Point> pnts(zdim);
+        std::vector<std::uint64_t> stack(prog.getStackWords()); // reused by every column of the slab
+        std::uint64_t * col;
+        cgp::Point base;
+        int x, y, z;
+
+        if(voxCancelled())
+            return;
+
+        // voxel centres are separable, so z is filled once per slab and only x and y per column
+        for(z = 0; z < zdim; z++)
+            pnts[z] = voxels->getVoxelPos(0, 0, z);
+        for(x = xstart; x < xend; x++)
+            for(y = 0; y < ydim; y++)
+            {
+                col = voxels->getColumn(x, y);
+                base = voxels->getVoxelPos(x, y, 0);
+                for(z = 0; z < zdim; z++)
+                {
+                    pnts[z].x = base.x;
+                    pnts[z].y = base.y;
+                }
+                if(!prog.empty())
+                    prog.evaluate(&pnts[0], zdim, col, &stack[0]);
+                else
+                    for(z = 0; z < zdim; z++)
+                        if(treeContainment(root, pnts[z]))
+                            col[z >> 6] |= 1ull << (z & 63);
+            }
+        voxAddProgress(xend - xstart);
+    });
+}
+
+std::uint64_t Scene::hashTree(SceneNode * root, std::uint64_t layout, std::unordered_map<SceneNode *, std::uint64_t> &hashes)
+{
+    std::uint64_t h, parts[3];
+
+    if(hashes.count(root) > 0) // shared nodes are hashed once
+        return hashes[root];
+    h = layout;
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        parts[0] = dynamic_cast<ShapeNode*>(root)->shape->contentHash();
+        h = hashBytes(parts, sizeof(std::uint64_t), layout);
+    }
+    else if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        parts[0] = (std::uint64_t) opnode->op;
+        parts[1] = hashTree(opnode->left, layout, hashes);
+        parts[2] = hashTree(opnode->right, layout, hashes);
+        h = hashBytes(parts, sizeof(parts), layout);
+    }
+    hashes[root] = h;
+    return h;
+}
+
+void Scene::voxCachedNode(SceneNode * root, std::unordered_map<SceneNode *, std::uint64_t> &hashes, VoxelVolume * vox)
+{
+    int xdim, ydim, zdim;
+    cgp::Point corner;
+    cgp::Vector diag;
+    ThreadPool * workers;
+    std::vector<ShapeNode *> leaves;
+
+    vox->getDim(xdim, ydim, zdim);
+    if(voxcache.find(hashes[root], vox))
+    {
+        traverseTree(root, leaves); // progress is counted in leaf slices
+        voxAddProgress((long) xdim * (long) leaves.size());
+        return;
+    }
+
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        BaseShape * shape = dynamic_cast<ShapeNode*>(root)->shape;
+
+        shape->prepareQueries();
+        workers = getPool();
+        workers->parallelFor(0, xdim, max(1, xdim / (4 * workers->getNumThreads())), [&](int xstart, int xend)
+        {
+            if(voxCancelled())
+                return;
+            voxLeaf(shape, vox, xstart, xend);
+            voxAddProgress(xend - xstart);
+        });
+    }
+    else if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        voxCachedNode(opnode->left, hashes, vox);
+
+        // an empty left operand stays empty under intersection and difference
+        if(opnode->op == SetOp::UNION || vox->count() > 0)
+        {
+            vox->getFrame(corner, diag);
+            VoxelVolume right(xdim, ydim, zdim, corner, diag);
+            voxCachedNode(opnode->right, hashes, &right);
+            voxSetOp(opnode->op, vox, &right);
+        }
+        else
+        {
+            traverseTree(opnode->right, leaves); // skipped operand counts as done
+            voxAddProgress((long) xdim * (long) leaves.size());
+        }
+    }
+    if(voxCancelled()) // incomplete results must never be reused
+        return;
+    voxcache.insert(hashes[root], vox);
+}
+
+void Scene::voxCached(SceneNode *root, VoxelVolume *voxels)
+{
+    std::unordered_map<SceneNode *, std::uint64_t> hashes;
+    std::vector<ShapeNode *> leaves;
+    std::uint64_t layout;
+    int dims[3];
+    float frame[6];
+    cgp::Point corner;
+    cgp::Vector diag;
+    long hits, misses;
+
+    voxels->getDim(dims[0], dims[1], dims[2]);
+    voxels->getFrame(corner, diag);
+    frame[0] = corner.x; frame[1] = corner.y; frame[2] = corner.z;
+    frame[3] = diag.i; frame[4] = diag.j; frame[5] = diag.k;
+    layout = hashBytes(frame, sizeof(frame), hashBytes(dims, sizeof(dims)));
+    hashTree(root, layout, hashes);
+
+    traverseTree(root, leaves);
+    voxBeginProgress((long) dims[0] * (long) leaves.size());
+    hits = voxcache.getHits(); misses = voxcache.getMisses();
+    voxCachedNode(root, hashes, voxels);
+    cerr << "Voxel cache: " << voxcache.getHits() - hits << " hits, " << voxcache.getMisses() - misses << " misses, "
+         << voxcache.size() << " entries using " << voxcache.getUsed() / (1 << 20) << " of " << voxcache.getBudget() / (1 << 20) << " MB" << endl;
+}
+
+CellClass Scene::classifyCell(SceneNode * root, cgp::BoundBox box)
+{
+    CellClass left, right;
+
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+        return dynamic_cast<ShapeNode*>(root)->shape->classifyBox(box);
+
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        // the right operand is only classified if the left does not already decide the result
+        left = classifyCell(opnode->left, box);
+        switch(opnode->op)
+        {
+        case SetOp::UNION:
+            if(left == CellClass::INSIDE)
+                return CellClass::INSIDE;
+            right = classifyCell(opnode->right, box);
+            if(right == CellClass::INSIDE)
+                return CellClass::INSIDE;
+            if(left == CellClass::OUTSIDE && right == CellClass::OUTSIDE)
+                return CellClass::OUTSIDE;
+            break;
+        case SetOp::INTERSECTION:
+            if(left == CellClass::OUTSIDE)
+                return CellClass::OUTSIDE;
+            right = classifyCell(opnode->right, box);
+            if(right == CellClass::OUTSIDE)
+                return CellClass::OUTSIDE;
+            if(left == CellClass::INSIDE && right == CellClass::INSIDE)
+                return CellClass::INSIDE;
+            break;
+        case SetOp::DIFFERENCE:
+            if(left == CellClass::OUTSIDE)
+                return CellClass::OUTSIDE;
+            right = classifyCell(opnode->right, box);
+            if(right == CellClass::INSIDE)
+                return CellClass::OUTSIDE;
+            if(left == CellClass::INSIDE && right == CellClass::OUTSIDE)
+                return CellClass::INSIDE;
+            break;
+        }
+    }
+    return CellClass::BOUNDARY;
+}
+
+bool Scene::treeContainment(SceneNode * root, cgp::Point pnt)
+{
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+        return dynamic_cast<ShapeNode*>(root)->shape->pointContainment(pnt);
+
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        switch(opnode->op)
+        {
+        case SetOp::UNION:
+            return treeContainment(opnode->left, pnt) || treeContainment(opnode->right, pnt);
+        case SetOp::INTERSECTION:
+            return treeContainment(opnode->left, pnt) && treeContainment(opnode->right, pnt);
+        case SetOp::DIFFERENCE:
+            return treeContainment(opnode->left, pnt) && !treeContainment(opnode->right, pnt);
+        }
+    }
+    return false;
+}
+
+bool Scene::pointContainment(cgp::Point pnt)
+{
+    if(csgroot == NULL)
+        return false;
+    return treeContainment(csgroot, pnt);
+}
+
+float Scene::treeDistance(SceneNode * root, cgp::Point pnt)
+{
+    float left, right;
+
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+        return dynamic_cast<ShapeNode*>(root)->shape->signedDistance(pnt);
+
+    if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        left = treeDistance(opnode->left, pnt);
+        right = treeDistance(opnode->right, pnt);
+        switch(opnode->op)
+        {
+        case SetOp::UNION:
+            return min(left, right);
+        case SetOp::INTERSECTION:
+            return max(left, right);
+        case SetOp::DIFFERENCE:
+            return max(left, -right);
+        }
+    }
+    return HUGE_VALF;
+}
+
+float Scene::signedDistance(cgp::Point pnt)
+{
+    if(csgroot == NULL)
+        return HUGE_VALF;
+    return treeDistance(csgroot, pnt);
+}
+
+void Scene::classifyLeaves(SceneNode * root, cgp::BoundBox box, std::vector<CellClass> &leafclass)
+{
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        leafclass.push_back(dynamic_cast<ShapeNode*>(root)->shape->classifyBox(box));
+    }
+    else if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        classifyLeaves(dynamic_cast<OpNode*>(root)->left, box, leafclass);
+        classifyLeaves(dynamic_cast<OpNode*>(root)->right, box, leafclass);
+    }
+}
+
+void Scene::voxCellColumn(SceneNode * root, VoxelVolume * vox, int x, int y, int zlo, int zhi, std::vector<CellClass> &leafclass,
+                          int &leafidx, std::uint64_t * col, std::vector<std::vector<std::uint64_t>> &scratch, int depth, std::vector<float> &spans)
+{
+    int wlo = zlo >> 6, whi = zhi >> 6;
+
+    if(dynamic_cast<ShapeNode*>(root) != NULL)
+    {
+        memset(&col[wlo], 0, sizeof(std::uint64_t) * (whi - wlo + 1));
+        switch(leafclass[leafidx++])
+        {
+        case CellClass::INSIDE:
+            setColumnSpan(col, zlo, zhi);
+            break;
+        case CellClass::BOUNDARY:
+            voxColumn(dynamic_cast<ShapeNode*>(root)->shape, vox, x, y, zlo, zhi, col, spans);
+            break;
+        case CellClass::OUTSIDE:
+            break;
+        }
+    }
+    else if(dynamic_cast<OpNode*>(root) != NULL)
+    {
+        OpNode * opnode = dynamic_cast<OpNode*>(root);
+
+        voxCellColumn(opnode->left, vox, x, y, zlo, zhi, leafclass, leafidx, col, scratch, depth+1, spans);
+        if((int) scratch.size() <= depth)
+            scratch.resize(depth+1);
+        scratch[depth].resize(vox->getColumnWords());
+        voxCellColumn(opnode->right, vox, x, y, zlo, zhi, leafclass, leafidx, &scratch[depth][0], scratch, depth+1, spans);
+        voxWordOp(opnode->op, &col[wlo], &scratch[depth][wlo], whi - wlo + 1);
+    }
+}
+
+void Scene::voxOctreeCell(SceneNode * root, std::vector<ShapeNode *> &leaves, VoxelVolume * vox, const int lo[3], const int hi[3], float eps,
+                          std::vector<std::vector<std::uint64_t>> &scratch, std::vector<std::uint64_t> &cellcol)
+{
+    std::vector<CellClass> leafclass;
+    std::vector<float> spans;
+    cgp::BoundBox box;
+    CellClass cls;
+    std::uint64_t * col;
+    int x, y, w, a, c, leafidx, mid[3], clo[3], chi[3];
+    bool leaf, nonempty, splitz;
+
+    // classification only needs to hold at the voxel centres of the cell
+    box.includePnt(vox->getVoxelPos(lo[0], lo[1], lo[2]));
+    box.includePnt(vox->getVoxelPos(hi[0]-1, hi[1]-1, hi[2]-1));
+    box.expand(eps);
+    cls = classifyCell(root, box);
+
+    if(cls == CellClass::OUTSIDE)
+        return;
+
+    if(cls == CellClass::INSIDE)
+    {
+        for(x = lo[0]; x < hi[0]; x++)
+            for(y = lo[1]; y < hi[1]; y++)
+                setColumnSpan(vox->getColumn(x, y), lo[2], hi[2]-1);
+        return;
+    }
+
+    // leaves with column spans fill a whole column at once, so splitting along z only pays off for
+    // boundary leaves that fall back on testing individual voxels
+    classifyLeaves(root, box, leafclass);
+    splitz = false;
+    if(hi[2] - lo[2] > octleafsize)
+        for(c = 0; c < (int) leafclass.size() && !splitz; c++)
+            if(leafclass[c] == CellClass::BOUNDARY && !leaves[c]->shape->hasColumnSpans())
+                splitz = true;
+    leaf = (hi[0] - lo[0] <= octleafsize && hi[1] - lo[1] <= octleafsize && !splitz);
+
+    if(leaf)
+    {
+        for(x = lo[0]; x < hi[0]; x++)
+            for(y = lo[1]; y < hi[1]; y++)
+            {
+                leafidx = 0;
+                voxCellColumn(root, vox, x, y, lo[2], hi[2]-1, leafclass, leafidx, &cellcol[0], scratch, 0, spans);
+                col = vox->getColumn(x, y);
+                for(w = lo[2] >> 6; w <= (hi[2]-1) >> 6; w++)
+                    col[w] |= cellcol[w];
+            }
+        return;
+    }
+
+    // split x and y while they are longer than a leaf cell, and z only when required
+    for(a = 0; a < 2; a++)
+        mid[a] = (hi[a] - lo[a] > octleafsize) ? (lo[a] + hi[a]) / 2 : hi[a];
+    mid[2] = splitz ? (lo[2] + hi[2]) / 2 : hi[2];
+    for(c = 0; c < 8; c++)
+    {
+        nonempty = true;
+        for(a = 0; a < 3; a++)
+        {
+            clo[a] = (c & (1 << a)) ? mid[a] : lo[a];
+            chi[a] = (c & (1 << a)) ? hi[a] : mid[a];
+            if(clo[a] >= chi[a])
+                nonempty = false;
+        }
+        if(nonempty)
+            voxOctreeCell(root, leaves, vox, clo, chi, eps, scratch, cellcol);
+    }
+}
+
+void Scene::voxOctree(SceneNode *root, VoxelVolume *voxels)
+{
+    std::vector<ShapeNode *> leaves;
+    int l, xdim, ydim, zdim, slab;
+    cgp::Point corner;
+    cgp::Vector diag;
+    ThreadPool * workers;
+    float eps;
+
+    traverseTree(root, leaves);
+    for(l = 0; l < (int) leaves.size(); l++)
+        leaves[l]->shape->prepareQueries();
+
+    voxels->fill(false);
+    voxels->getDim(xdim, ydim, zdim);
+    if(xdim <= 0 || ydim <= 0 || zdim <= 0)
+        return;
+
+    // a small fraction of a voxel keeps inside and outside decisions clear of rounding at the surface
+    voxels->getFrame(corner, diag);
+    eps = 1.0e-3f * min(diag.i / (float) xdim, min(diag.j / (float) ydim, diag.k / (float) zdim));
+
+    // slabs own disjoint words, so each can be subdivided independently
+    workers = getPool();
+    slab = max(octleafsize, xdim / (4 * workers->getNumThreads()));
+    voxBeginProgress(xdim);
+    workers->parallelFor(0, xdim, slab, [&](int xstart, int xend)
+    {
+        std::vector<std::vector<std::uint64_t>> scratch;
+        std::vector<std::uint64_t> cellcol(voxels->getColumnWords());
+        int lo[3] = {xstart, 0, 0}, hi[3] = {xend, ydim, zdim};
+        if(voxCancelled())
+            return;
+        voxOctreeCell(root, leaves, voxels, lo, hi, eps, scratch, cellcol);
+        voxAddProgress(xend - xstart);
+    });
+}
+
+
+/// Corners joined by each cube edge, with corner bits 0, 1, 2 giving the x, y, z offset. Edges 4a to 4a+3 run along axis a.
+static const int mcedgecorners[12][2] = {{0, 1}, {2, 3}, {4, 5}, {6, 7}, {0, 2}, {1, 3}, {4, 6}, {5, 7}, {0, 4}, {1, 5}, {2, 6}, {3, 7}};
+
+/**
+ * Padded bit lattice over a voxel volume for surface extraction. Lattice point (px, py, pz) is the centre of voxel
+ * (px-1, py-1, pz-1), with a layer of empty points all round so that extracted surfaces are closed. Planes of the
+ * lattice are bit packed along z like the volume, ly columns of sw words each.
+ */
+struct VoxLattice
+{
+    VoxelVolume * voxels;   ///< volume being extracted
+    int lx, ly, lz;         ///< lattice dimensions, two more than the volume
+    int sw;                 ///< words per lattice column
+    cgp::Point corner;      ///< minimum corner of the volume
+    cgp::Vector cell;       ///< voxel side lengths
+
+    VoxLattice(VoxelVolume * vol)
+    {
+        int xdim, ydim, zdim;
+        cgp::Vector diag;
+
+        voxels = vol;
+        voxels->getDim(xdim, ydim, zdim);
+        voxels->getFrame(corner, diag);
+        lx = xdim + 2; ly = ydim + 2; lz = zdim + 2;
+        sw = (lz + 63) / 64;
+        cell = cgp::Vector(diag.i / (float) max(1, xdim), diag.j / (float) max(1, ydim), diag.k / (float) max(1, zdim));
+    }
+
+    /// Fill plane px of the lattice, which is empty outside the volume
+    void plane(int px, std::vector<std::uint64_t> &out) const
+    {
+        const std::uint64_t * col;
+        int py, w, zwords = voxels->getColumnWords();
+
+        out.assign((std::size_t) ly * sw, 0);
+        if(px < 1 || px > lx - 2)
+            return;
+        for(py = 1; py < ly - 1; py++)
+        {
+            col = voxels->getColumn(px - 1, py - 1);
+            for(w = 0; w < sw; w++)
+                out[(std::size_t) py * sw + w] = ((w < zwords) ? col[w] << 1 : 0) | ((w >= 1 && w - 1 < zwords) ? col[w-1] >> 63 : 0);
+        }
+    }
+
+    /// Crossings of the lattice edges leaving column py of plane cur along axis, where nxt is the following plane
+    std::uint64_t edgeMask(const std::vector<std::uint64_t> &cur, const std::vector<std::uint64_t> &nxt, int py, int axis, int w) const
+    {
+        const std::uint64_t * c = &cur[(std::size_t) py * sw];
+
+        if(axis == 0)
+            return c[w] ^ nxt[(std::size_t) py * sw + w];
+        else if(axis == 1)
+            return (py + 1 < ly) ? c[w] ^ c[sw + w] : (std::uint64_t) 0;
+        else
+            return c[w] ^ ((c[w] >> 1) | ((w + 1 < sw) ? c[w+1] << 63 : (std::uint64_t) 0));
+    }
+
+    /**
+     * Cubes of a row whose eight corners are not all alike
+     * @param cc    columns (x, y), (x+1, y), (x, y+1), (x+1, y+1) of the two planes bounding the row
+     * @param w     word of the row
+     * @returns bit pz set for each mixed cube with lower corner pz in this word
+     */
+    std::uint64_t mixedCubes(const std::uint64_t * const cc[4], int w) const
+    {
+        std::uint64_t o, m, onext = 0, mnext = 0;
+
+        o = cc[0][w] | cc[1][w] | cc[2][w] | cc[3][w];
+        m = o ^ (cc[0][w] & cc[1][w] & cc[2][w] & cc[3][w]);
+        if(w + 1 < sw)
+        {
+            onext = cc[0][w+1] | cc[1][w+1] | cc[2][w+1] | cc[3][w+1];
+            mnext = onext ^ (cc[0][w+1] & cc[1][w+1] & cc[2][w+1] & cc[3][w+1]);
+        }
+        return m | (m >> 1) | (mnext << 63) | (o ^ ((o >> 1) | (onext << 63)));
+    }
+
+    /// Corner configuration of the cube with lower corner pz in a row, with bit c set for occupied corner c
+    int cubeConfig(const std::uint64_t * const cc[4], int pz) const
+    {
+        int c, cfg = 0;
+
+        for(c = 0; c < 8; c++)
+            cfg |= (int) ((cc[c & 3][(pz + (c >> 2)) >> 6] >> ((pz + (c >> 2)) & 63)) & 1) << c;
+        return cfg;
+    }
+
+    /// Position of a point in lattice coordinates
+    cgp::Point point(float px, float py, float pz) const
+    {
+        return cgp::Point(corner.x + (px - 0.5f) * cell.i, corner.y + (py - 0.5f) * cell.j, corner.z + (pz - 0.5f) * cell.k);
+    }
+
+    /// Midpoint of the lattice edge leaving (px, py, pz) along axis
+    cgp::Point edgePoint(int px, int py, int pz, int axis) const
+    {
+        return point((float) px + ((axis == 0) ? 0.5f : 0.0f), (float) py + ((axis == 1) ? 0.5f : 0.0f), (float) pz + ((axis == 2) ? 0.5f : 0.0f));
+    }
+};
+
+/**
+ * Surface loops through the edges of a marching cubes cell, for each of the 256 corner configurations
+ */
+struct MCLoops
+{
+    std::vector<std::vector<int>> loops[256];   ///< closed loops of crossed cube edges
+    int edgeloop[256][12];                      ///< loop through each cube edge, -1 where the edge is not crossed
+    int faceedges[6][4];                        ///< edges around each cube face counter-clockwise from outside
+};
+
+/**
+ * Build the surface loops of every cube configuration. On each cube face, occupied corners are kept apart when
+ * diagonally opposite, a rule that depends only on the face so both cubes sharing it agree, and the resulting
+ * face segments chain into closed loops.
+ * @param[out] mcl  loops by configuration
+ */
+static void buildMCLoops(MCLoops &mcl)
+{
+    int q[4], next[12], f, a, u, v, i, j, k, c, e, n, cfg;
+    float ang[4];
+    bool inside[8];
+
+    // the edges of each face in counter-clockwise order seen from outside the cube
+    for(f = 0; f < 6; f++)
+    {
+        a = f / 2;
+        u = (f % 2 == 1) ? (a + 1) % 3 : (a + 2) % 3;
+        v = (f % 2 == 1) ? (a + 2) % 3 : (a + 1) % 3;
+        n = 0;
+        for(c = 0; c < 8; c++)
+            if(((c >> a) & 1) == f % 2)
+            {
+                q[n] = c;
+                ang[n] = atan2f((float) ((c >> v) & 1) - 0.5f, (float) ((c >> u) & 1) - 0.5f);
+                n++;
+            }
+        for(i = 0; i < 4; i++)
+            for(j = i + 1; j < 4; j++)
+                if(ang[j] < ang[i])
+                {
+                    std::swap(ang[i], ang[j]);
+                    std::swap(q[i], q[j]);
+                }
+        for(i = 0; i < 4; i++)
+            for(e = 0; e < 12; e++)
+                if((mcedgecorners[e][0] == q[i] && mcedgecorners[e][1] == q[(i + 1) % 4]) ||
+                   (mcedgecorners[e][1] == q[i] && mcedgecorners[e][0] == q[(i + 1) % 4]))
+                    mcl.faceedges[f][i] = e;
+    }
+
+    auto faceCorner = [&](int g, int i)
+    {
+        // corner shared by edges i-1 and i of face g, which starts edge i
+        int e0 = mcl.faceedges[g][(i + 3) % 4], e1 = mcl.faceedges[g][i];
+        return (mcedgecorners[e1][0] == mcedgecorners[e0][0] || mcedgecorners[e1][0] == mcedgecorners[e0][1]) ? mcedgecorners[e1][0] : mcedgecorners[e1][1];
+    };
+
+    for(cfg = 0; cfg < 256; cfg++)
+    {
+        for(c = 0; c < 8; c++)
+            inside[c] = ((cfg >> c) & 1) != 0;
+
+        // on each face, a segment enters the occupied region and leaves at the next crossing counter-clockwise
+        for(e = 0; e < 12; e++)
+        {
+            next[e] = -1;
+            mcl.edgeloop[cfg][e] = -1;
+        }
+        for(f = 0; f < 6; f++)
+            for(i = 0; i < 4; i++)
+                if(!inside[faceCorner(f, i)] && inside[faceCorner(f, (i + 1) % 4)])
+                    for(j = 1; j < 4; j++)
+                        if(inside[faceCorner(f, (i + j) % 4)] && !inside[faceCorner(f, (i + j + 1) % 4)])
+                        {
+                            next[mcl.faceedges[f][i]] = mcl.faceedges[f][(i + j) % 4];
+                            break;
+                        }
+
+        for(e = 0; e < 12; e++)
+        {
+            if(next[e] < 0 || mcl.edgeloop[cfg][e] >= 0)
+                continue;
+            mcl.loops[cfg].push_back(std::vector<int>());
+            for(k = e; mcl.edgeloop[cfg][k] < 0; k = next[k])
+            {
+                mcl.edgeloop[cfg][k] = (int) mcl.loops[cfg].size() - 1;
+                mcl.loops[cfg].back().push_back(k);
+            }
+        }
+    }
+}
+
+/// Loops of every cube configuration, built on first use
+static const MCLoops & mcLoops()
+{
+    static const MCLoops mcl = [](){ MCLoops built; buildMCLoops(built); return built; }();
+    return mcl;
+}
+
+/**
+ * Build the marching cubes table. Each loop is fanned from a vertex whose diagonals cross the cube interior, so
+ * that no triangle edge can be generated from both sides of a face.
+ * @returns triples of cube edges for each of the 256 corner configurations
+ */
+static std::vector<std::vector<int>> buildMCTable()
+{
+    const MCLoops &mcl = mcLoops();
+    std::vector<std::vector<int>> table(256);
+    int a, i, r, n, cfg, tmp;
+    float p[3][3], nrm;
+    bool ok;
+
+    auto shareFace = [&](int e1, int e2)
+    {
+        for(int g = 0; g < 6; g++)
+            if(std::find(mcl.faceedges[g], mcl.faceedges[g] + 4, e1) != mcl.faceedges[g] + 4 &&
+               std::find(mcl.faceedges[g], mcl.faceedges[g] + 4, e2) != mcl.faceedges[g] + 4)
+                return true;
+        return false;
+    };
+
+    for(cfg = 0; cfg < 256; cfg++)
+        for(const std::vector<int> &loop : mcl.loops[cfg])
+        {
+            n = (int) loop.size();
+
+            // fan from a vertex whose diagonals all cross the interior, so that none can lie on a face. Keeping
+            // occupied corners apart leaves at most one loop of six edges, around a lone empty corner, and there
+            // alternate vertices qualify.
+            for(r = 0; r < n; r++)
+            {
+                ok = true;
+                for(i = 2; i <= n - 2 && ok; i++)
+                    ok = !shareFace(loop[r], loop[(r + i) % n]);
+                if(ok)
+                    break;
+            }
+            if(r == n)
+                cerr << "Error buildMCTable: no interior fan for configuration " << cfg << endl;
+            for(i = 1; i <= n - 2; i++)
+            {
+                table[cfg].push_back(loop[r % n]);
+                table[cfg].push_back(loop[(r + i) % n]);
+                table[cfg].push_back(loop[(r + i + 1) % n]);
+            }
+        }
+
+    // the winding follows from the face orientation, so check it once against a single occupied corner, whose
+    // triangle should face away from it, and reverse every triangle if need be
+    for(i = 0; i < 3; i++)
+        for(a = 0; a < 3; a++)
+            p[i][a] = 0.5f * (float) (((mcedgecorners[table[1][i]][0] >> a) & 1) + ((mcedgecorners[table[1][i]][1] >> a) & 1));
+    nrm = 0.0f;
+    for(a = 0; a < 3; a++)
+        nrm += (p[1][(a+1)%3] - p[0][(a+1)%3]) * (p[2][(a+2)%3] - p[0][(a+2)%3]) - (p[1][(a+2)%3] - p[0][(a+2)%3]) * (p[2][(a+1)%3] - p[0][(a+1)%3]);
+    if(nrm < 0.0f)
+        for(cfg = 0; cfg < 256; cfg++)
+            for(i = 0; i < (int) table[cfg].size(); i += 3)
+            {
+                tmp = table[cfg][i+1];
+                table[cfg][i+1] = table[cfg][i+2];
+                table[cfg][i+2] = tmp;
+            }
+    return table;
+}
+
+void Scene::marchingCubes(VoxelVolume * voxels, Mesh * mesh)
+{
+    static const std::vector<std::vector<int>> mctable = buildMCTable();
+    const VoxLattice lat(voxels);
+    std::vector<std::vector<Triangle>> slabtris;
+    std::vector<long> planebase;
+    std::vector<cgp::Point> verts;
+    std::vector<Triangle> tris;
+    int slab, numslabs, s, x;
+    ThreadPool * workers;
+
+    mesh->clear(); // vertices are extracted in world space, so any previous transform no longer applies
+    if(voxels->getNumWords() == 0)
+    {
+        mesh->setGeometry(verts, tris);
+        return;
+    }
+    workers = getPool();
+    slab = max(1, (lat.lx - 1) / (4 * workers->getNumThreads()));
+    numslabs = (lat.lx - 1 + slab - 1) / slab;
+
+    // first pass counts the vertices owned by each plane, so that every slab can number its own
+    planebase.assign(lat.lx, 0);
+    workers->parallelFor(0, numslabs, 1, [&](int sstart, int send)
+    {
+        std::vector<std::uint64_t> cur, nxt;
+        long count;
+        int px, py, axis, w;
+
+        for(int sl = sstart; sl < send; sl++)
+        {
+            lat.plane(sl * slab, cur);
+            for(px = sl * slab; px < min(lat.lx - 1, (sl + 1) * slab); px++)
+            {
+                lat.plane(px + 1, nxt);
+                count = 0;
+                for(py = 0; py < lat.ly; py++)
+                    for(axis = 0; axis < 3; axis++)
+                        for(w = 0; w < lat.sw; w++)
+                            count += (long) __builtin_popcountll(lat.edgeMask(cur, nxt, py, axis, w));
+                planebase[px + 1] = count;
+                cur.swap(nxt);
+            }
+        }
+    });
+    for(x = 1; x < lat.lx; x++)
+        planebase[x] += planebase[x-1];
+    verts.resize(planebase[lat.lx - 1]);
+
+    // second pass numbers vertices through an edge cache of two planes and triangulates the cubes between them
+    slabtris.resize(numslabs);
+    workers->parallelFor(0, numslabs, 1, [&](int sstart, int send)
+    {
+        std::vector<std::uint64_t> lp[3];
+        std::vector<int> ids[2];
+        std::uint64_t cubes;
+        const std::uint64_t * cc[4];
+        Triangle tri;
+        long id;
+        int px, py, pz, w, t, c, cfg, xstart, xend;
+
+        // vertex indices of the crossings owned by plane qx, with positions written only by the owning slab
+        auto cachePlane = [&](int qx, const std::vector<std::uint64_t> &cur, const std::vector<std::uint64_t> &nxt, std::vector<int> &pid, bool own)
+        {
+            std::uint64_t bits;
+            int qy, qa, qw, qz;
+
+            pid.resize((std::size_t) lat.ly * lat.lz * 3);
+            id = planebase[qx];
+            for(qy = 0; qy < lat.ly; qy++)
+                for(qa = 0; qa < 3; qa++)
+                    for(qw = 0; qw < lat.sw; qw++)
+                        for(bits = lat.edgeMask(cur, nxt, qy, qa, qw); bits != 0; bits &= bits - 1)
+                        {
+                            qz = (qw << 6) + __builtin_ctzll(bits);
+                            pid[((std::size_t) qy * lat.lz + qz) * 3 + qa] = (int) id;
+                            if(own)
+                                verts[id] = lat.edgePoint(qx, qy, qz, qa);
+                            id++;
+                        }
+        };
+        auto edgeVertex = [&](int edge, int qy, int qz)
+        {
+            int c0 = mcedgecorners[edge][0];
+            return ids[c0 & 1][((std::size_t) (qy + ((c0 >> 1) & 1)) * lat.lz + qz + ((c0 >> 2) & 1)) * 3 + edge / 4];
+        };
+
+        for(int sl = sstart; sl < send; sl++)
+        {
+            xstart = sl * slab;
+            xend = min(lat.lx - 1, (sl + 1) * slab);
+            lat.plane(xstart, lp[0]);
+            lat.plane(xstart + 1, lp[1]);
+            cachePlane(xstart, lp[0], lp[1], ids[0], true);
+            for(px = xstart; px < xend; px++)
+            {
+                lat.plane(px + 2, lp[2]);
+                cachePlane(px + 1, lp[1], lp[2], ids[1], px + 1 < xend);
+
+                for(py = 0; py + 1 < lat.ly; py++)
+                {
+                    cc[0] = &lp[0][(std::size_t) py * lat.sw]; cc[1] = &lp[1][(std::size_t) py * lat.sw];
+                    cc[2] = &lp[0][(std::size_t) (py + 1) * lat.sw]; cc[3] = &lp[1][(std::size_t) (py + 1) * lat.sw];
+                    for(w = 0; w < lat.sw; w++)
+                        for(cubes = lat.mixedCubes(cc, w); cubes != 0; cubes &= cubes - 1)
+                        {
+                            pz = (w << 6) + __builtin_ctzll(cubes);
+                            cfg = lat.cubeConfig(cc, pz);
+                            for(t = 0; t < (int) mctable[cfg].size(); t += 3)
+                            {
+                                for(c = 0; c < 3; c++)
+                                    tri.v[c] = edgeVertex(mctable[cfg][t + c], py, pz);
+                                slabtris[sl].push_back(tri);
+                            }
+                        }
+                }
+                lp[0].swap(lp[1]);
+                lp[1].swap(lp[2]);
+                ids[0].swap(ids[1]);
+            }
+        }
+    });
+
+    // gather triangles in slab order, so the result does not depend on the thread count
+    for(s = 0; s < numslabs; s++)
+    {
+        tris.insert(tris.end(), slabtris[s].begin(), slabtris[s].end());
+        std::vector<Triangle>().swap(slabtris[s]);
+    }
+    mesh->setGeometry(verts, tris);
+}
+
+/**
+ * Vertices of a surface nets cell for one corner configuration
+ */
+struct NetCase
+{
+    std::vector<std::vector<int>> vertedges;    ///< crossed cube edges averaged into each vertex
+    int edgevert[12][2];                        ///< vertex of the face segment through each edge, on the face across axis a+1 and a+2
+};
+
+/**
+ * Build the surface nets table from the marching cubes loops. A loop normally gives a single vertex, but one that
+ * crosses the same face twice would join the neighbouring cell by two quads along the same edge, so it is split
+ * into two arcs that each cross a face at most once, with a vertex per arc.
+ * @returns cell vertices for each of the 256 corner configurations
+ */
+static std::vector<NetCase> buildNetTable()
+{
+    const MCLoops &mcl = mcLoops();
+    std::vector<NetCase> table(256);
+    std::vector<int> segface;
+    int cfg, n, i, j, k, f, e, ends[2], split[2], arc;
+    bool distinct;
+
+    // face shared by two edges of a face segment
+    auto commonFace = [&](int e1, int e2)
+    {
+        for(int g = 0; g < 6; g++)
+            if(std::find(mcl.faceedges[g], mcl.faceedges[g] + 4, e1) != mcl.faceedges[g] + 4 &&
+               std::find(mcl.faceedges[g], mcl.faceedges[g] + 4, e2) != mcl.faceedges[g] + 4)
+                return g;
+        return -1;
+    };
+    // whether count segments from first, cyclically, lie on distinct faces
+    auto distinctFaces = [&](int first, int count)
+    {
+        int used = 0;
+        for(int sg = 0; sg < count; sg++)
+        {
+            if(used & (1 << segface[(first + sg) % segface.size()]))
+                return false;
+            used |= 1 << segface[(first + sg) % segface.size()];
+        }
+        return true;
+    };
+
+    for(cfg = 0; cfg < 256; cfg++)
+    {
+        for(e = 0; e < 12; e++)
+            table[cfg].edgevert[e][0] = table[cfg].edgevert[e][1] = -1;
+        for(const std::vector<int> &loop : mcl.loops[cfg])
+        {
+            n = (int) loop.size();
+            segface.resize(n);
+            for(i = 0; i < n; i++)
+                segface[i] = commonFace(loop[i], loop[(i + 1) % n]);
+
+            // segment i runs from edge i to edge i+1, and the second arc, if any, starts at segment split[1]
+            split[0] = 0; split[1] = n;
+            distinct = distinctFaces(0, n);
+            for(i = 0; i < n && !distinct; i++)
+                for(j = i + 1; j < n && !distinct; j++)
+                    if(distinctFaces(i, j - i) && distinctFaces(j, n - j + i))
+                    {
+                        split[0] = i; split[1] = j;
+                        distinct = true;
+                    }
+            if(!distinct)
+                cerr << "Error buildNetTable: no manifold split for configuration " << cfg << endl;
+
+            arc = (int) table[cfg].vertedges.size();
+            table[cfg].vertedges.push_back(std::vector<int>());
+            if(split[1] < n)
+                table[cfg].vertedges.push_back(std::vector<int>());
+            for(k = 0; k < n; k++)
+            {
+                i = (split[0] + k) % n;
+                j = arc + ((split[1] < n && k >= split[1] - split[0]) ? 1 : 0);
+                ends[0] = loop[i];
+                ends[1] = loop[(i + 1) % n];
+                for(e = 0; e < 2; e++)
+                {
+                    f = (segface[i] / 2 == (ends[e] / 4 + 1) % 3) ? 0 : 1;
+                    table[cfg].edgevert[ends[e]][f] = j;
+                    if(std::find(table[cfg].vertedges[j].begin(), table[cfg].vertedges[j].end(), ends[e]) == table[cfg].vertedges[j].end())
+                        table[cfg].vertedges[j].push_back(ends[e]);
+                }
+            }
+        }
+    }
+    return table;
+}
+
+void Scene::surfaceNets(VoxelVolume * voxels, Mesh * mesh)
+{
+    static const std::vector<NetCase> nettable = buildNetTable();
+    const VoxLattice lat(voxels);
+    std::vector<std::vector<Triangle>> slabtris;
+    std::vector<std::vector<cgp::Point>> slabhubs;
+    std::vector<long> planebase, hubbase;
+    std::vector<cgp::Point> verts;
+    std::vector<Triangle> tris;
+    int slab, numslabs, s, x;
+    ThreadPool * workers;
+
+    // cubes around a crossed edge, as offsets along the two other axes, counter-clockwise when seen from the
+    // positive end of the edge, so that consecutive cubes meet across faces normal to a+1, a+2, a+1, a+2
+    static const int quadcubes[4][2] = {{-1, -1}, {0, -1}, {0, 0}, {-1, 0}};
+
+    mesh->clear(); // vertices are extracted in world space, so any previous transform no longer applies
+    if(voxels->getNumWords() == 0)
+    {
+        mesh->setGeometry(verts, tris);
+        return;
+    }
+    workers = getPool();
+    slab = max(1, (lat.lx - 1) / (4 * workers->getNumThreads()));
+    numslabs = (lat.lx - 1 + slab - 1) / slab;
+
+    // first pass counts the vertices of each plane of cubes
+    planebase.assign(lat.lx, 0);
+    workers->parallelFor(0, numslabs, 1, [&](int sstart, int send)
+    {
+        std::vector<std::uint64_t> cur, nxt;
+        std::uint64_t cubes;
+        const std::uint64_t * cc[4];
+        long count;
+        int px, py, w;
+
+        for(int sl = sstart; sl < send; sl++)
+        {
+            lat.plane(sl * slab, cur);
+            for(px = sl * slab; px < min(lat.lx - 1, (sl + 1) * slab); px++)
+            {
+                lat.plane(px + 1, nxt);
+                count = 0;
+                for(py = 0; py + 1 < lat.ly; py++)
+                {
+                    cc[0] = &cur[(std::size_t) py * lat.sw]; cc[1] = &nxt[(std::size_t) py * lat.sw];
+                    cc[2] = &cur[(std::size_t) (py + 1) * lat.sw]; cc[3] = &nxt[(std::size_t) (py + 1) * lat.sw];
+                    for(w = 0; w < lat.sw; w++)
+                        for(cubes = lat.mixedCubes(cc, w); cubes != 0; cubes &= cubes - 1)
+                            count += (long) nettable[lat.cubeConfig(cc, (w << 6) + __builtin_ctzll(cubes))].vertedges.size();
+                }
+                planebase[px + 1] = count;
+                cur.swap(nxt);
+            }
+        }
+    });
+    for(x = 1; x < lat.lx; x++)
+        planebase[x] += planebase[x-1];
+    verts.resize(planebase[lat.lx - 1]);
+
+    // second pass places the cube vertices and joins those around each crossed lattice edge into a face
+    slabtris.resize(numslabs);
+    slabhubs.resize(numslabs);
+    workers->parallelFor(0, numslabs, 1, [&](int sstart, int send)
+    {
+        std::vector<std::uint64_t> lp[3];
+        std::vector<int> ids[2];
+        std::vector<unsigned char> cfgs[2];
+        std::vector<cgp::Point> pnts[2];
+        std::uint64_t bits;
+        Triangle tri;
+        cgp::Point poly[8], hub;
+        int q[8], d[3], n, px, py, pz, w, k, axis, c0, e, pl, cell, enter, split, xstart, xend;
+        bool inside;
+
+        // first vertex index of each mixed cube in plane qx, with positions written only by the owning slab
+        auto cachePlane = [&](int qx, const std::vector<std::uint64_t> &cur, const std::vector<std::uint64_t> &nxt, int p, bool own)
+        {
+            std::uint64_t cubes;
+            const std::uint64_t * cc[4];
+            cgp::Point ep;
+            long id = planebase[qx];
+            int qy, qz, qw, cfg;
+            float cx, cy, cz;
+
+            ids[p].resize((std::size_t) lat.ly * lat.lz);
+            cfgs[p].resize((std::size_t) lat.ly * lat.lz);
+            pnts[p].resize(planebase[qx + 1] - planebase[qx]);
+            for(qy = 0; qy + 1 < lat.ly; qy++)
+            {
+                cc[0] = &cur[(std::size_t) qy * lat.sw]; cc[1] = &nxt[(std::size_t) qy * lat.sw];
+                cc[2] = &cur[(std::size_t) (qy + 1) * lat.sw]; cc[3] = &nxt[(std::size_t) (qy + 1) * lat.sw];
+                for(qw = 0; qw < lat.sw; qw++)
+                    for(cubes = lat.mixedCubes(cc, qw); cubes != 0; cubes &= cubes - 1)
+                    {
+                        qz = (qw << 6) + __builtin_ctzll(cubes);
+                        cfg = lat.cubeConfig(cc, qz);
+                        ids[p][(std::size_t) qy * lat.lz + qz] = (int) id;
+                        cfgs[p][(std::size_t) qy * lat.lz + qz] = (unsigned char) cfg;
+
+                        // each vertex sits at the centroid of its edge crossings
+                        for(const std::vector<int> &vedges : nettable[cfg].vertedges)
+                        {
+                            cx = cy = cz = 0.0f;
+                            for(int ve : vedges)
+                            {
+                                int vc = mcedgecorners[ve][0];
+                                ep = lat.edgePoint(qx + (vc & 1), qy + ((vc >> 1) & 1), qz + ((vc >> 2) & 1), ve / 4);
+                                cx += ep.x; cy += ep.y; cz += ep.z;
+                            }
+                            pnts[p][id - planebase[qx]] = cgp::Point(cx / (float) vedges.size(), cy / (float) vedges.size(), cz / (float) vedges.size());
+                            if(own)
+                                verts[id] = pnts[p][id - planebase[qx]];
+                            id++;
+                        }
+                    }
+            }
+        };
+
+        for(int sl = sstart; sl < send; sl++)
+        {
+            xstart = sl * slab;
+            xend = min(lat.lx - 1, (sl + 1) * slab);
+            lat.plane(xstart - 1, lp[0]);
+            lat.plane(xstart, lp[1]);
+            lat.plane(xstart + 1, lp[2]);
+            if(xstart > 0)
+                cachePlane(xstart - 1, lp[0], lp[1], 0, false);
+            for(px = xstart; px < xend; px++)
+            {
+                cachePlane(px, lp[1], lp[2], 1, true);
+
+                // edges leaving plane px, whose faces join cubes of planes px-1 and px
+                for(py = 0; py < lat.ly; py++)
+                    for(axis = 0; axis < 3; axis++)
+                        for(w = 0; w < lat.sw; w++)
+                            for(bits = lat.edgeMask(lp[1], lp[2], py, axis, w); bits != 0; bits &= bits - 1)
+                            {
+                                pz = (w << 6) + __builtin_ctzll(bits);
+                                inside = ((lp[1][(std::size_t) py * lat.sw + w] >> (pz & 63)) & 1) != 0;
+
+                                // each cube adds the vertices of the segments on the faces by which the face enters
+                                // and leaves it, which differ only where the cube splits a loop
+                                n = 0;
+                                for(k = 0; k < 4; k++)
+                                {
+                                    d[axis] = 0;
+                                    d[(axis + 1) % 3] = quadcubes[k][0];
+                                    d[(axis + 2) % 3] = quadcubes[k][1];
+                                    c0 = (-d[0]) | ((-d[1]) << 1) | ((-d[2]) << 2);
+                                    for(e = 4 * axis; mcedgecorners[e][0] != c0; e++);
+                                    pl = d[0] + 1;
+                                    cell = (py + d[1]) * lat.lz + pz + d[2];
+                                    enter = (k % 2 == 0) ? 1 : 0;
+                                    q[n] = ids[pl][cell] + nettable[cfgs[pl][cell]].edgevert[e][enter];
+                                    poly[n] = pnts[pl][q[n] - planebase[px + d[0]]];
+                                    n++;
+                                    q[n] = ids[pl][cell] + nettable[cfgs[pl][cell]].edgevert[e][1 - enter];
+                                    poly[n] = pnts[pl][q[n] - planebase[px + d[0]]];
+                                    if(q[n] != q[n - 1])
+                                        n++;
+                                }
+                                if(!inside) // surface faces the negative end of the edge
+                                {
+                                    std::reverse(q, q + n);
+                                    std::reverse(poly, poly + n);
+                                }
+
+                                if(n == 4)
+                                {
+                                    // quads split along the shorter diagonal
+                                    split = (poly[0].x - poly[2].x) * (poly[0].x - poly[2].x) + (poly[0].y - poly[2].y) * (poly[0].y - poly[2].y) + (poly[0].z - poly[2].z) * (poly[0].z - poly[2].z) <=
+                                            (poly[1].x - poly[3].x) * (poly[1].x - poly[3].x) + (poly[1].y - poly[3].y) * (poly[1].y - poly[3].y) + (poly[1].z - poly[3].z) * (poly[1].z - poly[3].z) ? 0 : 1;
+                                    tri.v[0] = q[split]; tri.v[1] = q[split + 1]; tri.v[2] = q[split + 2];
+                                    slabtris[sl].push_back(tri);
+                                    tri.v[0] = q[split]; tri.v[1] = q[split + 2]; tri.v[2] = q[(split + 3) % 4];
+                                    slabtris[sl].push_back(tri);
+                                }
+                                else
+                                {
+                                    // larger faces fan from their centroid, numbered after the cube vertices
+                                    hub = cgp::Point(0.0f, 0.0f, 0.0f);
+                                    for(k = 0; k < n; k++)
+                                    {
+                                        hub.x += poly[k].x / (float) n; hub.y += poly[k].y / (float) n; hub.z += poly[k].z / (float) n;
+                                    }
+                                    slabhubs[sl].push_back(hub);
+                                    for(k = 0; k < n; k++)
+                                    {
+                                        tri.v[0] = -(int) slabhubs[sl].size(); tri.v[1] = q[k]; tri.v[2] = q[(k + 1) % n];
+                                        slabtris[sl].push_back(tri);
+                                    }
+                                }
+                            }
+
+                lp[0].swap(lp[1]);
+                lp[1].swap(lp[2]);
+                lat.plane(px + 2, lp[2]);
+                ids[0].swap(ids[1]);
+                cfgs[0].swap(cfgs[1]);
+                pnts[0].swap(pnts[1]);
+            }
+        }
+    });
+
+    // append face centroids after the cube vertices and gather triangles in slab order, so the result does not
+    // depend on the thread count
+    hubbase.resize(numslabs + 1);
+    hubbase[0] = (long) verts.size();
+    for(s = 0; s < numslabs; s++)
+        hubbase[s + 1] = hubbase[s] + (long) slabhubs[s].size();
+    for(s = 0; s < numslabs; s++)
+    {
+        verts.insert(verts.end(), slabhubs[s].begin(), slabhubs[s].end());
+        for(Triangle &st : slabtris[s])
+        {
+            if(st.v[0] < 0)
+                st.v[0] = (int) (hubbase[s] - 1 - st.v[0]);
+            tris.push_back(st);
+        }
+        std::vector<Triangle>().swap(slabtris[s]);
+    }
+    mesh->setGeometry(verts, tris);
+}
+
+void Scene::extractVoxMesh(bool nets)
+{
+    std::lock_guard<std::mutex> guard(voxlock); // a background job may be swapping in its result
+    if(nets)
+        surfaceNets(&vox, &voxmesh);
+    else
+        marchingCubes(&vox, &voxmesh);
+}
+
+void Scene::voxDims(float voxlen, int &xdim, int &ydim, int &zdim)
+{
+    // calculate voxel volume dimensions based on voxlen
+    xdim = ceil(voldiag.i / voxlen)+2; // needs a 1 voxel border to ensure a closed mesh if shapes reach write up to the border
+    ydim = ceil(voldiag.j / voxlen)+2;
+    zdim = ceil(voldiag.k / voxlen)+2;
+}
+
+void Scene::voxReportDims(float voxlen)
+{
+    int xdim, ydim, zdim;
+
+    voxDims(voxlen, xdim, ydim, zdim);
+    cerr << "Voxel volume dimensions = " << xdim << " x " << ydim << " x " << zdim << endl;
+}
+
+void Scene::voxLayout(float voxlen, VoxelVolume * target)
+{
+    int xdim, ydim, zdim;
+
+    voxDims(voxlen, xdim, ydim, zdim);
+    cgp::Vector voxdiag = cgp::Vector((float) xdim * voxlen, (float) ydim * voxlen, (float) zdim * voxlen);
+    cgp::Point voxorigin = cgp::Point(-0.5f*voxdiag.i, -0.5f*voxdiag.j, -0.5f*voxdiag.k);
+    target->setDim(xdim, ydim, zdim);
+    target->setFrame(voxorigin, voxdiag);
+}
+
+void Scene::voxSweep(SceneNode *root, VoxelVolume *voxels)
+{
+    // actual recursive depth-first walk of csg tree
+    if(root != NULL)
+    {
+        if(voxmode == VoxMode::STREAM)
+            voxStream(root, voxels);
+        else if(voxmode == VoxMode::OCTREE)
+            voxOctree(root, voxels);
+        else if(voxmode == VoxMode::CACHED)
+            voxCached(root, voxels);
+        else if(voxmode == VoxMode::PROGRAM)
+            voxProgram(root, voxels);
+        else
+            voxWalk(root, voxels);
+    }
+}
+
+void Scene::voxBeginProgress(long total)
+{
+    voxdone = 0;
+    voxtotal = total;
+}
+
+void Scene::voxAddProgress(long slices)
+{
+    long done = (voxdone += slices);
+
+    if(voxprogress)
+        voxprogress(done, voxtotal.load());
+}
+
+void Scene::voxelise(float voxlen)
+{
+    cancelVoxelise();
+    voxsidelen = voxlen;
+    voxactive = true;
+    voxReportDims(voxlen);
+    voxLayout(voxlen, &vox);
+    voxSweep(csgroot, &vox);
+}
+
+void Scene::voxeliseBackground(float voxlen, std::function<void(long done, long total)> progress,
+                               std::function<void(bool completed)> finished, int coarsen,
+                               std::function<void(int factor)> publish)
+{
+    cancelVoxelise();
+    voxprogress = progress;
+    voxBeginProgress(0);
+    voxbusy = true;
+    voxReportDims(voxlen);
+
+    // levels are swapped in only once complete, so the current voxels stay valid for rendering
+    voxjob = std::thread([this, voxlen, coarsen, publish, finished]()
+    {
+        bool completed;
+
+        completed = voxProgressive(voxlen, coarsen, publish);
+        voxbusy = false;
+        if(finished)
+            finished(completed);
+    });
+}
+
+void Scene::cancelVoxelise()
+{
+    voxcancel = true;
+    waitVoxelise();
+    voxcancel = false;
+}
+
+void Scene::waitVoxelise()
+{
+    if(voxjob.joinable())
+        voxjob.join();
+    voxprogress = nullptr;
+}
+
+void Scene::publishLevel(VoxelVolume * level, float sidelen, int factor, std::function<void(int factor)> publish)
+{
+    {
+        std::lock_guard<std::mutex> guard(voxlock);
+        vox.swap(*level);
+        voxsidelen = sidelen;
+        voxactive = true;
+    }
+    if(publish)
+        publish(factor);
+}
+
+bool Scene::voxeliseProgressive(float voxlen, int coarsen, std::function<void(int factor)> publish)
+{
+    cancelVoxelise();
+    voxReportDims(voxlen);
+    return voxProgressive(voxlen, coarsen, publish);
+}
+
+bool Scene::voxProgressive(float voxlen, int coarsen, std::function<void(int factor)> publish)
+{
+    std::vector<ShapeNode *> leaves;
+    std::vector<unsigned char> cls, prevcls;
+    VoxelVolume fine, level;
+    cgp::Point corner;
+    cgp::Vector diag;
+    ThreadPool * workers;
+    int l, f, top, xdim, ydim, zdim, cdim[3], pdim[3];
+    float eps;
+
+    voxLayout(voxlen, &fine);
+    fine.getDim(xdim, ydim, zdim);
+    fine.getFrame(corner, diag);
+    if(csgroot == NULL || xdim <= 0 || ydim <= 0 || zdim <= 0)
+    {
+        publishLevel(&fine, voxlen, 1, publish);
+        return true;
+    }
+    traverseTree(csgroot, leaves);
+    for(l = 0; l < (int) leaves.size(); l++)
+        leaves[l]->shape->prepareQueries();
+    workers = getPool();
+    eps = 1.0e-3f * voxlen;
+
+    // coarsening by powers of two, so that every cell nests inside one cell of the level above
+    top = 1;
+    while(top * 2 <= coarsen)
+        top *= 2;
+    pdim[0] = pdim[1] = pdim[2] = 0;
+    for(f = top; f >= 2; f /= 2)
+    {
+        cdim[0] = (xdim + f - 1) / f; cdim[1] = (ydim + f - 1) / f; cdim[2] = (zdim + f - 1) / f;
+        cls.assign((long) cdim[0] * cdim[1] * cdim[2], (unsigned char) CellClass::BOUNDARY);
+        level.setDim(cdim[0], cdim[1], cdim[2]);
+        level.setFrame(corner, cgp::Vector(cdim[0] * f * voxlen, cdim[1] * f * voxlen, cdim[2] * f * voxlen));
+        voxBeginProgress(cdim[0]);
+
+        workers->parallelFor(0, cdim[0], 1, [&](int cstart, int cend)
+        {
+            cgp::BoundBox box;
+            CellClass c;
+            long idx;
+            int x, y, z;
+
+            for(x = cstart; x < cend && !voxCancelled(); x++)
+                for(y = 0; y < cdim[1]; y++)
+                    for(z = 0; z < cdim[2]; z++)
+                    {
+                        idx = ((long) x * cdim[1] + y) * cdim[2] + z;
+
+                        // cells inside or outside at the level above need no further classification
+                        c = CellClass::BOUNDARY;
+                        if(!prevcls.empty())
+                            c = (CellClass) prevcls[((long) (x / 2) * pdim[1] + y / 2) * pdim[2] + z / 2];
+                        if(c == CellClass::BOUNDARY)
+                        {
+                            // classification only needs to hold at the centres of the fine voxels covered
+                            box.reset();
+                            box.includePnt(fine.getVoxelPos(x * f, y * f, z * f));
+                            box.includePnt(fine.getVoxelPos(min(xdim, (x+1) * f) - 1, min(ydim, (y+1) * f) - 1, min(zdim, (z+1) * f) - 1));
+                            box.expand(eps);
+                            c = classifyCell(csgroot, box);
+                        }
+                        cls[idx] = (unsigned char) c;
+
+                        // preview value, sampled at the cell centre where the cell straddles the surface
+                        if(c == CellClass::INSIDE || (c == CellClass::BOUNDARY && treeContainment(csgroot, level.getVoxelPos(x, y, z))))
+                            level.set(x, y, z, true);
+                    }
+            voxAddProgress(x - cstart);
+        });
+        if(voxCancelled())
+            return false;
+        publishLevel(&level, f * voxlen, f, publish);
+        prevcls.swap(cls);
+        pdim[0] = cdim[0]; pdim[1] = cdim[1]; pdim[2] = cdim[2];
+    }
+
+    // without coarse levels there is no classification to reuse, and cached subtrees are cheaper than reclassifying
+    if(prevcls.empty() || voxmode == VoxMode::CACHED)
+        voxSweep(csgroot, &fine);
+    else
+    {
+        // full resolution: fill homogeneous cells of the last level directly and evaluate boundary cells exactly
+        fine.fill(false);
+        voxBeginProgress(pdim[0]);
+        workers->parallelFor(0, pdim[0], 1, [&](int cstart, int cend)
+        {
+            std::vector<std::vector<std::uint64_t>> scratch;
+            std::vector<std::uint64_t> cellcol(fine.getColumnWords());
+            std::vector<CellClass> leafclass;
+            std::vector<float> spans;
+            cgp::BoundBox box;
+            CellClass c;
+            std::uint64_t * col;
+            int x, y, z, zend, zlo, zhi, fx, fy, w, leafidx, hi[2];
+
+            for(x = cstart; x < cend && !voxCancelled(); x++)
+                for(y = 0; y < pdim[1]; y++)
+                {
+                    hi[0] = min(xdim, 2 * x + 2); hi[1] = min(ydim, 2 * y + 2);
+                    z = 0;
+                    while(z < pdim[2])
+                    {
+                        // gather a run of cells of the same class along z, boundary runs no longer than a column word
+                        c = (CellClass) prevcls[((long) x * pdim[1] + y) * pdim[2] + z];
+                        zend = z + 1;
+                        while(zend < pdim[2] && (c != CellClass::BOUNDARY || zend - z < 32)
+                              && (CellClass) prevcls[((long) x * pdim[1] + y) * pdim[2] + zend] == c)
+                            zend++;
+                        zlo = 2 * z; zhi = min(zdim, 2 * zend) - 1;
+                        z = zend;
+                        if(c == CellClass::OUTSIDE)
+                            continue;
+                        if(c == CellClass::BOUNDARY)
+                        {
+                            box.reset();
+                            box.includePnt(fine.getVoxelPos(2 * x, 2 * y, zlo));
+                            box.includePnt(fine.getVoxelPos(hi[0] - 1, hi[1] - 1, zhi));
+                            box.expand(eps);
+                            leafclass.clear();
+                            classifyLeaves(csgroot, box, leafclass);
+                        }
+                        for(fx = 2 * x; fx < hi[0]; fx++)
+                            for(fy = 2 * y; fy < hi[1]; fy++)
+                            {
+                                col = fine.getColumn(fx, fy);
+                                if(c == CellClass::INSIDE)
+                                {
+                                    setColumnSpan(col, zlo, zhi);
+                                    continue;
+                                }
+                                leafidx = 0;
+                                voxCellColumn(csgroot, &fine, fx, fy, zlo, zhi, leafclass, leafidx, &cellcol[0], scratch, 0, spans);
+                                for(w = zlo >> 6; w <= zhi >> 6; w++)
+                                    col[w] |= cellcol[w];
+                            }
+                    }
+                }
+            voxAddProgress(x - cstart);
+        });
+    }
+    if(voxCancelled())
+        return false;
+    publishLevel(&fine, voxlen, 1, publish);
+    return true;
+}
+
+void Scene::sampleScene()
+{
+    ShapeNode * sph = new ShapeNode();
+    sph->shape = new Sphere(cgp::Point(0.0f, 0.0f, 0.0f), 4.0f);
+
+    ShapeNode * cyl1 = new ShapeNode();
+    cyl1->shape = new Cylinder(cgp::Point(-7.0f, -7.0f, 0.0f), cgp::Point(7.0f, 7.0f, 0.0f), 2.0f);
+
+    ShapeNode * cyl2 = new ShapeNode();
+    cyl2->shape = new Cylinder(cgp::Point(0.0f, -7.0f, 0.0f), cgp::Point(0.0f, 7.0f, 0.0f), 2.5f);
+
+    OpNode * combine = new OpNode();
+    combine->op = SetOp::UNION;
+    combine->left = sph;
+    combine->right = cyl1;
+
+    OpNode * diff = new OpNode();
+    diff->op = SetOp::DIFFERENCE;
+    diff->left = combine;
+    diff->right = cyl2;
+
+    setRoot(diff); // cancels any background job before the previous tree is freed
+}
+
+void Scene::expensiveScene()
+{
+    ShapeNode * sph = new ShapeNode();
+    sph->shape = new Sphere(cgp::Point(1.0f, -2.0f, -2.0f), 3.0f);
+
+    ShapeNode * cyl = new ShapeNode();
+    cyl->shape = new Cylinder(cgp::Point(-7.0f, -7.0f, 0.0f), cgp::Point(7.0f, 7.0f, 0.0f), 2.0f);
+
+    ShapeNode * mesh = new ShapeNode();
+    Mesh * bunny = new Mesh();
+    bunny->readSTL("../meshes/bunny.stl");
+    bunny->boxFit(10.0f);
+    mesh->shape = bunny;
+
+    OpNode * combine = new OpNode();
+    combine->op = SetOp::UNION;
+    combine->left = mesh;
+    combine->right = cyl;
+
+    OpNode * diff = new OpNode();
+    diff->op = SetOp::DIFFERENCE;
+    diff->left = combine;
+    diff->right = mesh;
+
+    setRoot(diff); // cancels any background job before the previous tree is freed
+}
+
+SceneNode* Scene::getRoot(){
+	return csgroot;
+}
+
+void Scene::setRoot(SceneNode * root)
+{
+    cancelVoxelise();
+    if(root != csgroot)
+        clearTree(csgroot);
+    csgroot = root;
+}
+
+/**
+ * Merge the set bits of a stack of bit rows into maximal rectangles, greedily extending each run of bits in a row
+ * across the rows that follow. The rows are cleared in the process.
+ * @param rows      nrows rows of rw words each, with no bits set beyond the end of a row
+ * @param nrows     number of rows
+ * @param rw        words per row
+ * @param emit      called with the first and last row and the first and last bit of each rectangle
+ */
+static void greedyRects(std::uint64_t * rows, int nrows, int rw, const std::function<void(int, int, int, int)> &emit)
+{
+    std::uint64_t * row;
+    std::uint64_t gap;
+    int r, r1, rc, w, wb, b0, b1;
+    bool covered;
+
+    // bits b0 to b1 that fall in word wb
+    auto runMask = [](int wb, int lo, int hi)
+    {
+        std::uint64_t m = ~(std::uint64_t) 0;
+        if(wb == lo >> 6)
+            m &= ~(std::uint64_t) 0 << (lo & 63);
+        if(wb == hi >> 6)
+            m &= ~(std::uint64_t) 0 >> (63 - (hi & 63));
+        return m;
+    };
+
+    for(r = 0; r < nrows; r++)
+    {
+        row = rows + (std::size_t) r * rw;
+        for(w = 0; w < rw; w++)
+            while(row[w] != 0)
+            {
+                // run of set bits from b0 to b1, which may carry on into following words
+                b0 = (w << 6) + __builtin_ctzll(row[w]);
+                b1 = (rw << 6) - 1;
+                for(wb = w; wb < rw; wb++)
+                {
+                    gap = ~row[wb] & ((wb == w) ? ~(std::uint64_t) 0 << (b0 & 63) : ~(std::uint64_t) 0);
+                    if(gap != 0)
+                    {
+                        b1 = (wb << 6) + __builtin_ctzll(gap) - 1;
+                        break;
+                    }
+                }
+
+                // extend over the following rows that contain the whole run
+                for(r1 = r; r1 + 1 < nrows; r1++)
+                {
+                    covered = true;
+                    for(wb = b0 >> 6; wb <= b1 >> 6 && covered; wb++)
+                        covered = (rows[(std::size_t) (r1 + 1) * rw + wb] & runMask(wb, b0, b1)) == runMask(wb, b0, b1);
+                    if(!covered)
+                        break;
+                }
+                for(rc = r; rc <= r1; rc++)
+                    for(wb = b0 >> 6; wb <= b1 >> 6; wb++)
+                        rows[(std::size_t) rc * rw + wb] &= ~runMask(wb, b0, b1);
+                emit(r, r1, b0, b1);
+            }
+    }
+}
+
+void Scene::voxelFaces(VoxelVolume * voxels, std::vector<cgp::Point> &points, std::vector<cgp::Vector> &norms, std::vector<int> &faces)
+{
+    std::vector<std::vector<cgp::Point>> slabpoints;
+    std::vector<std::vector<int>> slabaxes;
+    int xdim, ydim, zdim, zwords, yw, slab, numslabs, s, q, k;
+    cgp::Point corner;
+    cgp::Vector diag, cell;
+    ThreadPool * workers;
+
+    points.clear();
+    norms.clear();
+    faces.clear();
+    voxels->getDim(xdim, ydim, zdim);
+    if(voxels->getNumWords() == 0)
+        return;
+    voxels->getFrame(corner, diag);
+    cell = cgp::Vector(diag.i / (float) xdim, diag.j / (float) ydim, diag.k / (float) zdim);
+    zwords = voxels->getColumnWords();
+    yw = (ydim + 63) / 64;
+    workers = getPool();
+    slab = max(1, xdim / (4 * workers->getNumThreads()));
+    numslabs = (xdim + slab - 1) / slab;
+    slabpoints.resize(numslabs);
+    slabaxes.resize(numslabs);
+
+    workers->parallelFor(0, numslabs, 1, [&](int sstart, int send)
+    {
+        std::vector<std::uint64_t> rows, trans;
+        std::vector<cgp::Point> * pnts;
+        const std::uint64_t * col, * nbr;
+        std::uint64_t shifted;
+        int x, y, z, w, sign, xstart, xend, plane;
+
+        for(int sl = sstart; sl < send; sl++)
+        {
+            xstart = sl * slab;
+            xend = min(xdim, xstart + slab);
+            pnts = &slabpoints[sl];
+
+            // a face normal to axis, in the given plane of voxel boundaries, spanning [u0, u1] along axis + 1 and
+            // [v0, v1] along axis + 2 in voxel units, wound counter-clockwise seen from outside
+            auto emitQuad = [&](int ax, int sgn, int pl, int u0, int u1, int v0, int v1)
+            {
+                float c[3], org[3] = {corner.x, corner.y, corner.z}, len[3] = {cell.i, cell.j, cell.k};
+                int uv[4][2] = {{u0, v0}, {u1 + 1, v0}, {u1 + 1, v1 + 1}, {u0, v1 + 1}};
+
+                for(int i = 0; i < 4; i++)
+                {
+                    int j = (sgn > 0) ? i : 3 - i;
+                    c[ax] = org[ax] + (float) pl * len[ax];
+                    c[(ax + 1) % 3] = org[(ax + 1) % 3] + (float) uv[j][0] * len[(ax + 1) % 3];
+                    c[(ax + 2) % 3] = org[(ax + 2) % 3] + (float) uv[j][1] * len[(ax + 2) % 3];
+                    pnts->push_back(cgp::Point(c[0], c[1], c[2]));
+                }
+                slabaxes[sl].push_back(ax * 2 + ((sgn > 0) ? 1 : 0));
+            };
+
+            for(sign = -1; sign <= 1; sign += 2)
+            {
+                // faces normal to x, merged over y and z within each plane
+                rows.resize((std::size_t) ydim * zwords);
+                for(x = xstart; x < xend; x++)
+                {
+                    for(y = 0; y < ydim; y++)
+                    {
+                        col = voxels->getColumn(x, y);
+                        nbr = (x + sign >= 0 && x + sign < xdim) ? voxels->getColumn(x + sign, y) : NULL;
+                        for(w = 0; w < zwords; w++)
+                            rows[(std::size_t) y * zwords + w] = col[w] & ~((nbr != NULL) ? nbr[w] : 0);
+                    }
+                    plane = (sign > 0) ? x + 1 : x;
+                    greedyRects(&rows[0], ydim, zwords, [&](int r0, int r1, int b0, int b1){ emitQuad(0, sign, plane, r0, r1, b0, b1); });
+                }
+
+                // faces normal to y, merged over the x planes of the slab and z
+                rows.resize((std::size_t) (xend - xstart) * zwords);
+                for(y = 0; y < ydim; y++)
+                {
+                    for(x = xstart; x < xend; x++)
+                    {
+                        col = voxels->getColumn(x, y);
+                        nbr = (y + sign >= 0 && y + sign < ydim) ? voxels->getColumn(x, y + sign) : NULL;
+                        for(w = 0; w < zwords; w++)
+                            rows[(std::size_t) (x - xstart) * zwords + w] = col[w] & ~((nbr != NULL) ? nbr[w] : 0);
+                    }
+                    plane = (sign > 0) ? y + 1 : y;
+                    greedyRects(&rows[0], xend - xstart, zwords, [&](int r0, int r1, int b0, int b1){ emitQuad(1, sign, plane, b0, b1, r0 + xstart, r1 + xstart); });
+                }
+
+                // faces normal to z, transposed so that y runs along the bits, then merged over x and y
+                trans.assign((std::size_t) zdim * (xend - xstart) * yw, 0);
+                for(x = xstart; x < xend; x++)
+                    for(y = 0; y < ydim; y++)
+                    {
+                        col = voxels->getColumn(x, y);
+                        for(w = 0; w < zwords; w++)
+                        {
+                            if(sign > 0)
+                                shifted = (col[w] >> 1) | ((w + 1 < zwords) ? col[w+1] << 63 : 0);
+                            else
+                                shifted = (col[w] << 1) | ((w > 0) ? col[w-1] >> 63 : 0);
+                            for(std::uint64_t bits = col[w] & ~shifted; bits != 0; bits &= bits - 1)
+                            {
+                                z = (w << 6) + __builtin_ctzll(bits);
+                                trans[((std::size_t) z * (xend - xstart) + x - xstart) * yw + (y >> 6)] |= (std::uint64_t) 1 << (y & 63);
+                            }
+                        }
+                    }
+                for(z = 0; z < zdim; z++)
+                {
+                    plane = (sign > 0) ? z + 1 : z;
+                    greedyRects(&trans[(std::size_t) z * (xend - xstart) * yw], xend - xstart, yw, [&](int r0, int r1, int b0, int b1){ emitQuad(2, sign, plane, r0 + xstart, r1 + xstart, b0, b1); });
+                }
+            }
+        }
+    });
+
+    // gather the quads in slab order as pairs of triangles with flat normals
+    for(s = 0; s < numslabs; s++)
+    {
+        for(q = 0; q < (int) slabaxes[s].size(); q++)
+        {
+            k = (int) points.size();
+            for(int i = 0; i < 4; i++)
+            {
+                points.push_back(slabpoints[s][q * 4 + i]);
+                norms.push_back(cgp::Vector((slabaxes[s][q] / 2 == 0) ? 1.0f : 0.0f, (slabaxes[s][q] / 2 == 1) ? 1.0f : 0.0f, (slabaxes[s][q] / 2 == 2) ? 1.0f : 0.0f));
+                if(slabaxes[s][q] % 2 == 0)
+                    norms.back().mult(-1.0f);
+            }
+            faces.push_back(k); faces.push_back(k + 1); faces.push_back(k + 2);
+            faces.push_back(k); faces.push_back(k + 2); faces.push_back(k + 3);
+        }
+        std::vector<cgp::Point>().swap(slabpoints[s]);
+        std::vector<int>().swap(slabaxes[s]);
+    }
 }
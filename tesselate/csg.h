@@ -9,19 +9,32 @@
 #include <vector>
 #include <stdio.h>
 #include <iostream>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include "mesh.h"
 #include "voxels.h"
+#include "threadpool.h"
 
 /**
- * Different types of binary set operations on shapes
+ * Strategies for evaluating a CSG tree into a voxel volume
  */
-enum class SetOp
+enum class VoxMode
 {
-    UNION,        ///< combine two shapes together
-    INTERSECTION, ///< create a shape in the region where the arguments overlap
-    DIFFERENCE,   ///< subtract second shape from the first
+    LEAFGRID,   ///< voxelise every leaf into its own full-size grid and then combine, peak memory grows with leaf count
+    STREAM,     ///< evaluate the whole tree one x-slab at a time straight into the output volume
+    OCTREE,     ///< recursively subdivide the volume, filling cells classified inside or outside in bulk
+    CACHED,     ///< voxelise subtrees into full grids, reusing results cached from earlier calls where unchanged
+    PROGRAM,    ///< compile the tree once into a CSGProgram and test every voxel centre, a z-column at a time
 };
 
+const int octleafsize = 8;  ///< octree cells no larger than this along every axis are evaluated column by column
+
+class ShapeNode;
+
+/// A leaf node used more than once in a tree, paired with its voxelised slab once evaluated
+typedef std::pair<ShapeNode *, std::vector<std::uint64_t>> SlabLeaf;
 
 class SceneNode
 {
@@ -47,6 +60,175 @@ public:
     ~ShapeNode(){ delete shape; }
 };
 
+/**
+ * Summary of the changes made by Scene::optimiseTree
+ */
+struct CSGOptStats
+{
+    int sharedleaves;   ///< leaf occurrences that reuse the result of an identical leaf
+    int droppedleaves;  ///< leaves removed with operands that cannot affect the result
+    int flattened;      ///< binary operator nodes merged into n-ary unions and intersections
+    int reordered;      ///< n-ary unions and intersections whose operands were reordered by cost
+
+    CSGOptStats(){ sharedleaves = droppedleaves = flattened = reordered = 0; }
+};
+
+/**
+ * Instruction kinds of a compiled CSG program
+ */
+enum class CSGCode
+{
+    LOAD,       ///< push the containment of the points in a leaf shape
+    NARROW,     ///< between the operands of a set operator, restrict evaluation to points the right operand can change
+    COMBINE,    ///< pop both operands of a set operator and push the result, restoring the previous restriction
+};
+
+/**
+ * A single instruction of a compiled CSG program
+ */
+struct CSGInstr
+{
+    CSGCode code;       ///< instruction kind
+    SetOp op;           ///< set operator, for NARROW and COMBINE
+    BaseShape * shape;  ///< leaf shape, for LOAD
+    int jump;           ///< for NARROW, index of the matching COMBINE, taken when no point can be changed
+};
+
+/**
+ * Plain data copy of a Sphere for fused evaluation. Containment goes through Sphere::contains with the same squared
+ * radius, so it agrees exactly with Sphere::pointContainment.
+ */
+struct FusedSphere
+{
+    float cx, cy, cz, r2;   ///< center and squared radius
+
+    /// Test whether a point lies inside the sphere
+    inline bool contains(float x, float y, float z) const
+    {
+        return Sphere::contains(x - cx, y - cy, z - cz, r2);
+    }
+};
+
+/**
+ * Plain data copy of a Cylinder for fused evaluation, agreeing exactly with Cylinder::pointContainment in the same
+ * way as FusedSphere
+ */
+struct FusedCylinder
+{
+    float sx, sy, sz;   ///< start of the axis
+    float dx, dy, dz;   ///< axis from start to end
+    float den, r2;      ///< squared axis length and squared radius
+
+    /// Test whether a point lies inside the cylinder
+    inline bool contains(float x, float y, float z) const
+    {
+        return Cylinder::contains(sx, sy, sz, dx, dy, dz, den, r2, x, y, z);
+    }
+};
+
+/**
+ * A CSG tree flattened into postfix order, evaluated by a stack machine over batches of points. Each stack entry
+ * holds the results for 64 points as one bit-packed word, so set operators are single logical instructions.
+ * Operands of intersection and difference are only tested at points still inside the left operand, and those of
+ * union only at points still outside it, with the right subtree skipped when no such point remains. The program
+ * references the shapes of the tree, which must outlive it and not be modified while it is in use.
+ */
+class CSGProgram
+{
+private:
+    std::vector<CSGInstr> code; ///< instructions in postfix order
+    int maxdepth;               ///< deepest value stack needed during evaluation
+    bool fused;                 ///< tree matched the fused form and is evaluated by fusedEvaluate instead of code
+    std::vector<FusedSphere> addsph, subsph;    ///< spheres in the union and the subtracted union of the fused form
+    std::vector<FusedCylinder> addcyl, subcyl;  ///< cylinders in the union and the subtracted union of the fused form
+
+    /**
+     * Recursively append the instructions for a subtree
+     * @param root      root of the CSG subtree
+     * @param depth     value stack depth before the subtree is evaluated
+     * @retval @c true  if the subtree was compiled successfully
+     * @retval @c false if it contains a node that is neither a shape nor an operator
+     */
+    bool compileNode(SceneNode * root, int depth);
+
+    /**
+     * Recursively match a subtree of the form (U - V) - W ..., where U, V, W are unions of spheres and cylinders,
+     * gathering the primitives into the fused lists
+     * @param root      root of the CSG subtree
+     * @param subtract  whether the subtree is being subtracted, in which case only a union is accepted
+     * @retval @c true  if the subtree matches
+     * @retval @c false otherwise, in which case the fused lists are partially filled
+     */
+    bool matchFused(SceneNode * root, bool subtract);
+
+    /**
+     * Evaluate point containment for a batch of points with the fused union-minus-union kernel, which tests
+     * every primitive against 64 points at a time with no virtual dispatch
+     * @param pnts          points to test
+     * @param npnts         number of points
+     * @param[out] inside   bit-packed results, as for evaluate
+     */
+    void fusedEvaluate(const cgp::Point * pnts, int npnts, std::uint64_t * inside);
+
+public:
+
+    /// Default constructor, an empty program
+    CSGProgram(){ maxdepth = 0; fused = false; }
+
+    /**
+     * Flatten a CSG tree into this program, replacing any previous contents. Query structures of the leaf shapes
+     * are prepared so that the program can be evaluated concurrently. Trees that are a union of spheres and
+     * cylinders less further such unions, like the sample scene, are also matched to a fused kernel.
+     * @param root          root node of the CSG tree
+     * @param allowfused    whether to use the fused kernel for trees that match it
+     * @retval @c true  if the tree was compiled successfully
+     * @retval @c false if the tree is empty or malformed, in which case the program is empty
+     */
+    bool compile(SceneNode * root, bool allowfused = true);
+
+    /// Remove all instructions
+    void clear();
+
+    /// Getter for whether evaluation uses the fused kernel rather than the generic stack machine
+    bool isFused(){ return fused; }
+
+    /// Getter for whether the program has any instructions
+    bool empty(){ return code.empty(); }
+
+    /// Getter for the number of instructions
+    int size(){ return (int) code.size(); }
+
+    /// Number of words of scratch needed by evaluate for its value and active stacks, fixed by compile
+    int getStackWords(){ return 2 * (maxdepth + 1); }
+
+    /**
+     * Evaluate point containment for a batch of points
+     * @param pnts          points to test
+     * @param npnts         number of points
+     * @param[out] inside   bit-packed results, bit (i & 63) of word (i >> 6) is set if point i is inside. Must
+     *                      hold (npnts + 63) / 64 words, trailing bits of the last word are cleared.
+     * @param stack         getStackWords() words of scratch owned by the caller, so that repeated calls allocate
+     *                      nothing and threads sharing the program each pass their own
+     */
+    void evaluate(const cgp::Point * pnts, int npnts, std::uint64_t * inside, std::uint64_t * stack);
+
+    /**
+     * Evaluate point containment for a batch of points with scratch allocated for the call
+     * @param pnts          points to test
+     * @param npnts         number of points
+     * @param[out] inside   bit-packed results, as above
+     */
+    void evaluate(const cgp::Point * pnts, int npnts, std::uint64_t * inside);
+
+    /**
+     * Evaluate point containment for a single point
+     * @param pnt       point to test
+     * @retval @c true  if the point is inside the solid
+     * @retval @c false otherwise
+     */
+    bool pointContainment(cgp::Point pnt);
+};
+
 /**
  * CSG Tree that can be evaluated to produce a volumetric representation.
  */
@@ -63,6 +245,17 @@ private:
     Mesh voxmesh;                   ///< isosurface of voxel volume
     SetOp currentOp;
     vector<VoxelVolume*> voxVols;
+    int numthreads;                 ///< number of threads used for voxelisation, 1 for serial evaluation
+    ThreadPool * pool;              ///< worker threads for voxelisation, created on demand
+    VoxMode voxmode;                ///< strategy used to evaluate the csg tree
+    VoxelCache voxcache;            ///< subtree results keyed by content hash, for VoxMode::CACHED
+    std::thread voxjob;             ///< background voxelisation, joinable once started until waited on
+    std::atomic<bool> voxbusy;      ///< a background voxelisation is running
+    std::atomic<bool> voxcancel;    ///< cancellation token checked by the sweep loops
+    std::atomic<long> voxdone;      ///< x-slices of the current sweep completed
+    std::atomic<long> voxtotal;     ///< x-slices in the current sweep
+    std::function<void(long done, long total)> voxprogress; ///< progress notification for the background job
+    std::mutex voxlock;             ///< guards vox, voxsidelen and voxactive against a completing background job
 	
 	
     /**
@@ -78,8 +271,7 @@ private:
 
     /**
      * Generate triangle mesh geometry for OpenGL rendering of voxel structure.
-     * Approximates voxel grid as a set of spheres. Extremely expensive to render but more accurate in
-     * capturing set operations
+     * Shows every voxel exactly, as the exposed voxel faces merged into rectangles by voxelFaces
      * @param view      current view parameters
      * @param[out] sdd  openGL parameters required to draw this geometry
      * @retval @c true  if buffers are bound successfully, in which case sdd is valid
@@ -88,31 +280,351 @@ private:
     bool genVoxRender(View * view, ShapeDrawData &sdd);
 
     /**
-     * Apply a boolean set operator given two volumetric operands.
+     * Apply a boolean set operator given two volumetric operands. Volumes with matching dimensions are combined
+     * a packed word at a time (OR, AND, AND-NOT) using SIMD where available.
      * @param op            boolean set operation being applied (union, intersection or difference). Applied as leftarg = leftarg op rightarg
      * @param[out] leftarg  first voxel grid argument. The result is overwritten to here for space reasons.
      * @param rightarg      second voxel grid argument.
-     * @todo Scene::voxSetOp to be completed for CGP Assignment2
      */
     void voxSetOp(SetOp op, VoxelVolume *leftarg, VoxelVolume *rightarg);
 
     /**
-     * Convert a CSG tree into a VoxelVolume by evaluating it with a recursive depth-first walk
+     * Convert a CSG tree into a VoxelVolume by evaluating it with a recursive depth-first walk. Distinct leaf nodes
+     * are voxelised once each, split into x-slabs across the thread pool, and then combined.
      * @param root          root node of the CSG tree
      * @param[out] voxels   volumetric representation of the CSG tree
-     * @todo Scene::voxWalk to be completed for CGP Assignment2
      */
     void voxWalk(SceneNode *root, VoxelVolume *voxels);
 
+    /**
+     * Voxelise a single shape over a slab of the volume. Shapes with column spans are filled a z interval at a
+     * time, otherwise, and for any column the shape cannot resolve, each voxel centre is tested for containment. Slabs with disjoint x ranges touch disjoint
+     * words, so several can be filled concurrently.
+     * @param shape         shape to voxelise, prepareQueries must already have been called
+     * @param vox           volume providing the voxel layout and world-space placement
+     * @param xstart, xend  half open range [xstart, xend) of x indices to fill
+     * @param[out] slabwords    words receiving the slab, laid out as in vox starting at x = xstart. If NULL the
+     *                          words of vox itself are written.
+     */
+    void voxLeaf(BaseShape * shape, VoxelVolume * vox, int xstart, int xend, std::uint64_t * slabwords = NULL);
+
+    /**
+     * Voxelise a single shape over part of one z-column, from column spans where the shape provides them and
+     * otherwise by testing each voxel centre. Only bits in the z range are set, others are left untouched.
+     * @param shape         shape to voxelise, prepareQueries must already have been called
+     * @param vox           volume providing the voxel layout and world-space placement
+     * @param x, y          column location
+     * @param zlo, zhi      inclusive range of z indices to fill
+     * @param[out] col      column words, laid out as in vox
+     * @param spans         scratch storage for column spans
+     */
+    void voxColumn(BaseShape * shape, VoxelVolume * vox, int x, int y, int zlo, int zhi, std::uint64_t * col, std::vector<float> &spans);
+
+    /**
+     * Evaluate a CSG subtree over a single x-slab of the volume. Right operands are evaluated into a scratch
+     * slab per tree level, so temporary storage is bounded by tree depth times slab size.
+     * @param root          root node of the CSG subtree
+     * @param vox           volume providing the voxel layout and world-space placement
+     * @param xstart, xend  half open range [xstart, xend) of x indices in the slab
+     * @param[out] slabwords    words receiving the slab result, laid out as in vox starting at x = xstart
+     * @param scratch       per level scratch slabs, grown as required
+     * @param depth         level of root within the tree
+     * @param shared        leaves used more than once in the tree, with their slab result once evaluated
+     */
+    void voxSlab(SceneNode * root, VoxelVolume * vox, int xstart, int xend, std::uint64_t * slabwords,
+                 std::vector<std::vector<std::uint64_t>> &scratch, int depth, std::vector<SlabLeaf> &shared);
+
+    /**
+     * Convert a CSG tree into a VoxelVolume slab by slab, writing only into the output volume. Slabs are
+     * processed concurrently across the thread pool.
+     * @param root          root node of the CSG tree
+     * @param[out] voxels   volumetric representation of the CSG tree
+     */
+    void voxStream(SceneNode *root, VoxelVolume *voxels);
+
+    /**
+     * Gather every distinct node of a CSG subtree, visiting shared nodes once
+     * @param root          root node of the CSG subtree
+     * @param[out] nodes    distinct nodes, appended in depth-first order
+     */
+    void collectNodes(SceneNode * root, std::vector<SceneNode *> &nodes);
+
+    /**
+     * Delete nodes that are no longer part of a tree, taking care not to delete any child or shape twice or while
+     * it is still in use
+     * @param nodes     candidate nodes for deletion
+     * @param keep      nodes still in use, which are left alone along with their shapes
+     */
+    void deleteNodes(std::vector<SceneNode *> &nodes, std::vector<SceneNode *> &keep);
+
+    /**
+     * Test whether two shapes are identical, either the same object or primitives with equal parameters
+     * @param a, b      shapes to compare
+     * @retval @c true  if the shapes are interchangeable
+     * @retval @c false otherwise
+     */
+    bool sameShape(BaseShape * a, BaseShape * b);
+
+    /**
+     * Replace leaves with the first identical leaf found, so that each distinct leaf is a single shared node
+     * @param[in,out] root  root node of the CSG subtree, updated in place
+     * @param unique        distinct leaves found so far
+     */
+    void shareLeaves(SceneNode * &root, std::vector<ShapeNode *> &unique);
+
+    /**
+     * Copy operator nodes reached through more than one parent, so that each has a single parent and can be
+     * rewritten in place without changing the other uses. Leaves stay shared.
+     * @param[in,out] root  root node of the CSG subtree, updated in place
+     * @param seen          operator nodes already reached
+     */
+    void unshareOps(SceneNode * &root, std::vector<OpNode *> &seen);
+
+    /**
+     * Find conservative bounds of a CSG subtree, combining leaf bounds through the set operators
+     * @param root      root node of the CSG subtree
+     * @returns bounds, empty if the subtree is known to be empty
+     */
+    cgp::BoundBox treeBounds(SceneNode * root);
+
+    /**
+     * Remove operands of differences and intersections whose bounds are disjoint from the other operand, and
+     * subtrees that are known to be empty
+     * @param root          root node of the CSG subtree
+     * @param[in,out] stats count of removed leaves
+     * @returns replacement subtree, NULL if it is empty
+     */
+    SceneNode * pruneTree(SceneNode * root, CSGOptStats &stats);
+
+    /**
+     * Estimate the relative cost of evaluating a CSG subtree, for ordering operands
+     * @param root      root node of the CSG subtree
+     * @returns cost estimate, with a sphere costing 1
+     */
+    float treeCost(SceneNode * root);
+
+    /**
+     * Gather the operands of a run of nested nodes sharing the same operator
+     * @param root          root node of the run
+     * @param op            operator shared by the run
+     * @param[out] operands subtrees below the run, in depth-first order
+     * @param[out] chain    operator nodes of the run, children before parents
+     */
+    void gatherOperands(SceneNode * root, SetOp op, std::vector<SceneNode *> &operands, std::vector<OpNode *> &chain);
+
+    /**
+     * Flatten nested unions and intersections into n-ary operand lists, sort each list from cheap to expensive and
+     * relink the existing operator nodes as a left-deep chain in that order
+     * @param root          root node of the CSG subtree
+     * @param[in,out] stats count of flattened and reordered nodes
+     * @returns replacement subtree root
+     */
+    SceneNode * flattenTree(SceneNode * root, CSGOptStats &stats);
+
+    /**
+     * Compute content hashes for every node of a CSG subtree. A leaf hash combines its shape parameters with the
+     * volume layout, and an operator hash combines the operator with the hashes of its operands.
+     * @param root          root node of the CSG subtree
+     * @param layout        hash of the volume dimensions and frame
+     * @param[out] hashes   content hash of each node
+     * @returns hash of root
+     */
+    std::uint64_t hashTree(SceneNode * root, std::uint64_t layout, std::unordered_map<SceneNode *, std::uint64_t> &hashes);
+
+    /**
+     * Voxelise a CSG subtree into a full grid, reusing cached results for unchanged subtrees and caching any
+     * results computed here
+     * @param root          root node of the CSG subtree
+     * @param hashes        content hash of each node
+     * @param[in,out] vox   volume with the required layout, receives the subtree result
+     */
+    void voxCachedNode(SceneNode * root, std::unordered_map<SceneNode *, std::uint64_t> &hashes, VoxelVolume * vox);
+
+    /**
+     * Convert a CSG tree into a VoxelVolume subtree by subtree, so that after an edit only the subtrees on the
+     * path from the edited leaf to the root are evaluated again
+     * @param root          root node of the CSG tree
+     * @param[out] voxels   volumetric representation of the CSG tree
+     */
+    void voxCached(SceneNode *root, VoxelVolume *voxels);
+
+    /**
+     * Conservatively classify a box against a CSG subtree by combining the classifications of its leaves
+     * @param root      root node of the CSG subtree
+     * @param box       world-space axis-aligned box
+     * @returns classification of the box
+     */
+    CellClass classifyCell(SceneNode * root, cgp::BoundBox box);
+
+    /**
+     * Test point containment against a CSG subtree by a recursive walk
+     * @param root      root node of the CSG subtree
+     * @param pnt       point to test
+     * @retval @c true  if the point is inside the subtree
+     * @retval @c false otherwise
+     */
+    bool treeContainment(SceneNode * root, cgp::Point pnt);
+
+    /**
+     * Combine the signed distances of the leaves of a CSG subtree with min and max
+     * @param root      root node of the CSG subtree
+     * @param pnt       point to query
+     * @returns signed distance bound, negative inside the subtree
+     */
+    float treeDistance(SceneNode * root, cgp::Point pnt);
+
+    /**
+     * Classify a box against every leaf of a CSG subtree, in depth-first order
+     * @param root          root node of the CSG subtree
+     * @param box           world-space axis-aligned box
+     * @param[out] leafclass    classification of each leaf
+     */
+    void classifyLeaves(SceneNode * root, cgp::BoundBox box, std::vector<CellClass> &leafclass);
+
+    /**
+     * Evaluate a CSG subtree over part of one z-column, using per-leaf classifications of the enclosing cell
+     * to skip leaves that are wholly inside or outside it
+     * @param root          root node of the CSG subtree
+     * @param vox           volume providing the voxel layout and world-space placement
+     * @param x, y          column location
+     * @param zlo, zhi      inclusive range of z indices to evaluate, only the words holding them are written
+     * @param leafclass     classification of each leaf against the enclosing cell, in depth-first order
+     * @param[in,out] leafidx   index of the next leaf in leafclass
+     * @param[out] col      column words receiving the result
+     * @param scratch       per level scratch columns, grown as required
+     * @param depth         level of root within the tree
+     * @param spans         scratch storage for column spans
+     */
+    void voxCellColumn(SceneNode * root, VoxelVolume * vox, int x, int y, int zlo, int zhi, std::vector<CellClass> &leafclass,
+                       int &leafidx, std::uint64_t * col, std::vector<std::vector<std::uint64_t>> &scratch, int depth, std::vector<float> &spans);
+
+    /**
+     * Recursively voxelise a cell of the volume. Cells that are wholly inside or outside the CSG tree are filled
+     * in bulk, boundary cells are split until they are small enough to evaluate column by column. Splitting along
+     * z stops early when every boundary leaf of a narrow cell can be filled from column spans.
+     * @param root          root node of the CSG tree
+     * @param leaves        leaves of the CSG tree in depth-first order
+     * @param vox           output volume, bits are only ever set
+     * @param lo, hi        voxel index range of the cell, lo inclusive and hi exclusive
+     * @param eps           margin added around the voxel centres of a cell when classifying it
+     * @param scratch       per level scratch columns
+     * @param cellcol       scratch column for cell evaluation
+     */
+    void voxOctreeCell(SceneNode * root, std::vector<ShapeNode *> &leaves, VoxelVolume * vox, const int lo[3], const int hi[3], float eps,
+                       std::vector<std::vector<std::uint64_t>> &scratch, std::vector<std::uint64_t> &cellcol);
+
+    /**
+     * Dimensions of a volume covering the scene at a given voxel size, including a 1 voxel border
+     * @param voxlen        side length of an individual voxel
+     * @param[out] xdim     number of voxels in x
+     * @param[out] ydim     number of voxels in y
+     * @param[out] zdim     number of voxels in z
+     */
+    void voxDims(float voxlen, int &xdim, int &ydim, int &zdim);
+
+    /**
+     * Report the volume dimensions of a voxelisation request, once per request rather than per level
+     * @param voxlen        side length of an individual voxel
+     */
+    void voxReportDims(float voxlen);
+
+    /**
+     * Set the dimensions and frame of a volume to cover the scene at a given voxel size
+     * @param voxlen        side length of an individual voxel
+     * @param[out] target   volume to lay out, cleared
+     */
+    void voxLayout(float voxlen, VoxelVolume * target);
+
+    /**
+     * Make a completed level of progressive voxelisation the current voxel representation
+     * @param[in,out] level voxels of the level, swapped with the previous representation
+     * @param sidelen   side length of a voxel of the level
+     * @param factor    coarsening factor of the level relative to full resolution
+     * @param publish   notification of the new level, may be empty
+     */
+    void publishLevel(VoxelVolume * level, float sidelen, int factor, std::function<void(int factor)> publish);
+
+    /**
+     * Body of voxeliseProgressive and of the background job, abandoning the remaining levels when the
+     * cancellation token is set
+     * @param voxlen    side length of an individual voxel at full resolution
+     * @param coarsen   coarsening of the first level, rounded down to a power of two, 1 to skip preview levels
+     * @param publish   called after each level is published with its coarsening factor, 1 for the final result
+     * @retval @c true  if full resolution was reached
+     * @retval @c false if cancelled
+     */
+    bool voxProgressive(float voxlen, int coarsen, std::function<void(int factor)> publish);
+
+    /**
+     * Convert a CSG tree into a VoxelVolume by compiling it once into a CSGProgram, which then evaluates whole
+     * z-columns of voxel centres straight into the output words. Slabs are processed concurrently across the thread
+     * pool. Should the tree fail to compile, every voxel is tested by walking the tree instead.
+     * @param root          root node of the CSG tree
+     * @param[out] voxels   volumetric representation of the CSG tree
+     */
+    void voxProgram(SceneNode *root, VoxelVolume *voxels);
+
+    /**
+     * Convert a CSG tree into a VoxelVolume by adaptive octree subdivision, so that work grows with surface area
+     * rather than volume. Independent x-slabs are processed concurrently across the thread pool.
+     * @param root          root node of the CSG tree
+     * @param[out] voxels   volumetric representation of the CSG tree
+     */
+    void voxOctree(SceneNode *root, VoxelVolume *voxels);
+
+    /**
+     * Apply the set operations of a CSG tree to previously voxelised leaves, in the same depth-first order
+     * as traverseTree. The result is accumulated into the grid of the leftmost leaf.
+     * @param root          root node of the CSG subtree
+     * @param[in,out] leafidx   index of the next leaf occurrence to be consumed
+     * @param leafgrid      index into voxVols of the grid for each leaf occurrence
+     * @param[in,out] uses  remaining uses of each grid, shared grids are copied until their last use
+     * @returns voxel grid holding the result for this subtree
+     */
+    VoxelVolume * voxCombine(SceneNode * root, int &leafidx, std::vector<int> &leafgrid, std::vector<int> &uses);
+
+    /// Access to the thread pool, rebuilt if the thread count has changed
+    ThreadPool * getPool();
+
+    /**
+     * Voxelise a CSG tree with the current VoxMode strategy
+     * @param root          root node of the CSG tree
+     * @param[out] voxels   volume with dimensions and frame already set, receiving the result
+     */
+    void voxSweep(SceneNode *root, VoxelVolume *voxels);
+
+    /// Test whether the sweep in progress should be abandoned, leaving its output incomplete
+    bool voxCancelled(){ return voxcancel.load(std::memory_order_relaxed); }
+
+    /**
+     * Start progress accounting for a sweep
+     * @param total     number of x-slices the sweep will complete
+     */
+    void voxBeginProgress(long total);
+
+    /**
+     * Record completed x-slices of the current sweep and notify any progress callback. Safe to call from worker threads.
+     * @param slices    number of x-slices completed
+     */
+    void voxAddProgress(long slices);
+
 public:
 
     void traverseTree(SceneNode* root, std::vector<ShapeNode *> & leaves);
     void traverseTree2(SceneNode* root, std::vector<OpNode *> & leaves);
     void voxSetOp2(SetOp op, VoxelVolume *leftarg, VoxelVolume *rightarg);
-    
-    VoxelVolume* setVoxel(float voxlen);
+
+    /**
+     * Apply a boolean set operator given two sparse volumetric operands. Work is proportional to the number of
+     * non-empty bricks rather than the size of the volume.
+     * @param op            boolean set operation being applied. Applied as leftarg = leftarg op rightarg
+     * @param[out] leftarg  first sparse voxel argument. The result is overwritten to here.
+     * @param rightarg      second sparse voxel argument, with the same dimensions as leftarg
+     */
+    void voxSetOp(SetOp op, SparseVoxelVolume *leftarg, SparseVoxelVolume *rightarg);
     
     ShapeGeometry geom;         ///< triangle mesh geometry for scene
+    InstanceBuffer inst;        ///< instanced unit primitives for scene leaves that have them
 
     /// Default constructor
     Scene();
@@ -126,8 +638,23 @@ public:
      */
     void clear();
     
+    /**
+     * Delete every node of a CSG subtree along with its shapes. Nodes and shapes shared within the tree are
+     * deleted once.
+     * @param root      root node of the CSG subtree
+     */
     void clearTree(SceneNode * root);
 
+    /**
+     * Rewrite the CSG tree into an equivalent one that is cheaper to evaluate. Identical leaves are merged into a
+     * single shared leaf, which the voxelisers evaluate once; operands of differences and intersections with
+     * disjoint bounds are dropped; nested unions and intersections are flattened and their operands ordered from
+     * cheap to expensive, so that early-outs skip the expensive ones. Operator nodes with several parents are
+     * copied first, since the rewrites relink them in place. A summary is written to cerr.
+     * @returns counts of the changes made
+     */
+    CSGOptStats optimiseTree();
+
     /// getter for whether the scene has been voxelised
     bool voxFin(){ return voxactive; }
 
@@ -140,23 +667,178 @@ public:
      */
     bool bindGeometry(View * view, ShapeDrawData &sdd);
 
+    /**
+     * Bind the leaf shapes gathered as instances by the last bindGeometry call. There are none once the scene
+     * is voxelised.
+     * @param view      current view parameters
+     * @param[out] sdds openGL parameters of one instanced draw per primitive, appended to
+     * @retval @c true  if there are instances to draw
+     * @retval @c false otherwise
+     */
+    bool bindInstances(View * view, std::vector<ShapeDrawData> &sdds);
+
     /** 
-     * convert csg tree into a voxel representation
+     * convert csg tree into a voxel representation, cancelling any background voxelisation first
      * @param voxlen    side length of an individual voxel
      */
     void voxelise(float voxlen);
 
     /**
-     * create a sample csg tree to test different shapes and operators
+     * Convert the csg tree into a voxel representation coarse to fine. Levels coarsened by coarsen, coarsen / 2, ...
+     * down to 2 classify blocks of full resolution voxels, reclassifying only blocks whose parent straddles the
+     * surface, and each is published as the current voxel representation as soon as it is complete. The full
+     * resolution pass then fills homogeneous blocks directly and evaluates only boundary blocks, giving exactly
+     * the result of voxelise. In VoxMode::CACHED, or without preview levels, the full resolution pass is an
+     * ordinary sweep in the current mode instead, so that cached subtrees are still reused.
+     * Any background voxelisation is cancelled first.
+     * @param voxlen    side length of an individual voxel at full resolution
+     * @param coarsen   coarsening of the first level, rounded down to a power of two, 1 to skip preview levels
+     * @param publish   called after each level is published with its coarsening factor, 1 for the final result
+     * @retval @c true  if full resolution was reached
+     * @retval @c false if cancelled by cancelVoxelise from another thread
+     */
+    bool voxeliseProgressive(float voxlen, int coarsen = 8, std::function<void(int factor)> publish = nullptr);
+
+    /**
+     * Convert the csg tree into a voxel representation on a background thread, so that the caller stays responsive.
+     * The job runs voxeliseProgressive, so each level is swapped into the scene only once complete, and until then
+     * the previous voxel representation remains current and can still be rendered. Any job already running is
+     * cancelled first. The csg tree, thread count and voxelisation mode must not change while the job runs, call
+     * cancelVoxelise or waitVoxelise beforehand.
+     * @param voxlen    side length of an individual voxel
+     * @param progress  called with the x-slices completed so far and the total for the current level, from worker
+     *                  threads and possibly concurrently, so it must be thread safe
+     * @param finished  called on the background thread when the job ends, with @c true if the full resolution
+     *                  result was swapped in and @c false if the job was cancelled
+     * @param coarsen   coarsening of the first preview level, 1 for a single full resolution sweep
+     * @param publish   called on the background thread after each level is swapped in, with its coarsening factor
+     */
+    void voxeliseBackground(float voxlen, std::function<void(long done, long total)> progress = nullptr,
+                            std::function<void(bool completed)> finished = nullptr, int coarsen = 1,
+                            std::function<void(int factor)> publish = nullptr);
+
+    /**
+     * Cancel any background voxelisation and wait for it to stop, leaving the last level it completed, or else the
+     * previous voxel representation, in place
+     */
+    void cancelVoxelise();
+
+    /// Wait for any background voxelisation to finish
+    void waitVoxelise();
+
+    /// Test whether a background voxelisation is running
+    bool isVoxelising(){ return voxbusy.load(); }
+
+    /**
+     * Report the progress of the current or most recent sweep, or level of progressive voxelisation
+     * @param[out] done     x-slices completed
+     * @param[out] total    x-slices in the sweep or level, 0 before the sweep has started
+     */
+    void getVoxProgress(long &done, long &total){ done = voxdone.load(); total = voxtotal.load(); }
+
+    /**
+     * Set the number of threads used during voxelisation. Results are identical whatever the thread count.
+     * @param threads   number of threads, 1 for serial evaluation or 0 to match the hardware concurrency
+     */
+    void setThreads(int threads);
+
+    /// Getter for the number of threads used during voxelisation
+    int getThreads(){ return numthreads; }
+
+    /// Setter for the csg evaluation strategy used by voxelise
+    void setVoxMode(VoxMode mode){ voxmode = mode; }
+
+    /// Getter for the csg evaluation strategy used by voxelise
+    VoxMode getVoxMode(){ return voxmode; }
+
+    /**
+     * Test point containment against the CSG model by walking the tree for the single point. VoxMode::PROGRAM
+     * evaluates whole voxel columns through a CSGProgram instead.
+     * @param pnt       point to test
+     * @retval @c true  if the point is inside the model
+     * @retval @c false otherwise
+     */
+    bool pointContainment(cgp::Point pnt);
+
+    /**
+     * Find the signed distance from a point to the CSG model, negative inside. Union, intersection and difference
+     * combine leaf distances with min, max and max(a, -b), which gives the exact sign and a magnitude that never
+     * exceeds the true distance, so spheres of that radius can be skipped safely.
+     * @param pnt   point to query
+     * @returns signed distance bound, HUGE_VALF for an empty scene
+     */
+    float signedDistance(cgp::Point pnt);
+
+    /// Getter for the subtree result cache used by VoxMode::CACHED, for statistics and budget control
+    VoxelCache * getVoxCache(){ return &voxcache; }
+
+    /**
+     * Extract the boundary of the occupied voxels as a closed triangle mesh by marching cubes over the voxel centres,
+     * with vertices at the midpoints of lattice edges that join occupied and empty voxels. Space outside the volume
+     * counts as empty, so the mesh is always closed. Cube configurations are triangulated from a table that
+     * resolves ambiguous faces the same way from either side, so the mesh is watertight and two-manifold. Slabs of
+     * x-planes run in parallel, and each lattice edge gets its vertex index from a per-plane edge cache, so
+     * vertices are shared without a merging pass.
+     * @param voxels    volume to extract from
+     * @param[out] mesh receives the triangles, replacing any previous geometry
+     */
+    void marchingCubes(VoxelVolume * voxels, Mesh * mesh);
+
+    /**
+     * Extract the boundary of the occupied voxels as a closed quad mesh by surface nets, the dual of marchingCubes.
+     * Each cube straddling the surface gets one vertex, at the centroid of its edge crossings, and the four cubes
+     * around every crossed lattice edge are joined by a quad split along its shorter diagonal. Cubes that the
+     * marching cubes table separates into several sheets get a vertex per sheet, and a sheet that crosses one face
+     * twice is split in two, which keeps the mesh two-manifold. The triangle count matches marching cubes, two per
+     * crossed edge, but without slivers. Coplanar quads are not merged, so lowering the triangle count is left to
+     * Mesh::decimate, which removes flat regions at no error. Slabs of x-planes run in parallel.
+     * @param voxels    volume to extract from
+     * @param[out] mesh receives the triangles, replacing any previous geometry
+     */
+    void surfaceNets(VoxelVolume * voxels, Mesh * mesh);
+
+    /**
+     * Extract the isosurface of the current voxel representation into the voxel mesh
+     * @param nets  use surfaceNets rather than marchingCubes
+     */
+    void extractVoxMesh(bool nets = false);
+
+    /**
+     * Greedy mesh of the exposed faces of the occupied voxels, those with an empty or out of volume neighbour.
+     * Coplanar faces with the same orientation are merged into maximal rectangles, each emitted as a pair of
+     * triangles with its own four vertices and flat normals, ready for ShapeGeometry::genMesh. Slabs of x-planes
+     * run in parallel, and faces normal to y or z are only merged within a slab.
+     * @param voxels        volume to mesh
+     * @param[out] points   rectangle corners, four per rectangle
+     * @param[out] norms    outward normal at each corner
+     * @param[out] faces    flattened triangle vertex indices, counter-clockwise seen from outside
+     */
+    void voxelFaces(VoxelVolume * voxels, std::vector<cgp::Point> &points, std::vector<cgp::Vector> &norms, std::vector<int> &faces);
+
+    /// Getter for the isosurface of the voxel representation, empty until extractVoxMesh is called
+    Mesh * getVoxMesh(){ return &voxmesh; }
+
+    /// Getter for the voxel representation of the scene, which a completing background job may swap out
+    VoxelVolume * getVoxels(){ return &vox; }
+
+    /**
+     * create a sample csg tree to test different shapes and operators, replacing the current tree through setRoot
      */
     void sampleScene();
 
     /**
      * create a sample csg tree to test different shapes and operators. Expensive because it uses mesh point containment with the Bunny.
+     * Replaces the current tree through setRoot.
      */
     void expensiveScene();
     
     SceneNode* getRoot();
+
+    /**
+     * Replace the CSG tree, deleting the previous one
+     * @param root      root node of the new tree, owned by the scene from now on
+     */
+    void setRoot(SceneNode * root);
 };
 
 #endif
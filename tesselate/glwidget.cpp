@@ -12,6 +12,8 @@
 #include <QImage>
 #include <QCoreApplication>
 #include <QMessageBox>
+#include <QMainWindow>
+#include <QStatusBar>
 
 #include <fstream>
 
@@ -41,12 +43,18 @@ GLWidget::GLWidget(const QGLFormat& format, QWidget *parent)
     meshVisible = false;
 
     scene.sampleScene();
+    scene.optimiseTree();
+    scene.setVoxMode(VoxMode::CACHED); // repeated presses only re-evaluate edited subtrees
+    voxlevel = false;
+    voxtimer = new QTimer(this);
+    connect(voxtimer, &QTimer::timeout, this, &GLWidget::pollVoxelise);
     setMouseTracking(true);
     setFocusPolicy(Qt::StrongFocus);
 }
 
 GLWidget::~GLWidget()
 {
+    scene.cancelVoxelise();
     if (renderer) delete renderer;
 }
 
@@ -130,6 +138,7 @@ void GLWidget::paintGL()
         {
             if(scene.bindGeometry(getView(), sdd))
                 drawParams.push_back(sdd);
+            scene.bindInstances(getView(), drawParams);
         }
         updateGeometry = false;
     }
@@ -150,6 +159,41 @@ void GLWidget::resizeGL(int width, int height)
 }
 
 
+void GLWidget::voxeliseScene(float voxlen)
+{
+    // levels are published on the background thread, so only flag them here for the timer to display
+    scene.voxeliseBackground(voxlen, nullptr, nullptr, 8, [this](int){ voxlevel = true; });
+    voxtimer->start(100);
+}
+
+void GLWidget::pollVoxelise()
+{
+    QMainWindow * mainwin = qobject_cast<QMainWindow *>(window());
+    long done, total;
+
+    if(scene.isVoxelising())
+    {
+        scene.getVoxProgress(done, total);
+        if(mainwin != NULL && total > 0)
+            mainwin->statusBar()->showMessage(tr("Voxelising %1%").arg((int) (100 * done / total)));
+        if(voxlevel.exchange(false))
+        {
+            setGeometryUpdate(true);
+            emit signalRepaintAllGL();
+        }
+    }
+    else
+    {
+        voxtimer->stop();
+        scene.waitVoxelise();
+        voxlevel = false;
+        if(mainwin != NULL)
+            mainwin->statusBar()->clearMessage();
+        setGeometryUpdate(true);
+        emit signalRepaintAllGL();
+    }
+}
+
 void GLWidget::keyPressEvent(QKeyEvent *event)
 {
     if(event->key() == Qt::Key_A)
@@ -12,6 +12,7 @@
 #include <QKeyEvent>
 #include <QPushButton>
 #include <list>
+#include <atomic>
 #include <common/debug_vector.h>
 #include <common/debug_list.h>
 
@@ -57,6 +58,14 @@ public:
     /// respond to key press events
     void keyPressEvent(QKeyEvent *event);
 
+    /**
+     * Voxelise the scene progressively on a background thread. The previous voxels continue to be rendered until
+     * the first coarse level is complete, each finer level is displayed as it arrives, and progress is shown in the
+     * status bar of the main window.
+     * @param voxlen    side length of an individual voxel
+     */
+    void voxeliseScene(float voxlen);
+
 signals:
 
     /// signal that the OpenGL canvas should be repainted
@@ -84,6 +93,9 @@ protected:
     /// Handle mouse wheel scrolling
     void wheelEvent(QWheelEvent * wheel);
 
+    /// Report progress of background voxelisation and display each level it publishes
+    void pollVoxelise();
+
 private:
 
     // scene control
@@ -92,6 +104,8 @@ private:
     vector<ShapeDrawData> drawParams;   ///< OpenGL drawing parameters
     bool updateGeometry;                ///< recreate render buffers on change
     bool meshVisible;                   ///< render intersection mesh
+    QTimer * voxtimer;                  ///< polls background voxelisation while it runs
+    std::atomic<bool> voxlevel;         ///< background voxelisation has published a level not yet displayed
 
     // render variables
     Renderer * renderer;                ///< OpenGL renderer
@@ -17,6 +17,9 @@
 #include <glm/gtx/rotate_vector.hpp>
 #include <glm/gtx/intersect.hpp>
 #include <unordered_map>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
 
 using namespace std;
 using namespace cgp;
@@ -24,6 +27,34 @@ using namespace cgp;
 GLfloat stdCol[] = {0.7f, 0.7f, 0.75f, 0.4f};
 const int raysamples = 2;
 
+cgp::BoundBox BaseShape::getBounds()
+{
+    cgp::BoundBox bbox;
+
+    bbox.min = cgp::Point(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+    bbox.max = cgp::Point(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+    return bbox;
+}
+
+CellClass BaseShape::classifyBox(cgp::BoundBox box)
+{
+    cgp::Point center;
+    float dist, halfdiag;
+
+    if(!box.overlaps(getBounds()))
+        return CellClass::OUTSIDE;
+
+    // the surface cannot pass through the box if it is further from the center than any corner
+    center = cgp::Point(0.5f * (box.min.x + box.max.x), 0.5f * (box.min.y + box.max.y), 0.5f * (box.min.z + box.max.z));
+    halfdiag = 0.5f * box.diagLen();
+    dist = signedDistance(center);
+    if(dist > halfdiag)
+        return CellClass::OUTSIDE;
+    if(dist < -halfdiag)
+        return CellClass::INSIDE;
+    return CellClass::BOUNDARY;
+}
+
 void Sphere::genGeometry(ShapeGeometry * geom, View * view)
 {
     glm::mat4 tfm, idt;
@@ -35,27 +66,92 @@ void Sphere::genGeometry(ShapeGeometry * geom, View * view)
     geom->genSphere(r, 40, 40, tfm);
 }
 
+bool Sphere::genInstance(InstanceBuffer * inst)
+{
+    glm::mat4 tfm, idt;
+
+    idt = glm::mat4(1.0f); // identity matrix
+    tfm = glm::translate(idt, glm::vec3(c.x, c.y, c.z));
+    tfm = glm::scale(tfm, glm::vec3(r, r, r));
+    inst->addInstance(Primitive::SPHERE, tfm);
+    return true;
+}
+
 bool Sphere::pointContainment(cgp::Point pnt)
 {
-    float dist = c.dist(pnt);
-    
-    if (dist <= r){
-    	return true;
+    // squared distances avoid the square root, and match the fused CSG kernel exactly
+    return contains(pnt.x - c.x, pnt.y - c.y, pnt.z - c.z, r * r);
+}
+
+float Sphere::signedDistance(cgp::Point pnt)
+{
+    return c.dist(pnt) - r;
+}
+
+std::uint64_t Sphere::contentHash()
+{
+    float params[4] = {c.x, c.y, c.z, r};
+
+    return hashBytes(params, sizeof(params), hashBytes("sphere", 6));
+}
+
+cgp::BoundBox Sphere::getBounds()
+{
+    cgp::BoundBox bbox;
+
+    bbox.includePnt(c);
+    bbox.expand(r);
+    return bbox;
+}
+
+bool Sphere::columnSpans(float x, float y, std::vector<float> &spans)
+{
+    float dx, dy, dz2, dz;
+
+    spans.clear();
+    dx = x - c.x; dy = y - c.y;
+    dz2 = r * r - dx * dx - dy * dy;
+    if(dz2 >= 0.0f)
+    {
+        dz = sqrt(dz2);
+        spans.push_back(c.z - dz);
+        spans.push_back(c.z + dz);
     }
-    else{
-    	return false;
+    return true;
+}
+
+CellClass Sphere::classifyBox(cgp::BoundBox box)
+{
+    float near2 = 0.0f, far2 = 0.0f, cmin[3], cmax[3], cc[3], dlo, dhi;
+    int a;
+
+    cmin[0] = box.min.x; cmin[1] = box.min.y; cmin[2] = box.min.z;
+    cmax[0] = box.max.x; cmax[1] = box.max.y; cmax[2] = box.max.z;
+    cc[0] = c.x; cc[1] = c.y; cc[2] = c.z;
+    for(a = 0; a < 3; a++)
+    {
+        dlo = cmin[a] - cc[a]; dhi = cmax[a] - cc[a];
+        if(dlo > 0.0f)
+            near2 += dlo * dlo;
+        else if(dhi < 0.0f)
+            near2 += dhi * dhi;
+        far2 += max(dlo * dlo, dhi * dhi);
     }
-    
-    // stub, needs completing
+    if(near2 > r * r)
+        return CellClass::OUTSIDE;
+    if(far2 <= r * r)
+        return CellClass::INSIDE;
+    return CellClass::BOUNDARY;
 }
 
-void Cylinder::genGeometry(ShapeGeometry * geom, View * view)
+float Cylinder::spineFrame(glm::mat4x4 &tfm)
 {
-    glm::mat4 tfm, idt;
+    glm::mat4 idt;
     glm::vec3 trs, rot;
     Vector edgevec, zerovec, axisvec, zaxis;
     float edgelen, aval;
 
+    idt = glm::mat4(1.0f); // identity matrix
     edgevec.diff(s, e);
     edgelen = edgevec.length();
     edgevec.normalize();
@@ -86,23 +182,173 @@ void Cylinder::genGeometry(ShapeGeometry * geom, View * view)
         rot = glm::vec3(axisvec.i, axisvec.j, axisvec.k);
         tfm = glm::rotate(tfm, aval, rot);
     }
+    return edgelen;
+}
+
+void Cylinder::genGeometry(ShapeGeometry * geom, View * view)
+{
+    glm::mat4 tfm;
+    float edgelen;
 
     // align to edge vector by rotation
+    edgelen = spineFrame(tfm);
     geom->genCylinder(r, edgelen, 12, 4, tfm);
 }
 
+bool Cylinder::genInstance(InstanceBuffer * inst)
+{
+    glm::mat4 tfm;
+    float edgelen;
+
+    edgelen = spineFrame(tfm);
+    tfm = glm::scale(tfm, glm::vec3(r, r, edgelen));
+    inst->addInstance(Primitive::CYLINDER, tfm);
+    return true;
+}
+
 bool Cylinder::pointContainment(cgp::Point pnt)
 {
     cgp::Vector dirvec;
-    float dist, tval;
 
-    // find distance and parameter value to closest point on the axis of the cylinder
+    // closest point on the axis of the cylinder, compared in squared distance as by the fused CSG kernel
     dirvec.diff(s, e);
-    rayPointDist(s, dirvec, pnt, tval, dist);
-    if(tval >= 0.0f && tval <= 1.0f && dist <= r)
+    return contains(s.x, s.y, s.z, dirvec.i, dirvec.j, dirvec.k, dirvec.sqrdlength(), r * r, pnt.x, pnt.y, pnt.z);
+}
+
+cgp::BoundBox Cylinder::getBounds()
+{
+    cgp::BoundBox bbox;
+    cgp::Vector axis;
+    float len, ex, ey, ez;
+
+    bbox.includePnt(s);
+    bbox.includePnt(e);
+    axis.diff(s, e);
+    len = axis.length();
+    if(len > 0.0f)
+    {
+        // the end cap discs reach r * sin(angle between axis and coordinate axis) along each coordinate
+        axis.normalize();
+        ex = r * sqrt(max(0.0f, 1.0f - axis.i * axis.i));
+        ey = r * sqrt(max(0.0f, 1.0f - axis.j * axis.j));
+        ez = r * sqrt(max(0.0f, 1.0f - axis.k * axis.k));
+        bbox.min.x -= ex; bbox.max.x += ex;
+        bbox.min.y -= ey; bbox.max.y += ey;
+        bbox.min.z -= ez; bbox.max.z += ez;
+    }
+    return bbox;
+}
+
+bool Cylinder::columnSpans(float x, float y, std::vector<float> &spans)
+{
+    double dx, dy, dz, len2, wx, wy, wz, a0, qa, qb, qc, disc, root, zlo, zhi, t0, t1;
+
+    spans.clear();
+    dx = e.x - s.x; dy = e.y - s.y; dz = e.z - s.z;
+    len2 = dx * dx + dy * dy + dz * dz;
+    if(len2 <= 0.0)
         return true;
+
+    // offset of the line point at z = 0 from the start of the axis
+    wx = x - s.x; wy = y - s.y; wz = -s.z;
+    a0 = wx * dx + wy * dy + wz * dz;
+
+    // squared distance to the axis less r^2 is a quadratic qa z^2 + 2 qb z + qc, inside where it is <= 0
+    qa = 1.0 - dz * dz / len2;
+    qb = wz - a0 * dz / len2;
+    qc = wx * wx + wy * wy + wz * wz - a0 * a0 / len2 - (double) r * (double) r;
+    if(qa <= 1e-12) // axis parallel to the line, distance does not vary with z
+    {
+        if(qc > 0.0)
+            return true;
+        zlo = -HUGE_VAL; zhi = HUGE_VAL;
+    }
     else
-        return false;
+    {
+        disc = qb * qb - qa * qc;
+        if(disc < 0.0)
+            return true;
+        root = sqrt(disc);
+        zlo = (-qb - root) / qa;
+        zhi = (-qb + root) / qa;
+    }
+
+    // parameter along the axis, t = (a0 + z dz) / len2, must lie in [0, 1]
+    if(dz == 0.0)
+    {
+        if(a0 < 0.0 || a0 > len2)
+            return true;
+    }
+    else
+    {
+        t0 = -a0 / dz; t1 = (len2 - a0) / dz;
+        zlo = max(zlo, min(t0, t1));
+        zhi = min(zhi, max(t0, t1));
+    }
+
+    if(zlo <= zhi)
+    {
+        spans.push_back((float) zlo);
+        spans.push_back((float) zhi);
+    }
+    return true;
+}
+
+float Cylinder::signedDistance(cgp::Point pnt)
+{
+    cgp::Vector dirvec;
+    float tval, dist, len, radial, axial;
+
+    if(s == e)
+        return s.dist(pnt) - r;
+
+    dirvec.diff(s, e);
+    len = dirvec.length();
+    rayPointDist(s, dirvec, pnt, tval, dist);
+
+    // distance outside the curved wall and beyond the nearer end cap, negative when within
+    radial = dist - r;
+    axial = max(-tval, tval - 1.0f) * len;
+    if(radial > 0.0f && axial > 0.0f) // beyond the rim of a cap
+        return sqrt(radial * radial + axial * axial);
+    return max(radial, axial);
+}
+
+std::uint64_t Cylinder::contentHash()
+{
+    float params[7] = {s.x, s.y, s.z, e.x, e.y, e.z, r};
+
+    return hashBytes(params, sizeof(params), hashBytes("cylinder", 8));
+}
+
+CellClass Cylinder::classifyBox(cgp::BoundBox box)
+{
+    cgp::Point center;
+    cgp::Vector dirvec, halfdiag;
+    float tval, dist;
+    int corner;
+    bool allin;
+
+    if(!box.overlaps(getBounds()))
+        return CellClass::OUTSIDE;
+    if(s == e)
+        return CellClass::BOUNDARY;
+
+    // bounding sphere of the box against the axis segment
+    center = cgp::Point(0.5f * (box.min.x + box.max.x), 0.5f * (box.min.y + box.max.y), 0.5f * (box.min.z + box.max.z));
+    halfdiag.diff(center, box.max);
+    dirvec.diff(s, e);
+    rayPointDist(s, dirvec, center, tval, dist);
+    clamp(tval);
+    dist = center.dist(cgp::Point(s.x + tval * dirvec.i, s.y + tval * dirvec.j, s.z + tval * dirvec.k));
+    if(dist > r + halfdiag.length())
+        return CellClass::OUTSIDE;
+
+    allin = true;
+    for(corner = 0; corner < 8 && allin; corner++)
+        allin = pointContainment(cgp::Point((corner & 1) ? box.max.x : box.min.x, (corner & 2) ? box.max.y : box.min.y,
+                                            (corner & 4) ? box.max.z : box.min.z));
+    return allin ? CellClass::INSIDE : CellClass::BOUNDARY;
 }
 
 bool Mesh::findVert(cgp::Point pnt, int &idx)
@@ -453,6 +699,7 @@ Mesh::Mesh()
     scale = 1.0f;
     xrot = yrot = zrot = 0.0f;
     trx = cgp::Vector(0.0f, 0.0f, 0.0f);
+    colnx = colny = 0;
 }
 
 Mesh::~Mesh()
@@ -460,10 +707,33 @@ Mesh::~Mesh()
     clear();
 }
 
+void Mesh::setGeometry(std::vector<cgp::Point> &newverts, std::vector<Triangle> &newtris)
+{
+    // acceleration structures describe the old triangles, whereas placement and colour carry over
+    boundspheres.clear();
+    colverts.clear();
+    colgrid.clear();
+    colnx = colny = 0;
+    bvh.clear();
+    bvhtris.clear();
+    geometry.clear();
+    norms.clear();
+    verts.swap(newverts);
+    tris.swap(newtris);
+    deriveFaceNorms();
+    deriveVertNorms();
+}
+
 void Mesh::clear()
 {
     verts.clear();
     tris.clear();
+    boundspheres.clear();
+    colverts.clear();
+    colgrid.clear();
+    colnx = colny = 0;
+    bvh.clear();
+    bvhtris.clear();
     geometry.clear();
     col = stdCol;
     scale = 1.0f;
@@ -504,6 +774,22 @@ bool Mesh::bindGeometry(View * view, ShapeDrawData &sdd)
        return false;
 }
 
+cgp::BoundBox Mesh::getBounds()
+{
+    cgp::BoundBox bbox;
+    glm::mat4x4 tfm;
+    glm::vec4 vxfm;
+    int v;
+
+    buildTransform(tfm);
+    for(v = 0; v < (int) verts.size(); v++)
+    {
+        vxfm = tfm * glm::vec4(verts[v].x, verts[v].y, verts[v].z, 1.0f);
+        bbox.includePnt(cgp::Point(vxfm.x, vxfm.y, vxfm.z));
+    }
+    return bbox;
+}
+
 bool Mesh::pointContainment(cgp::Point pnt)
 {
     int incount = 0, outcount = 0, hits, i, t, p, s;
@@ -514,8 +800,14 @@ bool Mesh::pointContainment(cgp::Point pnt)
     cgp::Vector dir;
     float dist, tval;
     list<int> inspheres;
+    std::uint32_t seed, bits[3];
 
-    srand(time(0));
+    // seed a local xorshift generator from the query position rather than using the shared rand() state,
+    // so that results do not depend on thread scheduling or the time of the query
+    memcpy(bits, &pnt.x, sizeof(float)); memcpy(&bits[1], &pnt.y, sizeof(float)); memcpy(&bits[2], &pnt.z, sizeof(float));
+    seed = (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+    if(seed == 0)
+        seed = 2463534242u;
 
     // sample over multiple rays to avoid numerical issues (e.g., ray hits a vertex or edge)
     origin = glm::vec3(pnt.x, pnt.y, pnt.z);
@@ -533,7 +825,12 @@ bool Mesh::pointContainment(cgp::Point pnt)
 
         // sampling ray with random direction
         // avoid axis aligned rays because more likely to lead to numerical issues with axis aligned structures
-        dir = cgp::Vector((float) (rand()%1000-500), (float) (rand()%1000-500), (float) (rand()%1000-500));
+        for(p = 0; p < 3; p++)
+        {
+            seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+            bits[p] = seed % 1000;
+        }
+        dir = cgp::Vector((float) ((int) bits[0]-500), (float) ((int) bits[1]-500), (float) ((int) bits[2]-500));
         dir.normalize();
         ray = glm::vec3(dir.i, dir.j, dir.k);
 
@@ -577,6 +874,405 @@ bool Mesh::pointContainment(cgp::Point pnt)
     return (incount > outcount);
 }
 
+void Mesh::prepareQueries()
+{
+    if(boundspheres.empty()) // no acceleration structure so build
+        buildSphereAccel((int) sphperdim);
+    buildColumnAccel(); // transform may have changed since the last build
+    buildDistanceAccel();
+}
+
+std::uint64_t Mesh::contentHash()
+{
+    std::uint64_t h;
+    float params[7] = {scale, xrot, yrot, zrot, trx.i, trx.j, trx.k};
+    float coords[3];
+    int v, t;
+
+    h = hashBytes("mesh", 4);
+    for(v = 0; v < (int) verts.size(); v++)
+    {
+        coords[0] = verts[v].x; coords[1] = verts[v].y; coords[2] = verts[v].z;
+        h = hashBytes(coords, sizeof(coords), h);
+    }
+    for(t = 0; t < (int) tris.size(); t++) // normals are derived from the vertices, so are left out
+        h = hashBytes(tris[t].v, sizeof(tris[t].v), h);
+    return hashBytes(params, sizeof(params), h);
+}
+
+float Mesh::signedDistance(cgp::Point pnt)
+{
+    std::vector<int> stack;
+    std::vector<float> spans;
+    glm::mat4x4 tfm;
+    glm::vec4 vxfm;
+    glm::vec3 q, v[3];
+    cgp::Point vert;
+    float best = HUGE_VALF, dist, dl, dr;
+    int n, t, p, h, l, r;
+    bool inside;
+
+    if(tris.empty())
+        return HUGE_VALF;
+    q = glm::vec3(pnt.x, pnt.y, pnt.z);
+
+    if(bvh.empty()) // no acceleration structure so test every triangle
+    {
+        buildTransform(tfm);
+        for(t = 0; t < (int) tris.size(); t++)
+        {
+            for(p = 0; p < 3; p++)
+            {
+                vert = verts[tris[t].v[p]];
+                vxfm = tfm * glm::vec4(vert.x, vert.y, vert.z, 1.0f);
+                v[p] = glm::vec3(vxfm.x, vxfm.y, vxfm.z);
+            }
+            best = min(best, triangleSqrDist(q, v[0], v[1], v[2]));
+        }
+    }
+    else
+    {
+        // depth first, nearer child first, skipping nodes whose bounds are further than the best so far
+        stack.push_back(0);
+        while(!stack.empty())
+        {
+            n = stack.back();
+            stack.pop_back();
+            if(boxSqrDist(bvh[n].box, pnt) >= best)
+                continue;
+            if(bvh[n].left < 0)
+            {
+                for(t = bvh[n].first; t < bvh[n].first + bvh[n].count; t++)
+                {
+                    for(p = 0; p < 3; p++)
+                    {
+                        vert = colverts[tris[bvhtris[t]].v[p]];
+                        v[p] = glm::vec3(vert.x, vert.y, vert.z);
+                    }
+                    best = min(best, triangleSqrDist(q, v[0], v[1], v[2]));
+                }
+            }
+            else
+            {
+                l = bvh[n].left; r = bvh[n].right;
+                dl = boxSqrDist(bvh[l].box, pnt);
+                dr = boxSqrDist(bvh[r].box, pnt);
+                if(dl < dr)
+                    swap(l, r);
+                stack.push_back(l); // further child is popped last
+                stack.push_back(r);
+            }
+        }
+    }
+
+    // sign from containment, using the exact column test where it resolves
+    if(columnSpans(pnt.x, pnt.y, spans))
+    {
+        inside = false;
+        for(h = 0; h+1 < (int) spans.size(); h += 2)
+            if(pnt.z >= spans[h] && pnt.z <= spans[h+1])
+                inside = true;
+    }
+    else
+        inside = pointContainment(pnt);
+    dist = sqrt(best);
+    return inside ? -dist : dist;
+}
+
+float Mesh::boxSqrDist(const cgp::BoundBox &box, cgp::Point pnt)
+{
+    float dx, dy, dz;
+
+    dx = max(0.0f, max(box.min.x - pnt.x, pnt.x - box.max.x));
+    dy = max(0.0f, max(box.min.y - pnt.y, pnt.y - box.max.y));
+    dz = max(0.0f, max(box.min.z - pnt.z, pnt.z - box.max.z));
+    return dx * dx + dy * dy + dz * dz;
+}
+
+float Mesh::triangleSqrDist(const glm::vec3 &pnt, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+{
+    glm::vec3 ab, ac, ap, bp, cp, closest;
+    float d1, d2, d3, d4, d5, d6, va, vb, vc, denom, v, w;
+
+    // Voronoi region tests on the triangle features (Ericson, Real-Time Collision Detection, 5.1.5)
+    ab = b - a; ac = c - a; ap = pnt - a;
+    d1 = glm::dot(ab, ap); d2 = glm::dot(ac, ap);
+    if(d1 <= 0.0f && d2 <= 0.0f)
+        closest = a;
+    else
+    {
+        bp = pnt - b;
+        d3 = glm::dot(ab, bp); d4 = glm::dot(ac, bp);
+        cp = pnt - c;
+        d5 = glm::dot(ab, cp); d6 = glm::dot(ac, cp);
+        vc = d1 * d4 - d3 * d2;
+        vb = d5 * d2 - d1 * d6;
+        va = d3 * d6 - d5 * d4;
+        if(d3 >= 0.0f && d4 <= d3)
+            closest = b;
+        else if(d6 >= 0.0f && d5 <= d6)
+            closest = c;
+        else if(vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+            closest = a + ab * (d1 / (d1 - d3));
+        else if(vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+            closest = a + ac * (d2 / (d2 - d6));
+        else if(va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+            closest = b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+        else
+        {
+            denom = va + vb + vc;
+            if(denom <= 0.0f) // degenerate triangle, fall back on the nearest vertex
+                return min(glm::dot(ap, ap), min(glm::dot(bp, bp), glm::dot(cp, cp)));
+            v = vb / denom; w = vc / denom;
+            closest = a + ab * v + ac * w;
+        }
+    }
+    closest = pnt - closest;
+    return glm::dot(closest, closest);
+}
+
+void Mesh::buildDistanceAccel()
+{
+    int t;
+
+    bvh.clear();
+    bvhtris.clear();
+    if(tris.empty() || colverts.empty())
+        return;
+    for(t = 0; t < (int) tris.size(); t++)
+        bvhtris.push_back(t);
+    bvh.reserve(2 * tris.size() / bvhleafsize + 1);
+    buildBVHNode(0, (int) tris.size());
+}
+
+int Mesh::buildBVHNode(int first, int count)
+{
+    TriBVHNode node;
+    cgp::BoundBox cbox;
+    float ext[3];
+    int n, t, p, axis, half;
+
+    node.left = node.right = -1;
+    node.first = first; node.count = count;
+    for(t = first; t < first + count; t++)
+        for(p = 0; p < 3; p++)
+            node.box.includePnt(colverts[tris[bvhtris[t]].v[p]]);
+    n = (int) bvh.size();
+    bvh.push_back(node);
+    if(count <= bvhleafsize)
+        return n;
+
+    // median split of triangle centroids along the longest axis of their bounds
+    for(t = first; t < first + count; t++)
+        cbox.includePnt(triCentroid(bvhtris[t]));
+    ext[0] = cbox.max.x - cbox.min.x; ext[1] = cbox.max.y - cbox.min.y; ext[2] = cbox.max.z - cbox.min.z;
+    axis = 0;
+    if(ext[1] > ext[axis])
+        axis = 1;
+    if(ext[2] > ext[axis])
+        axis = 2;
+    half = count / 2;
+    nth_element(bvhtris.begin() + first, bvhtris.begin() + first + half, bvhtris.begin() + first + count,
+                [this, axis](int a, int b) {
+                    cgp::Point ca = triCentroid(a), cb = triCentroid(b);
+                    return axis == 0 ? ca.x < cb.x : (axis == 1 ? ca.y < cb.y : ca.z < cb.z);
+                });
+
+    // children are appended after this node, so the node is indexed rather than referenced
+    t = buildBVHNode(first, half);
+    bvh[n].left = t;
+    t = buildBVHNode(first + half, count - half);
+    bvh[n].right = t;
+    return n;
+}
+
+cgp::Point Mesh::triCentroid(int t)
+{
+    cgp::Point a, b, c;
+
+    a = colverts[tris[t].v[0]]; b = colverts[tris[t].v[1]]; c = colverts[tris[t].v[2]];
+    return cgp::Point((a.x + b.x + c.x) / 3.0f, (a.y + b.y + c.y) / 3.0f, (a.z + b.z + c.z) / 3.0f);
+}
+
+void Mesh::buildColumnAccel()
+{
+    glm::mat4x4 tfm;
+    glm::vec4 vxfm;
+    cgp::BoundBox tbox;
+    float cellx, celly;
+    int v, t, p, x, y, xlo, xhi, ylo, yhi;
+
+    colverts.clear();
+    colgrid.clear();
+    colbox.reset();
+    colnx = colny = 0;
+    if(tris.empty())
+        return;
+
+    buildTransform(tfm);
+    for(v = 0; v < (int) verts.size(); v++)
+    {
+        vxfm = tfm * glm::vec4(verts[v].x, verts[v].y, verts[v].z, 1.0f);
+        colverts.push_back(cgp::Point(vxfm.x, vxfm.y, vxfm.z));
+        colbox.includePnt(colverts.back());
+    }
+
+    // roughly one bin per triangle in total, binned by xy bounding rectangle
+    colnx = colny = max(1, min(1024, (int) sqrt((float) tris.size())));
+    colgrid.resize(colnx * colny);
+    cellx = (colbox.max.x - colbox.min.x) / (float) colnx;
+    celly = (colbox.max.y - colbox.min.y) / (float) colny;
+    for(t = 0; t < (int) tris.size(); t++)
+    {
+        tbox.reset();
+        for(p = 0; p < 3; p++)
+            tbox.includePnt(colverts[tris[t].v[p]]);
+        xlo = 0; xhi = colnx-1; ylo = 0; yhi = colny-1;
+        if(cellx > 0.0f)
+        {
+            xlo = max(0, min(colnx-1, (int) ((tbox.min.x - colbox.min.x) / cellx)));
+            xhi = max(0, min(colnx-1, (int) ((tbox.max.x - colbox.min.x) / cellx)));
+        }
+        if(celly > 0.0f)
+        {
+            ylo = max(0, min(colny-1, (int) ((tbox.min.y - colbox.min.y) / celly)));
+            yhi = max(0, min(colny-1, (int) ((tbox.max.y - colbox.min.y) / celly)));
+        }
+        for(x = xlo; x <= xhi; x++)
+            for(y = ylo; y <= yhi; y++)
+                colgrid[x * colny + y].push_back(t);
+    }
+}
+
+CellClass Mesh::classifyBox(cgp::BoundBox box)
+{
+    cgp::BoundBox tbox;
+    cgp::Point center;
+    std::vector<float> spans;
+    float cellx, celly;
+    int xlo, xhi, ylo, yhi, x, y, t, p, h;
+    bool inside;
+
+    if(colgrid.empty())
+        return BaseShape::classifyBox(box);
+    if(!box.overlaps(colbox))
+        return CellClass::OUTSIDE;
+
+    // any triangle whose bounds reach the box may cross it
+    cellx = (colbox.max.x - colbox.min.x) / (float) colnx;
+    celly = (colbox.max.y - colbox.min.y) / (float) colny;
+    xlo = 0; xhi = colnx-1; ylo = 0; yhi = colny-1;
+    if(cellx > 0.0f)
+    {
+        xlo = max(0, min(colnx-1, (int) ((box.min.x - colbox.min.x) / cellx)));
+        xhi = max(0, min(colnx-1, (int) ((box.max.x - colbox.min.x) / cellx)));
+    }
+    if(celly > 0.0f)
+    {
+        ylo = max(0, min(colny-1, (int) ((box.min.y - colbox.min.y) / celly)));
+        yhi = max(0, min(colny-1, (int) ((box.max.y - colbox.min.y) / celly)));
+    }
+    for(x = xlo; x <= xhi; x++)
+        for(y = ylo; y <= yhi; y++)
+            for(t = 0; t < (int) colgrid[x * colny + y].size(); t++)
+            {
+                tbox.reset();
+                for(p = 0; p < 3; p++)
+                    tbox.includePnt(colverts[tris[colgrid[x * colny + y][t]].v[p]]);
+                if(tbox.overlaps(box))
+                    return CellClass::BOUNDARY;
+            }
+
+    // no surface in the box, so the whole box shares the containment of its center
+    center = cgp::Point(0.5f * (box.min.x + box.max.x), 0.5f * (box.min.y + box.max.y), 0.5f * (box.min.z + box.max.z));
+    if(columnSpans(center.x, center.y, spans))
+    {
+        inside = false;
+        for(h = 0; h+1 < (int) spans.size(); h += 2)
+            if(center.z >= spans[h] && center.z <= spans[h+1])
+                inside = true;
+    }
+    else
+        inside = pointContainment(center);
+    return inside ? CellClass::INSIDE : CellClass::OUTSIDE;
+}
+
+bool Mesh::columnSpans(float x, float y, std::vector<float> &spans)
+{
+    std::vector<float> hits;
+    cgp::Point * tv[3], * ep, * eq;
+    double w[3], wsum, area, z;
+    float cellx, celly;
+    int cx, cy, c, t, p, h;
+    bool swapped, hit;
+
+    spans.clear();
+    if(colgrid.empty())
+        return false;
+    if(x < colbox.min.x || x > colbox.max.x || y < colbox.min.y || y > colbox.max.y)
+        return true;
+
+    // only the bin holding the line needs to be searched, so every candidate triangle is tested once
+    cellx = (colbox.max.x - colbox.min.x) / (float) colnx;
+    celly = (colbox.max.y - colbox.min.y) / (float) colny;
+    cx = (cellx > 0.0f) ? max(0, min(colnx-1, (int) ((x - colbox.min.x) / cellx))) : 0;
+    cy = (celly > 0.0f) ? max(0, min(colny-1, (int) ((y - colbox.min.y) / celly))) : 0;
+    c = cx * colny + cy;
+
+    for(t = 0; t < (int) colgrid[c].size(); t++)
+    {
+        for(p = 0; p < 3; p++)
+            tv[p] = &colverts[tris[colgrid[c][t]].v[p]];
+
+        // orient counter-clockwise in the xy plane, triangles seen edge-on cannot be crossed
+        area = ((double) tv[1]->x - tv[0]->x) * ((double) tv[2]->y - tv[0]->y) - ((double) tv[1]->y - tv[0]->y) * ((double) tv[2]->x - tv[0]->x);
+        if(area == 0.0)
+            continue;
+        if(area < 0.0)
+            std::swap(tv[1], tv[2]);
+
+        // w[p] is the edge function of the edge opposite vertex p. Edges are evaluated in a canonical vertex
+        // order so that the two triangles sharing an edge see exactly opposite values, and a line exactly on
+        // an edge is given to just one side of it by a top-left rule. This also makes vertex hits count once.
+        hit = true;
+        for(p = 0; p < 3 && hit; p++)
+        {
+            ep = tv[(p+1)%3]; eq = tv[(p+2)%3];
+            swapped = (eq->x < ep->x) || (eq->x == ep->x && eq->y < ep->y);
+            if(swapped)
+                std::swap(ep, eq);
+            w[p] = ((double) eq->x - ep->x) * ((double) y - ep->y) - ((double) eq->y - ep->y) * ((double) x - ep->x);
+            if(swapped)
+            {
+                w[p] = -w[p];
+                std::swap(ep, eq);
+            }
+            if(w[p] < 0.0)
+                hit = false;
+            else if(w[p] == 0.0) // on the edge, keep only for edges pointing up or along -x
+                hit = (eq->y > ep->y) || (eq->y == ep->y && eq->x < ep->x);
+        }
+
+        if(hit)
+        {
+            wsum = w[0] + w[1] + w[2];
+            if(wsum > 0.0)
+                z = (w[0] * tv[0]->z + w[1] * tv[1]->z + w[2] * tv[2]->z) / wsum;
+            else
+                z = tv[0]->z;
+            hits.push_back((float) z);
+        }
+    }
+
+    // an odd number of crossings cannot be paired into intervals
+    if((int) hits.size() % 2 != 0)
+        return false;
+    std::sort(hits.begin(), hits.end());
+    for(h = 0; h < (int) hits.size(); h++)
+        spans.push_back(hits[h]);
+    return true;
+}
+
 void Mesh::boxFit(float sidelen)
 {
     cgp::Point pnt;
@@ -1056,3 +1752,327 @@ bool Mesh::manifoldValidity()
     // which is beyond the scope of this assignment
     return true;
 }
+
+int Mesh::decimate(int targettris, float tolerance)
+{
+    const float maxturn = 0.2f; // smallest cosine between a triangle normal before and after a collapse
+    int nv = (int) verts.size(), nt = (int) tris.size();
+    std::vector<Quadric> quad(nv);
+    std::vector<int> refs, tstart(nv), tcount(nv), version(nv, 0), mark(nv, -1);
+    std::vector<char> locked(nv, 0), deadvert(nv, 0), deadtri(nt, 0);
+    std::vector<EdgeCollapse> slots;
+    std::vector<int> freeslots;
+    std::vector<std::uint64_t> heap;
+    std::vector<cgp::Point> newverts;
+    std::vector<Triangle> newtris;
+    std::vector<int> remap;
+    long initrefs;
+    double maxcost, nx, ny, nz, len;
+    int i, j, k, t, v, w, v0, v1, live, stamp, common, opp[2];
+    std::uint64_t key;
+    std::uint32_t bits;
+    float cost;
+    cgp::Point pos;
+    cgp::Vector e1, e2, nold, nnew;
+    bool valid;
+
+    if(nt == 0 || (targettris > 0 && nt <= targettris))
+        return nt;
+    maxcost = (tolerance < 0.0f) ? HUGE_VAL : (double) tolerance * (double) tolerance;
+
+    // the quadric of each vertex starts as the planes of its triangles
+    for(t = 0; t < nt; t++)
+    {
+        cgp::Point &a = verts[tris[t].v[0]], &b = verts[tris[t].v[1]], &c = verts[tris[t].v[2]];
+        nx = ((double) b.y - a.y) * ((double) c.z - a.z) - ((double) b.z - a.z) * ((double) c.y - a.y);
+        ny = ((double) b.z - a.z) * ((double) c.x - a.x) - ((double) b.x - a.x) * ((double) c.z - a.z);
+        nz = ((double) b.x - a.x) * ((double) c.y - a.y) - ((double) b.y - a.y) * ((double) c.x - a.x);
+        len = sqrt(nx * nx + ny * ny + nz * nz);
+        if(len > 0.0)
+        {
+            nx /= len; ny /= len; nz /= len;
+            for(i = 0; i < 3; i++)
+                quad[tris[t].v[i]].addPlane(nx, ny, nz, -(nx * a.x + ny * a.y + nz * a.z));
+        }
+    }
+
+    // triangles around each vertex as runs of refs, rebuilt from the live triangles when superseded runs pile up
+    auto buildRefs = [&]()
+    {
+        int r, s;
+        std::fill(tcount.begin(), tcount.end(), 0);
+        for(r = 0; r < nt; r++)
+            if(!deadtri[r])
+                for(s = 0; s < 3; s++)
+                    tcount[tris[r].v[s]]++;
+        tstart[0] = 0;
+        for(s = 1; s < nv; s++)
+            tstart[s] = tstart[s-1] + tcount[s-1];
+        refs.resize(nv > 0 ? tstart[nv-1] + tcount[nv-1] : 0);
+        std::fill(tcount.begin(), tcount.end(), 0);
+        for(r = 0; r < nt; r++)
+            if(!deadtri[r])
+                for(s = 0; s < 3; s++)
+                {
+                    v = tris[r].v[s];
+                    refs[tstart[v] + tcount[v]++] = r;
+                }
+    };
+    buildRefs();
+    initrefs = (long) refs.size();
+    refs.reserve(initrefs * 2);
+
+    // lock vertices on edges that do not have exactly two triangles, or on degenerate triangles
+    for(v = 0; v < nv; v++)
+    {
+        for(i = 0; i < tcount[v]; i++)
+        {
+            Triangle &tri = tris[refs[tstart[v] + i]];
+            if(tri.v[0] == tri.v[1] || tri.v[1] == tri.v[2] || tri.v[2] == tri.v[0])
+                locked[tri.v[0]] = locked[tri.v[1]] = locked[tri.v[2]] = 1;
+            for(j = 0; j < 3; j++)
+                mark[tri.v[j]] = 0;
+        }
+        for(i = 0; i < tcount[v]; i++)
+            for(j = 0; j < 3; j++)
+                mark[tris[refs[tstart[v] + i]].v[j]]++;
+        for(i = 0; i < tcount[v]; i++)
+            for(j = 0; j < 3; j++)
+            {
+                w = tris[refs[tstart[v] + i]].v[j];
+                if(w != v && mark[w] != 2)
+                    locked[v] = locked[w] = 1;
+            }
+    }
+    std::fill(mark.begin(), mark.end(), -1);
+
+    // quadric error of merging an edge, at the minimiser of the summed quadric when it is well defined and close
+    // to the edge, otherwise at the best of the midpoint and endpoints. Ties go to the midpoint, so that flat regions,
+    // where every choice costs nothing, do not collapse into fans around a fixed vertex.
+    auto edgeCost = [&](int a, int b, cgp::Point &p)
+    {
+        Quadric q = quad[a];
+        double det, trace, x, y, z, best, err, mx, my, mz, half2;
+        int c;
+
+        q.add(quad[b]);
+        const double * m = q.q;
+        det = m[0] * (m[4] * m[7] - m[5] * m[5]) - m[1] * (m[1] * m[7] - m[5] * m[2]) + m[2] * (m[1] * m[5] - m[4] * m[2]);
+        trace = m[0] + m[4] + m[7];
+        mx = 0.5 * ((double) verts[a].x + verts[b].x); my = 0.5 * ((double) verts[a].y + verts[b].y); mz = 0.5 * ((double) verts[a].z + verts[b].z);
+        half2 = 0.25 * (((double) verts[a].x - verts[b].x) * ((double) verts[a].x - verts[b].x) + ((double) verts[a].y - verts[b].y) * ((double) verts[a].y - verts[b].y)
+                + ((double) verts[a].z - verts[b].z) * ((double) verts[a].z - verts[b].z));
+        if(fabs(det) > 1.0e-9 * trace * trace * trace)
+        {
+            // Cramer's rule on the upper 3x3 block against minus the last column
+            x = (-m[3] * (m[4] * m[7] - m[5] * m[5]) + m[1] * (m[6] * m[7] - m[5] * m[8]) - m[2] * (m[6] * m[5] - m[4] * m[8])) / det;
+            y = (m[0] * (-m[6] * m[7] + m[8] * m[5]) + m[3] * (m[1] * m[7] - m[5] * m[2]) + m[2] * (-m[1] * m[8] + m[6] * m[2])) / det;
+            z = (m[0] * (-m[4] * m[8] + m[5] * m[6]) - m[1] * (-m[1] * m[8] + m[6] * m[2]) - m[3] * (m[1] * m[5] - m[4] * m[2])) / det;
+            if((x - mx) * (x - mx) + (y - my) * (y - my) + (z - mz) * (z - mz) <= 4.0 * half2)
+            {
+                p = cgp::Point((float) x, (float) y, (float) z);
+                return (float) std::max(0.0, q.eval(x, y, z));
+            }
+        }
+        best = HUGE_VAL;
+        for(c = 0; c < 3; c++)
+        {
+            x = (c == 0) ? mx : ((c == 1) ? verts[a].x : verts[b].x);
+            y = (c == 0) ? my : ((c == 1) ? verts[a].y : verts[b].y);
+            z = (c == 0) ? mz : ((c == 1) ? verts[a].z : verts[b].z);
+            err = q.eval(x, y, z);
+            if(err < best)
+            {
+                best = err;
+                p = cgp::Point((float) x, (float) y, (float) z);
+            }
+        }
+        return (float) std::max(0.0, best);
+    };
+
+    // min-heap of 64-bit keys, the cost in the high half and a slot in the low half. A non-negative float orders
+    // the same as its bit pattern, and small keys keep the heap compact. Slots are recycled as keys are popped.
+    auto heapOrder = std::greater<std::uint64_t>();
+    auto makeKey = [&](int a, int b)
+    {
+        EdgeCollapse ec;
+        cgp::Point p;
+        float cost;
+        std::uint32_t bits;
+        int s;
+
+        cost = edgeCost(a, b, p);
+        memcpy(&bits, &cost, sizeof(bits));
+        ec.v[0] = a; ec.v[1] = b;
+        ec.version[0] = version[a]; ec.version[1] = version[b];
+        if(freeslots.empty())
+        {
+            s = (int) slots.size();
+            slots.push_back(ec);
+        }
+        else
+        {
+            s = freeslots.back();
+            freeslots.pop_back();
+            slots[s] = ec;
+        }
+        return ((std::uint64_t) bits << 32) | (std::uint64_t) (std::uint32_t) s;
+    };
+    auto pushEdge = [&](int a, int b)
+    {
+        heap.push_back(makeKey(a, b));
+        std::push_heap(heap.begin(), heap.end(), heapOrder);
+    };
+    heap.reserve((std::size_t) nt * 3 / 2 + 16);
+    slots.reserve((std::size_t) nt * 3 / 2 + 16);
+    for(t = 0; t < nt; t++)
+        for(i = 0; i < 3; i++)
+        {
+            v0 = tris[t].v[i]; v1 = tris[t].v[(i+1)%3];
+            if(v0 < v1 && !locked[v0] && !locked[v1]) // a closed edge is traversed both ways, so take the ascending one
+                heap.push_back(makeKey(v0, v1));
+        }
+    std::make_heap(heap.begin(), heap.end(), heapOrder);
+
+    live = nt;
+    stamp = 0;
+    while(!heap.empty() && (targettris <= 0 || live > targettris))
+    {
+        std::pop_heap(heap.begin(), heap.end(), heapOrder);
+        key = heap.back();
+        heap.pop_back();
+        EdgeCollapse ec = slots[(int) (key & 0xffffffffu)];
+        freeslots.push_back((int) (key & 0xffffffffu));
+        v0 = ec.v[0]; v1 = ec.v[1];
+        if(deadvert[v0] || deadvert[v1] || version[v0] != ec.version[0] || version[v1] != ec.version[1])
+            continue; // stale
+        bits = (std::uint32_t) (key >> 32);
+        memcpy(&cost, &bits, sizeof(cost));
+        if((double) cost > maxcost)
+            break;
+        edgeCost(v0, v1, pos);
+
+        // link condition: the endpoints share exactly the two neighbours opposite the edge, and neither of those
+        // is left with fewer than three triangles
+        stamp += 2;
+        for(i = 0; i < tcount[v0]; i++)
+            for(j = 0; j < 3; j++)
+                mark[tris[refs[tstart[v0] + i]].v[j]] = stamp;
+        common = 0;
+        for(i = 0; i < tcount[v1]; i++)
+            for(j = 0; j < 3; j++)
+            {
+                w = tris[refs[tstart[v1] + i]].v[j];
+                if(w != v0 && w != v1 && mark[w] == stamp)
+                {
+                    mark[w] = stamp + 1;
+                    if(common < 2)
+                        opp[common] = w;
+                    common++;
+                }
+            }
+        valid = (common == 2 && tcount[opp[0]] > 3 && tcount[opp[1]] > 3);
+
+        // no triangle that survives the collapse may fold over or collapse to a sliver
+        for(k = 0; k < 2 && valid; k++)
+        {
+            v = (k == 0) ? v0 : v1;
+            for(i = 0; i < tcount[v] && valid; i++)
+            {
+                Triangle &tri = tris[refs[tstart[v] + i]];
+                if((tri.v[0] == v0 || tri.v[1] == v0 || tri.v[2] == v0) && (tri.v[0] == v1 || tri.v[1] == v1 || tri.v[2] == v1))
+                    continue; // removed by the collapse
+                for(j = 0; j < 3 && tri.v[j] != v; j++);
+                cgp::Point &a = verts[tri.v[j]], &b = verts[tri.v[(j+1)%3]], &c = verts[tri.v[(j+2)%3]];
+                e1.diff(a, b); e2.diff(a, c);
+                nold.cross(e1, e2);
+                e1.diff(pos, b); e2.diff(pos, c);
+                nnew.cross(e1, e2);
+                len = (double) nnew.length();
+                valid = len > 0.0 && (double) nnew.dot(nold) >= (double) maxturn * len * (double) nold.length();
+            }
+        }
+        if(!valid)
+            continue;
+
+        // merge v1 into v0, dropping the two triangles on the edge
+        verts[v0] = pos;
+        quad[v0].add(quad[v1]);
+        deadvert[v1] = 1;
+        version[v0]++;
+        for(i = 0; i < tcount[v1]; i++)
+        {
+            t = refs[tstart[v1] + i];
+            for(j = 0; j < 3 && tris[t].v[j] != v0; j++);
+            if(j < 3)
+            {
+                deadtri[t] = 1;
+                live--;
+                for(j = 0; j < 2; j++)
+                    tcount[opp[j]] -= (tris[t].v[0] == opp[j] || tris[t].v[1] == opp[j] || tris[t].v[2] == opp[j]) ? 1 : 0;
+            }
+            else
+            {
+                for(j = 0; j < 3; j++)
+                    if(tris[t].v[j] == v1)
+                        tris[t].v[j] = v0;
+            }
+        }
+
+        // the triangle run of each opposite vertex loses a dead entry, which is swept out in place
+        for(j = 0; j < 2; j++)
+        {
+            w = opp[j];
+            for(i = 0, k = 0; i < tcount[w] + 1; i++)
+                if(!deadtri[refs[tstart[w] + i]])
+                    refs[tstart[w] + k++] = refs[tstart[w] + i];
+        }
+
+        // v0 takes a fresh run at the end of refs holding the survivors of both runs
+        k = (int) refs.size();
+        for(i = 0; i < tcount[v0]; i++)
+            if(!deadtri[refs[tstart[v0] + i]])
+                refs.push_back(refs[tstart[v0] + i]);
+        for(i = 0; i < tcount[v1]; i++)
+            if(!deadtri[refs[tstart[v1] + i]])
+                refs.push_back(refs[tstart[v1] + i]);
+        tstart[v0] = k;
+        tcount[v0] = (int) refs.size() - k;
+        tcount[v1] = 0;
+        if((long) refs.size() > initrefs * 2)
+            buildRefs();
+
+        // every edge around v0 has changed cost
+        stamp += 2;
+        for(i = 0; i < tcount[v0]; i++)
+            for(j = 0; j < 3; j++)
+            {
+                w = tris[refs[tstart[v0] + i]].v[j];
+                if(w != v0 && mark[w] != stamp && !locked[w])
+                {
+                    mark[w] = stamp;
+                    pushEdge(v0, w);
+                }
+            }
+    }
+
+    // compact the surviving vertices and triangles
+    remap.assign(nv, -1);
+    for(t = 0; t < nt; t++)
+        if(!deadtri[t])
+        {
+            for(i = 0; i < 3; i++)
+            {
+                v = tris[t].v[i];
+                if(remap[v] < 0)
+                {
+                    remap[v] = (int) newverts.size();
+                    newverts.push_back(verts[v]);
+                }
+                tris[t].v[i] = remap[v];
+            }
+            newtris.push_back(tris[t]);
+        }
+    setGeometry(newverts, newtris);
+    return (int) tris.size();
+}
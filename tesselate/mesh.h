@@ -15,6 +15,7 @@
 using namespace std;
 
 const int sphperdim = 20;
+const int bvhleafsize = 4; ///< maximum number of triangles in a leaf of the mesh distance hierarchy
 
 /**
  * A triangle in 3D space, with 3 indices into a vertex list and an outward facing normal. Triangle winding is counterclockwise.
@@ -33,6 +34,70 @@ struct Edge
     int v[2];   ///< indices into the vertex list for edge endpoints
 };
 
+/**
+ * A node of a bounding volume hierarchy over triangles. Leaves reference a run of triangle indices, internal nodes
+ * reference two children.
+ */
+struct TriBVHNode
+{
+    cgp::BoundBox box;  ///< bounds of every triangle below this node
+    int left, right;    ///< child node indices, -1 for a leaf
+    int first, count;   ///< run of entries in the triangle index list, for leaves only
+};
+
+/**
+ * Error quadric of Garland and Heckbert, a symmetric 4x4 matrix Q such that vQv is the sum of squared distances
+ * from a point v = (x, y, z, 1) to a set of planes. Only the upper triangle is stored.
+ */
+struct Quadric
+{
+    double q[10];   ///< aa, ab, ac, ad, bb, bc, bd, cc, cd, dd for planes ax + by + cz + d = 0
+
+    /// Zero quadric, with no planes
+    Quadric(){ for(int i = 0; i < 10; i++) q[i] = 0.0; }
+
+    /**
+     * Add the squared distance to a plane
+     * @param a, b, c   unit plane normal
+     * @param d         plane offset
+     */
+    void addPlane(double a, double b, double c, double d)
+    {
+        q[0] += a*a; q[1] += a*b; q[2] += a*c; q[3] += a*d; q[4] += b*b;
+        q[5] += b*c; q[6] += b*d; q[7] += c*c; q[8] += c*d; q[9] += d*d;
+    }
+
+    /// Accumulate the planes of another quadric
+    void add(const Quadric &o){ for(int i = 0; i < 10; i++) q[i] += o.q[i]; }
+
+    /// Sum of squared distances from a point to the planes
+    double eval(double x, double y, double z) const
+    {
+        return x*(q[0]*x + 2.0*(q[1]*y + q[2]*z + q[3])) + y*(q[4]*y + 2.0*(q[5]*z + q[6])) + z*(q[7]*z + 2.0*q[8]) + q[9];
+    }
+};
+
+/**
+ * Candidate edge collapse referenced from the decimation heap, which is ordered by cost. Entries are never updated
+ * in place. They go stale when either endpoint is moved, which the vertex version stamps detect when the entry
+ * reaches the top of the heap.
+ */
+struct EdgeCollapse
+{
+    int v[2];           ///< edge endpoints, the first of which is kept
+    int version[2];     ///< version stamps of the endpoints when the entry was made
+};
+
+/**
+ * Classification of an axis-aligned cell of space against a solid
+ */
+enum class CellClass
+{
+    OUTSIDE,    ///< no point of the cell lies inside the solid
+    INSIDE,     ///< every point of the cell lies inside the solid
+    BOUNDARY,   ///< the cell may straddle the surface of the solid
+};
+
 /**
  * Abstract base class for shapes
  */
@@ -50,6 +115,15 @@ public:
      */
     virtual void genGeometry(ShapeGeometry * geom, View * view)=0;
 
+    /**
+     * Add the shape as a transformed unit primitive for instanced rendering, instead of tessellating it with
+     * genGeometry. Shapes that have no matching unit primitive leave this as is.
+     * @param[out] inst instance buffer to add to
+     * @retval true if an instance was added,
+     * @retval false if the shape has to be drawn with genGeometry
+     */
+    virtual bool genInstance(InstanceBuffer *){ return false; }
+
     /**
      * Test whether a point falls inside the shape. Will need to be overridden by each inheriting class.
      * @param pnt   point to test for containment
@@ -57,6 +131,56 @@ public:
      * @retval false otherwise
      */
     virtual bool pointContainment(cgp::Point pnt)=0;
+
+    /**
+     * Find the signed distance from a point to the surface of the shape, negative inside. Will need to be
+     * overridden by each inheriting class.
+     * @param pnt   point to query
+     * @returns signed distance, whose magnitude never exceeds the true distance to the surface
+     */
+    virtual float signedDistance(cgp::Point pnt)=0;
+
+    /**
+     * Fingerprint the parameters that determine the solid, so that results derived from it can be cached and
+     * reused until it is edited. Will need to be overridden by each inheriting class.
+     * @returns 64-bit content hash, equal for shapes describing the same solid
+     */
+    virtual std::uint64_t contentHash()=0;
+
+    /**
+     * Build any acceleration structures used by pointContainment ahead of time, so that subsequent queries
+     * only read shared state and can safely be issued from several threads at once.
+     */
+    virtual void prepareQueries(){}
+
+    /**
+     * Find an axis-aligned box in world space enclosing the shape, so that containment need only be tested
+     * inside it. The default is an unbounded box, which is always safe.
+     * @returns bounding box of the shape
+     */
+    virtual cgp::BoundBox getBounds();
+
+    /// Whether columnSpans is implemented, otherwise voxelisation falls back on pointContainment
+    virtual bool hasColumnSpans(){ return false; }
+
+    /**
+     * Find the intervals of a line parallel to the z axis that fall inside the shape. Only valid when
+     * hasColumnSpans is true.
+     * @param x, y          world-space position of the line
+     * @param[out] spans    closed intervals as consecutive (zin, zout) pairs in increasing z order
+     * @retval true if the spans are reliable,
+     * @retval false if this particular line could not be resolved and pointContainment should be used instead
+     */
+    virtual bool columnSpans(float, float, std::vector<float> &spans){ spans.clear(); return false; }
+
+    /**
+     * Conservatively classify a box against the shape. OUTSIDE and INSIDE must only be returned when they
+     * hold for every point of the box, BOUNDARY is always a safe answer. The default rejects boxes that miss
+     * the shape bounds and otherwise compares the signed distance of the box center with its half diagonal.
+     * @param box   world-space axis-aligned box
+     * @returns classification of the box
+     */
+    virtual CellClass classifyBox(cgp::BoundBox box);
 };
 
 /**
@@ -94,6 +218,26 @@ public:
      */
     void genGeometry(ShapeGeometry * geom, View * view);
 
+    /**
+     * Add the sphere as a scaled and translated unit sphere
+     * @param[out] inst instance buffer to add to
+     * @retval true always
+     */
+    bool genInstance(InstanceBuffer * inst);
+
+    /**
+     * Containment test on the offset of a point from the center, shared with the fused CSG kernel so that both
+     * round identically
+     * @param dx, dy, dz    offset of the point from the sphere center
+     * @param r2            squared radius, as r * r
+     * @retval true if the point falls within the sphere,
+     * @retval false otherwise
+     */
+    static inline bool contains(float dx, float dy, float dz, float r2)
+    {
+        return dx * dx + dy * dy + dz * dz <= r2;
+    }
+
     /**
      * Test whether a point falls inside the sphere
      * @param pnt   point to test for containment
@@ -103,6 +247,39 @@ public:
      */
     bool pointContainment(cgp::Point pnt);
 
+    /**
+     * Find the signed distance from a point to the sphere surface
+     * @param pnt   point to query
+     * @returns distance from the center less the radius
+     */
+    float signedDistance(cgp::Point pnt);
+
+    /// Fingerprint the center and radius
+    std::uint64_t contentHash();
+
+    /**
+     * Find the axis-aligned bounds of the sphere
+     * @returns bounding box of the sphere
+     */
+    cgp::BoundBox getBounds();
+
+    /// Sphere spans are found analytically
+    bool hasColumnSpans(){ return true; }
+
+    /**
+     * Find the interval of a line parallel to the z axis that falls inside the sphere
+     * @param x, y          world-space position of the line
+     * @param[out] spans    (zin, zout) pair, or nothing if the line misses
+     * @retval true always
+     */
+    bool columnSpans(float x, float y, std::vector<float> &spans);
+
+    /**
+     * Classify a box by its nearest and farthest points from the sphere center
+     * @param box   world-space axis-aligned box
+     * @returns classification of the box
+     */
+    CellClass classifyBox(cgp::BoundBox box);
 };
 
 /**
@@ -135,6 +312,13 @@ public:
         r = radius;
     }
 
+   /**
+     * Build the rigid transform that takes the positive z axis onto the spine of the cylinder
+     * @param[out] tfm  translation to the start vertex followed by rotation onto the spine
+     * @returns length of the spine
+     */
+    float spineFrame(glm::mat4x4 &tfm);
+
    /**
      * Generate cylinder geometry for OpenGL rendering
      * @param[out] geom triangle-mesh geometry packed for OpenGL
@@ -142,6 +326,35 @@ public:
      */
     void genGeometry(ShapeGeometry * geom, View * view);
 
+    /**
+     * Add the cylinder as a unit cylinder scaled to its radius and length, then placed along its spine
+     * @param[out] inst instance buffer to add to
+     * @retval true always
+     */
+    bool genInstance(InstanceBuffer * inst);
+
+    /**
+     * Containment test against a cylinder given by its axis, shared with the fused CSG kernel so that both round
+     * identically. Branch free, so that loops over points vectorise.
+     * @param sx, sy, sz    start of the axis
+     * @param dx, dy, dz    axis from start to end
+     * @param den           squared axis length, zero for a degenerate axis which contains nothing
+     * @param r2            squared radius, as r * r
+     * @param x, y, z       point to test
+     * @retval true if the point falls within the cylinder,
+     * @retval false otherwise
+     */
+    static inline bool contains(float sx, float sy, float sz, float dx, float dy, float dz, float den, float r2,
+                                float x, float y, float z)
+    {
+        float t, vx, vy, vz;
+
+        // parameter of the closest point on the axis, then the offset from that point
+        t = (dx * (x - sx) + dy * (y - sy) + dz * (z - sz)) / den;
+        vx = sx + dx * t - x; vy = sy + dy * t - y; vz = sz + dz * t - z;
+        return (t >= 0.0f) & (t <= 1.0f) & (vx * vx + vy * vy + vz * vz <= r2);
+    }
+
     /**
      * Test whether a point falls inside the cylinder
      * @param pnt   point to test for containment
@@ -149,6 +362,43 @@ public:
      * @retval false otherwise
      */
     bool pointContainment(cgp::Point pnt);
+
+    /**
+     * Find the signed distance from a point to the capped cylinder surface, combining the radial distance from
+     * the axis with the distance beyond the end caps
+     * @param pnt   point to query
+     * @returns exact signed distance
+     */
+    float signedDistance(cgp::Point pnt);
+
+    /// Fingerprint the axis end points and radius
+    std::uint64_t contentHash();
+
+    /**
+     * Find the axis-aligned bounds of the cylinder, taking the end caps into account
+     * @returns bounding box of the cylinder
+     */
+    cgp::BoundBox getBounds();
+
+    /// Cylinder spans are found analytically, except for degenerate cylinders with no length
+    bool hasColumnSpans(){ return !(s == e); }
+
+    /**
+     * Find the interval of a line parallel to the z axis that falls inside the cylinder, by intersecting
+     * the quadratic distance-to-axis condition with the linear end cap conditions
+     * @param x, y          world-space position of the line
+     * @param[out] spans    (zin, zout) pair, or nothing if the line misses
+     * @retval true always
+     */
+    bool columnSpans(float x, float y, std::vector<float> &spans);
+
+    /**
+     * Classify a box against the cylinder. A box is outside if its bounding sphere misses the cylinder, and
+     * inside if all its corners are, since the cylinder is convex.
+     * @param box   world-space axis-aligned box
+     * @returns classification of the box
+     */
+    CellClass classifyBox(cgp::BoundBox box);
 };
 
 class TestMesh;
@@ -169,6 +419,12 @@ private:
     cgp::Vector trx;                 ///< translation
     float xrot, yrot, zrot;     ///< rotation angles about x, y, and z axes
     std::vector<Sphere> boundspheres; ///< bounding sphere accel structure
+    std::vector<cgp::Point> colverts; ///< world-space vertices used by column queries
+    std::vector<std::vector<int>> colgrid; ///< triangles binned by world-space xy extent, for column queries
+    cgp::BoundBox colbox;       ///< world-space bounds of colverts
+    int colnx, colny;           ///< number of column bins along x and y
+    std::vector<TriBVHNode> bvh;  ///< triangle hierarchy for distance queries, root first
+    std::vector<int> bvhtris;     ///< triangle indices referenced by bvh leaves
 
     /**
      * Search list of vertices to find matching point
@@ -201,6 +457,38 @@ private:
     /// Generate vertex normals by averaging normals of the surrounding faces
     void deriveVertNorms();
 
+    /// Transform vertices into world space and bin triangles by their xy extent, for column queries
+    void buildColumnAccel();
+
+    /// Build a bounding volume hierarchy over the world-space triangles, for distance queries
+    void buildDistanceAccel();
+
+    /**
+     * Recursively build the distance hierarchy over a run of the triangle index list
+     * @param first, count  run of entries in bvhtris
+     * @returns index of the new node
+     */
+    int buildBVHNode(int first, int count);
+
+    /**
+     * Find the closest point on a triangle to a query point
+     * @param pnt       query point
+     * @param a, b, c   triangle vertices
+     * @returns squared distance to the closest point
+     */
+    float triangleSqrDist(const glm::vec3 &pnt, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c);
+
+    /**
+     * Find the squared distance from a point to an axis-aligned box, zero if the point is inside
+     * @param box   box to measure against
+     * @param pnt   query point
+     * @returns squared distance
+     */
+    float boxSqrDist(const cgp::BoundBox &box, cgp::Point pnt);
+
+    /// Centroid of a triangle in world space, from the transformed column vertices
+    cgp::Point triCentroid(int t);
+
     /// Generate face normals from triangle vertex positions
     void deriveFaceNorms();
 
@@ -251,6 +539,22 @@ public:
     /// Test whether mesh is empty of any geometry (true if empty, false otherwise)
     bool empty(){ return verts.empty(); }
 
+    /// Getter for the number of triangles in the mesh
+    int getNumTris(){ return (int) tris.size(); }
+
+    /// Getter for the number of vertices in the mesh
+    int getNumVerts(){ return (int) verts.size(); }
+
+    /**
+     * Replace the mesh with generated geometry and derive its face and vertex normals. Vertices are taken as
+     * given, so generators that share vertices between triangles avoid a mergeVerts pass. Scale, rotation,
+     * translation and colour are kept.
+     * @param[in,out] newverts  vertex positions, swapped into the mesh and left empty
+     * @param[in,out] newtris   triangles indexing newverts, wound counter-clockwise seen from outside,
+     *                          swapped into the mesh and left empty
+     */
+    void setGeometry(std::vector<cgp::Point> &newverts, std::vector<Triangle> &newtris);
+
     /// Setter for scale
     void setScale(float scf){ scale = scf; }
 
@@ -289,13 +593,63 @@ public:
     void genGeometry(ShapeGeometry * geom, View * view);
 
     /**
-     * Test whether a point falls inside the mesh using ray-mesh intersection tests
+     * Test whether a point falls inside the mesh using ray-mesh intersection tests. Ray directions are
+     * pseudo-random but seeded from the query point, so results are repeatable and queries are thread safe
+     * once prepareQueries has been called.
      * @param pnt   point to test for containment
      * @retval true if the point falls within the mesh, 
      * @retval false otherwise
      */
     bool pointContainment(cgp::Point pnt);
 
+    /**
+     * Find the signed distance from a point to the mesh, as the distance to the closest triangle found through a
+     * bounding volume hierarchy, negated if the point is inside. Falls back on a search of every triangle if
+     * prepareQueries has not been called.
+     * @param pnt   point to query
+     * @returns signed distance
+     */
+    float signedDistance(cgp::Point pnt);
+
+    /// Fingerprint the vertices, triangle indices and model transform
+    std::uint64_t contentHash();
+
+    /**
+     * Build the bounding sphere acceleration structure if it does not already exist, and rebuild the column
+     * and distance acceleration structures for the current transform
+     */
+    void prepareQueries();
+
+    /// Mesh spans are found by column parity once prepareQueries has been called
+    bool hasColumnSpans(){ return !tris.empty(); }
+
+    /**
+     * Find the intervals of a line parallel to the z axis that fall inside the mesh, by sorting the heights
+     * at which the line crosses triangles and toggling occupancy at each crossing. Lines through vertices
+     * and edges are resolved with a consistent tie-breaking rule so that each crossing is counted once.
+     * @param x, y          world-space position of the line
+     * @param[out] spans    closed intervals as consecutive (zin, zout) pairs in increasing z order
+     * @retval true if the line crosses the surface an even number of times,
+     * @retval false if the crossings do not pair up (e.g., the line passes through a hole in the mesh) or
+     *               the column acceleration structure has not been built
+     */
+    bool columnSpans(float x, float y, std::vector<float> &spans);
+
+    /**
+     * Classify a box against the mesh. A box that overlaps the bounds of no triangle cannot cross the surface,
+     * so it takes the containment of its center. Requires prepareQueries, otherwise only boxes missing the
+     * mesh bounds are resolved.
+     * @param box   world-space axis-aligned box
+     * @returns classification of the box
+     */
+    CellClass classifyBox(cgp::BoundBox box);
+
+    /**
+     * Find the axis-aligned bounds of the mesh after its scale, rotation and translation are applied
+     * @returns bounding box of the transformed mesh vertices
+     */
+    cgp::BoundBox getBounds();
+
     /**
      * Scale geometry to fit bounding cube centered at origin
      * @param sidelen   length of one side of the bounding cube
@@ -335,6 +689,19 @@ public:
      * @todo manifoldValidity requires completing for CGP Prac1
      */
     bool manifoldValidity();
+
+    /**
+     * Simplify the mesh by quadric error edge collapse, cheapest collapse first. Each collapse merges an edge into
+     * the point minimising the summed squared distance to the planes of the original triangles around it. Collapses
+     * that would pinch the surface, change the topology or fold a triangle over are skipped, and vertices on
+     * boundary or non-manifold edges are never moved, so a closed manifold stays closed and manifold. Vertex
+     * normals are derived afresh afterwards, while scale, rotation, translation and colour are kept.
+     * @param targettris    stop once no more than this many triangles remain, 0 for no limit on the count
+     * @param tolerance     stop before any collapse whose quadric error exceeds the square of this distance,
+     *                      negative for no limit on the error
+     * @returns number of triangles after decimation
+     */
+    int decimate(int targettris, float tolerance = -1.0f);
 };
 
 #endif
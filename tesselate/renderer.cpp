@@ -58,6 +58,10 @@ void Renderer::initShaders(void)
     s->setShaderSources(std::string("phong.frag"), std::string("phong.vert"));
     shaders["phong"] = s;
 
+    s = new shaderProgram();
+    s->setShaderSources(std::string("phong.frag"), std::string("phongInst.vert"));
+    shaders["phongInst"] = s;
+
     s = new shaderProgram();
     s->setShaderSources(std::string("rad_scaling_pass1.frag"), std::string("rad_scaling_pass1.vert"));
     shaders["rscale1"] = s;
@@ -113,12 +117,22 @@ void Renderer::draw(View * view)
     MVmx = view->getViewMtx();
     projMx = view->getProjMtx();
 
-    GLuint programID = (*shaders["phong"]).getProgramID();
+    GLuint phongID = (*shaders["phong"]).getProgramID();
+    GLuint instID = (*shaders["phongInst"]).getProgramID();
+    GLuint programID = phongID;
 
     glUseProgram(programID); CE();
 
     for (int i = 0; i < (int)drawCallData.size(); i++)
     {
+        // instanced draws take their model transform per instance in the vertex shader
+        GLuint drawID = (drawCallData[i].instances > 0) ? instID : phongID;
+        if (drawID != programID)
+        {
+            programID = drawID;
+            glUseProgram(programID); CE();
+        }
+
         glUniformMatrix4fv(glGetUniformLocation(programID, "MV"), 1, GL_FALSE, glm::value_ptr(MVmx) ); CE();
         glUniformMatrix4fv(glGetUniformLocation(programID, "MVproj"), 1, GL_FALSE, glm::value_ptr(MVP) ); CE();
         glUniformMatrix3fv(glGetUniformLocation(programID, "normMx"), 1, GL_FALSE, glm::value_ptr(normalMatrix)); CE();
@@ -143,7 +157,16 @@ void Renderer::draw(View * view)
         glUniform1f(glGetUniformLocation(programID, "shiny"), shinySpec); CE();
 
         glBindVertexArray(drawCallData[i].VAO); CE();
-        glDrawElements(GL_TRIANGLES, drawCallData[i].indexBufSize, GL_UNSIGNED_INT, (void*)(0)); CE();
+        if (drawCallData[i].instances > 0)
+        {
+            glDrawElementsInstanced(GL_TRIANGLES, drawCallData[i].indexBufSize, GL_UNSIGNED_INT,
+                                    (void*)(drawCallData[i].indexOffset * sizeof(GLuint)), drawCallData[i].instances); CE();
+        }
+        else
+        {
+            glDrawElements(GL_TRIANGLES, drawCallData[i].indexBufSize, GL_UNSIGNED_INT,
+                           (void*)(drawCallData[i].indexOffset * sizeof(GLuint))); CE();
+        }
         glBindVertexArray(0); CE();
     }
     
@@ -0,0 +1,53 @@
+#version 150
+#extension GL_ARB_explicit_attrib_location: enable
+
+// vertex shader: phongInst; Phong Model lighting of instanced primitives, each with its own model transform
+
+layout (location=0) in vec3 vertex;
+layout (location=1) in vec2 UV;
+layout (location=2) in vec3 vertexNormal;
+layout (location=3) in mat4 instanceMx; // per-instance model mx, occupies locations 3-6
+
+// transformations
+uniform mat4 MV; // model-view mx
+uniform mat4 MVproj; //model-view-projection mx
+uniform mat3 normMx; // normal matrix
+
+//colours and material
+uniform vec4 matDiffuse;
+uniform vec4 matAmbient;
+uniform vec4 lightpos; // in camera space
+uniform vec4 diffuseCol;
+uniform vec4 ambientCol;
+
+// per pixel values to be computed in fragment shader
+out vec3 normal; // vertex normal
+out vec3 lightDir; // toLight
+out vec3 halfVector;
+out vec4 diffuse;
+out vec4 ambient;
+
+out vec2 texCoord;
+
+void main(void)
+{
+    vec3 inNormal, v;
+
+    texCoord = UV;
+    v = (instanceMx * vec4(vertex, 1.0)).xyz;
+    inNormal = transpose(inverse(mat3(instanceMx))) * vertexNormal;
+
+    // map to camera space for lighting etc
+    normal = normalize(normMx * inNormal);
+
+    // vertex in camera coords
+    vec4 ecPos = MV * vec4(v, 1.0);
+
+    lightDir  = normalize(lightpos.xyz - ecPos.xyz);
+    halfVector = normalize(normalize(-ecPos.xyz) + lightDir);
+
+    diffuse = matDiffuse * diffuseCol;
+    ambient = matAmbient * ambientCol;
+
+    gl_Position = MVproj * vec4(v, 1.0); // clip space position
+}
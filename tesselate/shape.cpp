@@ -123,6 +123,42 @@ void ShapeGeometry::genSphere(float radius, int slices, int stacks, glm::mat4x4
     }
 }
 
+void ShapeGeometry::genCube(float side, glm::mat4x4 trm)
+{
+    int f, a, i, j, base;
+    float c[3], n[3];
+    int uv[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+    glm::vec4 p;
+    glm::vec3 v;
+
+    for(f = 0; f < 6; f++)
+    {
+        // face normal to axis a, on its high side for odd f, wound counter-clockwise seen from outside
+        a = f / 2;
+        base = int(verts.size()) / 8;
+        for(i = 0; i < 4; i++)
+        {
+            j = (f % 2 == 1) ? i : 3 - i;
+            c[a] = (float) (f % 2) * side;
+            c[(a + 1) % 3] = (float) uv[j][0] * side;
+            c[(a + 2) % 3] = (float) uv[j][1] * side;
+            n[a] = (f % 2 == 1) ? 1.0f : -1.0f;
+            n[(a + 1) % 3] = n[(a + 2) % 3] = 0.0f;
+
+            // apply transformation
+            p = trm * glm::vec4(c[0], c[1], c[2], 1.0f);
+            v = glm::transpose(glm::inverse(glm::mat3(trm))) * glm::vec3(n[0], n[1], n[2]);
+            v = glm::normalize(v);
+
+            verts.push_back(p.x); verts.push_back(p.y); verts.push_back(p.z); // position
+            verts.push_back(0.0f); verts.push_back(0.0f); // texture coordinates
+            verts.push_back(v.x); verts.push_back(v.y); verts.push_back(v.z); // normal
+        }
+        indices.push_back(base); indices.push_back(base+1); indices.push_back(base+2);
+        indices.push_back(base); indices.push_back(base+2); indices.push_back(base+3);
+    }
+}
+
 void ShapeGeometry::genMesh(std::vector<cgp::Point> * points, std::vector<cgp::Vector> * norms, std::vector<int> * faces, glm::mat4x4 trm)
 {
     int i, base;
@@ -162,6 +198,8 @@ ShapeDrawData ShapeGeometry::getDrawParameters()
     for(int i = 0; i < 4; i++)
         sdd.ambient[i] = ambient[i];
     sdd.indexBufSize = (int) indices.size();
+    sdd.indexOffset = 0;
+    sdd.instances = 0;
     sdd.texID = 0;
     sdd.current = false; // default setting
 
@@ -222,3 +260,177 @@ bool ShapeGeometry::bindBuffers(View * view)
         return false;
     }
 }
+
+InstanceBuffer::InstanceBuffer()
+{
+    ShapeGeometry unit;
+    glm::mat4 idt;
+    int p;
+
+    idt = glm::mat4(1.0f); // identity matrix
+
+    // unit primitives at the resolution that Sphere and Cylinder tessellate with, one after another
+    firstindex[(int) Primitive::SPHERE] = 0;
+    unit.genSphere(1.0f, 40, 40, idt);
+    firstindex[(int) Primitive::CYLINDER] = (int) unit.getIndices().size();
+    unit.genCylinder(1.0f, 1.0f, 12, 4, idt);
+    firstindex[(int) Primitive::CUBE] = (int) unit.getIndices().size();
+    unit.genCube(1.0f, idt);
+    firstindex[numprimitives] = (int) unit.getIndices().size();
+    unitverts = unit.getVerts();
+    unitindices = unit.getIndices();
+
+    for(p = 0; p < numprimitives; p++)
+    {
+        vaoInst[p] = 0;
+        vboInst[p] = 0;
+    }
+    vboUnit = 0;
+    iboUnit = 0;
+
+    // default colour
+    diffuse[0] = 0.325f; diffuse[1] = 0.235f; diffuse[3] = diffuse[2] = 1.0f;
+}
+
+void InstanceBuffer::clear()
+{
+    for(int p = 0; p < numprimitives; p++)
+        xforms[p].clear();
+}
+
+void InstanceBuffer::deleteBuffers()
+{
+    for(int p = 0; p < numprimitives; p++)
+    {
+        if(vaoInst[p] != 0)
+        {
+            glDeleteVertexArrays(1, &vaoInst[p]);
+            glDeleteBuffers(1, &vboInst[p]);
+            vaoInst[p] = 0;
+            vboInst[p] = 0;
+        }
+    }
+    if(vboUnit != 0)
+    {
+        glDeleteBuffers(1, &vboUnit);
+        glDeleteBuffers(1, &iboUnit);
+        vboUnit = 0;
+        iboUnit = 0;
+    }
+}
+
+void InstanceBuffer::setColour(GLfloat * col)
+{
+    int i;
+
+    for(i = 0; i < 4; i++)
+        diffuse[i] = col[i];
+    for(i = 0; i < 3; i++)
+        ambient[i] = diffuse[i] * 0.75f;
+    for(i = 0; i < 3; i++)
+        specular[i] = std::min(1.0f, diffuse[i] * 1.25f);
+}
+
+void InstanceBuffer::addInstance(Primitive prim, const glm::mat4x4 &trm)
+{
+    const float * m = glm::value_ptr(trm);
+
+    xforms[(int) prim].insert(xforms[(int) prim].end(), m, m + 16);
+}
+
+void InstanceBuffer::getIndexRange(Primitive prim, int &first, int &count)
+{
+    first = firstindex[(int) prim];
+    count = firstindex[(int) prim + 1] - first;
+}
+
+long InstanceBuffer::getInstanceBytes()
+{
+    long bytes = 0;
+
+    for(int p = 0; p < numprimitives; p++)
+        bytes += (long) (xforms[p].size() * sizeof(GLfloat));
+    return bytes;
+}
+
+bool InstanceBuffer::bindBuffers(View * view)
+{
+    bool any = false;
+    int p, c;
+
+    for(p = 0; p < numprimitives; p++)
+        any = any || !xforms[p].empty();
+    if(!any)
+        return false;
+
+    // the unit meshes never change, so are uploaded once
+    if(vboUnit == 0)
+    {
+        glGenBuffers(1, &vboUnit);
+        glBindBuffer(GL_ARRAY_BUFFER, vboUnit);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*(int) unitverts.size(), (GLfloat *) &unitverts[0], GL_STATIC_DRAW);
+        glGenBuffers(1, &iboUnit);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboUnit);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*(int) unitindices.size(), (GLuint *) &unitindices[0], GL_STATIC_DRAW);
+    }
+
+    for(p = 0; p < numprimitives; p++)
+    {
+        if(xforms[p].empty())
+            continue;
+        if(vaoInst[p] == 0)
+        {
+            glGenVertexArrays(1, &vaoInst[p]);
+            glBindVertexArray(vaoInst[p]);
+
+            // position, texture coordinate and normal attributes come from the shared unit mesh
+            glBindBuffer(GL_ARRAY_BUFFER, vboUnit);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboUnit);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8*sizeof(GLfloat), (void*)(0));
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 8*sizeof(GLfloat), (void*)(3*sizeof(GLfloat)));
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 8*sizeof(GLfloat), (void*)(5*sizeof(GLfloat)));
+
+            // the model transform advances once per instance, a column per attribute
+            glGenBuffers(1, &vboInst[p]);
+            glBindBuffer(GL_ARRAY_BUFFER, vboInst[p]);
+            for(c = 0; c < 4; c++)
+            {
+                glEnableVertexAttribArray(3 + c);
+                glVertexAttribPointer(3 + c, 4, GL_FLOAT, GL_FALSE, 16*sizeof(GLfloat), (void*)(c*4*sizeof(GLfloat)));
+                glVertexAttribDivisor(3 + c, 1);
+            }
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, vboInst[p]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*(int) xforms[p].size(), (GLfloat *) &xforms[p][0], GL_DYNAMIC_DRAW);
+    }
+    glBindVertexArray(0);
+    return true;
+}
+
+void InstanceBuffer::getDrawParameters(std::vector<ShapeDrawData> &sdds)
+{
+    ShapeDrawData sdd;
+    int p, i;
+
+    for(p = 0; p < numprimitives; p++)
+    {
+        if(xforms[p].empty())
+            continue;
+        sdd.VAO = vaoInst[p];
+        for(i = 0; i < 4; i++)
+            sdd.diffuse[i] = diffuse[i];
+        for(i = 0; i < 4; i++)
+            sdd.specular[i] = specular[i];
+        for(i = 0; i < 4; i++)
+            sdd.ambient[i] = ambient[i];
+        sdd.indexOffset = firstindex[p];
+        sdd.indexBufSize = firstindex[p + 1] - firstindex[p];
+        sdd.instances = (GLuint) (xforms[p].size() / 16);
+        sdd.texID = 0;
+        sdd.current = false; // default setting
+        sdds.push_back(sdd);
+    }
+}
@@ -18,10 +18,24 @@ struct ShapeDrawData
     GLfloat specular[4];    ///< specular colour
     GLfloat ambient[4];     ///< ambient colour
     GLuint indexBufSize;    ///< index buffer size - as required by DrawElements
+    GLuint indexOffset;     ///< first index to draw
+    GLuint instances;       ///< number of instances for an instanced draw, 0 for a plain draw
     bool   current;         ///< set to true is this is part of current manipulator
     GLuint texID;           ///< texture ID
 };
 
+/**
+ * Unit primitives that can be drawn instanced
+ */
+enum class Primitive
+{
+    SPHERE,     ///< sphere of unit radius about the origin
+    CYLINDER,   ///< uncapped cylinder of unit radius from the origin to z = 1
+    CUBE,       ///< cube from the origin to (1, 1, 1)
+};
+
+const int numprimitives = 3;    ///< number of Primitive values
+
 /**
  * Geometry in a format suitable for OpenGL
  */
@@ -93,6 +107,14 @@ public:
      */
     void genSphere(float radius, int slices, int stacks, glm::mat4x4 trm);
 
+    /**
+     * Create an axis-aligned cube with a transformation matrix applied and append to existing geometry. Faces do
+     * not share vertices, so that normals are flat.
+     * @param side      side length, with one corner at the origin
+     * @param trm       model transformation matrix
+     */
+    void genCube(float side, glm::mat4x4 trm);
+
     /**
      * Convert a mesh structure to openGL geometry
      * @param points    list of vertices
@@ -102,6 +124,12 @@ public:
      */
     void genMesh(std::vector<cgp::Point> * points, std::vector<cgp::Vector> * norms, std::vector<int> * faces, glm::mat4x4 trm);
 
+    /// Getter for the packed vertex data, eight floats per vertex for position, texture coordinates and normal
+    const std::vector<float> & getVerts(){ return verts; }
+
+    /// Getter for the triangle vertex indices
+    const std::vector<unsigned int> & getIndices(){ return indices; }
+
     /**
      * Return data required for a draw call, such as the VAO, colour, etc.
      */
@@ -115,4 +143,83 @@ public:
      */
     bool bindBuffers(View * view);
 };
+
+/**
+ * Geometry for repeated primitives drawn instanced. A single unit mesh of each primitive sits in a shared buffer,
+ * and instances differ only by a model transform in a per-instance attribute buffer. Transforms are gathered on
+ * the CPU, so instance buffers can be built and checked without an OpenGL context.
+ */
+class InstanceBuffer
+{
+private:
+    std::vector<float> unitverts;                   ///< vertex, texture and normal data of all unit primitives
+    std::vector<unsigned int> unitindices;          ///< triangle indices of all unit primitives
+    int firstindex[numprimitives+1];                ///< start of the index range of each primitive
+    std::vector<float> xforms[numprimitives];       ///< column-major 4x4 model transforms, 16 floats per instance
+    GLuint vaoInst[numprimitives], vboInst[numprimitives]; ///< openGL handles for per-primitive arrays and transforms
+    GLuint vboUnit, iboUnit;                        ///< openGL handles for the shared unit meshes
+    GLfloat diffuse[4], ambient[4], specular[4];    ///< material properties
+
+    /// Release the openGL arrays and buffers, if any have been created
+    void deleteBuffers();
+
+    // the openGL handles are owned, so a copy would release them twice
+    InstanceBuffer(const InstanceBuffer &) = delete;
+    InstanceBuffer &operator=(const InstanceBuffer &) = delete;
+
+public:
+
+    /// Default constructor, which tessellates the unit primitives
+    InstanceBuffer();
+
+    /// Destructor, which releases the openGL buffers
+    ~InstanceBuffer(){ clear(); deleteBuffers(); }
+
+    /// Remove all instances, keeping the unit primitives
+    void clear();
+
+    /// Setter for instance colour
+    void setColour(GLfloat * col);
+
+    /**
+     * Add an instance of a unit primitive
+     * @param prim  primitive to draw
+     * @param trm   model transformation matrix applied to the unit primitive
+     */
+    void addInstance(Primitive prim, const glm::mat4x4 &trm);
+
+    /// Getter for the number of instances of a primitive
+    int getNumInstances(Primitive prim){ return (int) xforms[(int) prim].size() / 16; }
+
+    /// Getter for the model transforms of a primitive, 16 floats per instance in column-major order
+    const float * getTransforms(Primitive prim){ return xforms[(int) prim].data(); }
+
+    /**
+     * Find the part of the shared index buffer holding a unit primitive
+     * @param prim          primitive to look up
+     * @param[out] first    first index of its triangles
+     * @param[out] count    number of indices
+     */
+    void getIndexRange(Primitive prim, int &first, int &count);
+
+    /// Getter for the shared unit meshes, eight floats per vertex as in ShapeGeometry
+    const std::vector<float> & getUnitVerts(){ return unitverts; }
+
+    /// Bytes of per-instance data uploaded by bindBuffers
+    long getInstanceBytes();
+
+    /**
+     * Bind the shared unit meshes, once, and the instance transforms for rendering. Only needs to be done if
+     * the instances change.
+     * @param view      current viewpoint
+     * @retval true if there are instances to draw
+     */
+    bool bindBuffers(View * view);
+
+    /**
+     * Append data for one instanced draw call per primitive with instances
+     * @param[out] sdds     draw parameters, appended to
+     */
+    void getDrawParameters(std::vector<ShapeDrawData> &sdds);
+};
 #endif
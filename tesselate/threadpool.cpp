@@ -0,0 +1,130 @@
+//
+// ThreadPool
+//
+
+#include "threadpool.h"
+#include <algorithm>
+
+using namespace std;
+
+ThreadPool::ThreadPool(int threads)
+{
+    int t;
+
+    if(threads <= 0)
+        threads = max(1, (int) std::thread::hardware_concurrency());
+    numthreads = threads;
+    pending = 0;
+    stopping = false;
+
+    // a single thread pool runs tasks on the caller so needs no workers
+    if(numthreads > 1)
+        for(t = 0; t < numthreads; t++)
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    wait();
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(int t = 0; t < (int) workers.size(); t++)
+        workers[t].join();
+}
+
+void ThreadPool::workerLoop()
+{
+    std::function<void()> task;
+
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            wake.wait(lk, [this]{ return stopping || !tasks.empty(); });
+            if(stopping && tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            pending--;
+            if(pending == 0)
+                done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::enqueue(std::function<void()> task)
+{
+    if(workers.empty())
+    {
+        task();
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        tasks.push_back(std::move(task));
+        pending++;
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    done.wait(lk, [this]{ return pending == 0; });
+}
+
+void ThreadPool::parallelFor(int start, int end, int grain, std::function<void(int, int)> body)
+{
+    std::shared_ptr<Batch> batch;
+    int nchunks, h;
+
+    if(end <= start)
+        return;
+
+    // aim for several chunks per thread so uneven chunks still balance
+    if(grain <= 0)
+        grain = max(1, (end - start) / (4 * numthreads));
+    nchunks = (end - start + grain - 1) / grain;
+    batch = std::make_shared<Batch>();
+    batch->next = 0;
+    batch->finished = 0;
+
+    // every runner claims chunks until none remain, and the caller is one of them, so the batch completes even when
+    // the workers are held up by another caller's tasks. Helpers that start late find nothing left and just exit.
+    auto run = [this, batch, body, start, end, grain, nchunks]()
+    {
+        int c, n = 0;
+
+        while((c = batch->next++) < nchunks)
+        {
+            body(start + c * grain, min(end, start + (c + 1) * grain));
+            n++;
+        }
+        if(n > 0)
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            batch->finished += n;
+            if(batch->finished == nchunks)
+                done.notify_all();
+        }
+    };
+
+    if(!workers.empty())
+        for(h = 0; h < min(nchunks, numthreads) - 1; h++)
+            enqueue(run);
+    run();
+
+    // only this batch is waited on, not whatever else is queued on the pool
+    std::unique_lock<std::mutex> lk(lock);
+    done.wait(lk, [&batch, nchunks]{ return batch->finished == nchunks; });
+}
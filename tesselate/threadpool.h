@@ -0,0 +1,84 @@
+#ifndef _THREADPOOL
+#define _THREADPOOL
+/**
+ * @file
+ *
+ * Fixed-size pool of worker threads for data parallel loops.
+ */
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+
+/**
+ * A fixed set of worker threads servicing a shared task queue. A pool of one thread runs every task inline on the
+ * calling thread, which gives a serial mode with identical behaviour and no synchronisation overhead.
+ */
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;           ///< worker threads, empty for a serial pool
+    std::deque<std::function<void()>> tasks;    ///< queued tasks waiting for a worker
+    std::mutex lock;                            ///< guards the task queue and counters
+    std::condition_variable wake;               ///< signals workers that tasks are available
+    std::condition_variable done;               ///< signals waiters that all tasks or a batch are finished
+    int pending;                                ///< number of tasks queued or running
+    bool stopping;                              ///< workers should exit
+    int numthreads;                             ///< number of threads executing tasks
+
+    /// Progress of one parallelFor call, shared with the tasks running it so that late tasks stay safe
+    struct Batch
+    {
+        std::atomic<int> next;  ///< next chunk to claim
+        int finished;           ///< number of chunks completed, guarded by lock
+    };
+
+    /// Main loop of each worker, pulling tasks until the pool is stopped
+    void workerLoop();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+public:
+
+    /**
+     * Constructor
+     * @param threads   number of threads to use, 0 to match the hardware concurrency
+     */
+    ThreadPool(int threads = 0);
+
+    /// Destructor, waits for outstanding tasks to finish
+    ~ThreadPool();
+
+    /// Number of threads executing tasks
+    int getNumThreads(){ return numthreads; }
+
+    /**
+     * Add a task to the queue. In a serial pool the task runs immediately.
+     * @param task  work to perform
+     */
+    void enqueue(std::function<void()> task);
+
+    /**
+     * Block until every enqueued task has completed, including those of other threads sharing the pool.
+     * Must not be called from within a task.
+     */
+    void wait();
+
+    /**
+     * Split an index range into contiguous chunks and process them across the pool, blocking until complete.
+     * The calling thread processes chunks too and only this call's chunks are waited on, so threads sharing the
+     * pool do not hold each other up. Must not be called from within a task.
+     * @param start, end    half open range of indices [start, end)
+     * @param grain         number of indices in each chunk, 0 to pick a chunk size from the thread count
+     * @param body          called as body(chunkstart, chunkend) for each chunk
+     */
+    void parallelFor(int start, int end, int grain, std::function<void(int, int)> body);
+};
+
+#endif
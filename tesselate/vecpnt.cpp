@@ -36,3 +36,17 @@ void clamp(float & t)
     if(t < 0.0f)
         t = 0.0f;
 }
+
+std::uint64_t hashBytes(const void * data, std::size_t len, std::uint64_t seed)
+{
+    const unsigned char * bytes = (const unsigned char *) data;
+    std::uint64_t h = seed;
+    std::size_t b;
+
+    for(b = 0; b < len; b++)
+    {
+        h ^= (std::uint64_t) bytes[b];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
@@ -9,6 +9,8 @@
 
 #include <math.h>
 #include <fstream>
+#include <cstdint>
+#include <cstddef>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/base_object.hpp>
@@ -392,6 +394,13 @@ public:
         max.y += extent; min.y -= extent;
         max.z += extent; min.z -= extent;
     }
+
+    /// Return true if this box overlaps another, including touching at a face, edge or corner
+    inline bool overlaps(const BoundBox & box)
+    {
+        return (min.x <= box.max.x && max.x >= box.min.x && min.y <= box.max.y && max.y >= box.min.y &&
+                min.z <= box.max.z && max.z >= box.min.z);
+    }
 };
 
 }
@@ -407,4 +416,7 @@ void rayPointDist(cgp::Point start, cgp::Vector dirn, cgp::Point query, float &t
 
 // clamp: ensure that parameter <t> falls in [0,1]
 void clamp(float & t);
+
+// hashBytes: extend the 64-bit FNV-1a hash <seed> with <len> bytes of <data>. Used to fingerprint shape parameters.
+std::uint64_t hashBytes(const void * data, std::size_t len, std::uint64_t seed = 14695981039346656037ULL);
 #endif
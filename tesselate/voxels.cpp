@@ -8,19 +8,45 @@
 #include <string.h>
 #include <iostream>
 #include <limits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+static const char voxfilemagic[8] = {'T', 'E', 'S', 'V', 'O', 'X', '0', '1'}; ///< identifies a mapped volume file
+
+/**
+ * Fixed header at the start of a mapped volume file. Only the first sizeof(VoxelFileHeader) of the voxfilehdrbytes
+ * reserved are used, the rest keeps the start of the voxel words page aligned.
+ */
+struct VoxelFileHeader
+{
+    char magic[8];              ///< voxfilemagic
+    std::int32_t dim[3];        ///< number of voxels in x, y, z
+    std::int32_t zwords;        ///< words in a single z-column
+    std::int64_t numwords;      ///< total number of voxel words following the header
+    float origin[3];            ///< corner point in world space
+    float diagonal[3];          ///< diagonal extent in world space
+};
+
 VoxelVolume::VoxelVolume()
 {
-    xdim = ydim = zdim = 0;
     voxgrid = NULL;
+    mapfd = -1; mapbase = NULL; maplen = 0;
+    clear();
     setFrame(cgp::Point(0.0f, 0.0f, 0.0f), cgp::Vector(0.0f, 0.0f, 0.0f));
 }
 
 VoxelVolume::VoxelVolume(int xsize, int ysize, int zsize, cgp::Point corner, cgp::Vector diag)
 {
     voxgrid = NULL;
+    mapfd = -1; mapbase = NULL; maplen = 0;
     setDim(xsize, ysize, zsize);
     setFrame(corner, diag);
 }
@@ -32,24 +58,63 @@ VoxelVolume::~VoxelVolume()
 
 void VoxelVolume::clear()
 {
-    if(voxgrid != NULL)
+    if(mapbase != NULL)
+    {
+        // unmapping writes modified pages back lazily, the file keeps the voxels
+        munmap(mapbase, maplen);
+        close(mapfd);
+        mapbase = NULL; maplen = 0; mapfd = -1;
+        voxgrid = NULL;
+    }
+    else if(voxgrid != NULL)
     {
         delete [] voxgrid;
         voxgrid = NULL;
     }
+    xdim = ydim = zdim = 0;
+    zwords = 0; numwords = 0; colmask = 0;
+}
+
+void VoxelVolume::swap(VoxelVolume &other)
+{
+    std::swap(voxgrid, other.voxgrid);
+    std::swap(xdim, other.xdim);
+    std::swap(ydim, other.ydim);
+    std::swap(zdim, other.zdim);
+    std::swap(zwords, other.zwords);
+    std::swap(numwords, other.numwords);
+    std::swap(colmask, other.colmask);
+    std::swap(mapfd, other.mapfd);
+    std::swap(mapbase, other.mapbase);
+    std::swap(maplen, other.maplen);
+    std::swap(origin, other.origin);
+    std::swap(diagonal, other.diagonal);
+    std::swap(cell, other.cell);
 }
 
 void VoxelVolume::fill(bool setval)
 {
-    // stub, needs completing
-	for (int i=0; i<xdim; i++){
-		for (int j=0; j<ydim; j++){
-			for (int k=0; k<ydim; k++){
-				//cerr << i << endl;
-				set(i,j,k,setval);
-			}
-		}
-	}
+    long c, numcols;
+    std::uint64_t * col;
+
+    if(voxgrid == NULL)
+        return;
+
+    if(!setval)
+    {
+        memset(voxgrid, 0, sizeof(std::uint64_t) * numwords);
+    }
+    else
+    {
+        // set whole words and then clear the padding at the top of each column
+        memset(voxgrid, 0xff, sizeof(std::uint64_t) * numwords);
+        numcols = (long) xdim * (long) ydim;
+        for(c = 0; c < numcols; c++)
+        {
+            col = &voxgrid[c * zwords];
+            col[zwords-1] = colmask;
+        }
+    }
 }
 
 void VoxelVolume::calcCellDiag()
@@ -65,14 +130,27 @@ void VoxelVolume::getDim(int &dimx, int &dimy, int &dimz)
     dimx = xdim; dimy = ydim; dimz = zdim;
 }
 
+void VoxelVolume::calcPacking()
+{
+    // pad z-columns to a whole number of 64-bit words
+    zwords = (zdim + 63) / 64;
+    numwords = (long) xdim * (long) ydim * (long) zwords;
+    if(zdim % 64 == 0)
+        colmask = ~((std::uint64_t) 0);
+    else
+        colmask = (((std::uint64_t) 1) << (zdim % 64)) - 1;
+}
+
 void VoxelVolume::setDim(int dimx, int dimy, int dimz)
 {
-    // stub, needs completing
+    clear();
     xdim = dimx;
     ydim = dimy;
     zdim = dimz;
-    
-    voxgrid = new int [(xdim*ydim*zdim)]();
+    calcPacking();
+
+    if(numwords > 0)
+        voxgrid = new std::uint64_t[numwords](); // zero initialised, so all voxels start empty
 
     calcCellDiag();
 }
@@ -88,66 +166,156 @@ void VoxelVolume::setFrame(cgp::Point corner, cgp::Vector diag)
     origin = corner;
     diagonal = diag;
     calcCellDiag();
+    if(mapbase != NULL)
+        writeHeader();
+}
+
+void VoxelVolume::writeHeader()
+{
+    VoxelFileHeader * hdr = (VoxelFileHeader *) mapbase;
+
+    memcpy(hdr->magic, voxfilemagic, sizeof(voxfilemagic));
+    hdr->dim[0] = xdim; hdr->dim[1] = ydim; hdr->dim[2] = zdim;
+    hdr->zwords = zwords;
+    hdr->numwords = numwords;
+    hdr->origin[0] = origin.x; hdr->origin[1] = origin.y; hdr->origin[2] = origin.z;
+    hdr->diagonal[0] = diagonal.i; hdr->diagonal[1] = diagonal.j; hdr->diagonal[2] = diagonal.k;
+}
+
+bool VoxelVolume::mapFile(int fd, std::size_t len)
+{
+    void * base;
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+    mapfd = fd;
+    mapbase = base;
+    maplen = len;
+    voxgrid = (std::uint64_t *) ((char *) base + voxfilehdrbytes);
+    return true;
+}
+
+bool VoxelVolume::createMapped(const std::string &filename, int xsize, int ysize, int zsize, cgp::Point corner, cgp::Vector diag)
+{
+    std::size_t len;
+    int fd;
+
+    clear();
+    if(xsize <= 0 || ysize <= 0 || zsize <= 0)
+    {
+        cerr << "Error VoxelVolume::createMapped: volume dimensions must be positive" << endl;
+        return false;
+    }
+    xdim = xsize; ydim = ysize; zdim = zsize;
+    calcPacking();
+    len = (std::size_t) voxfilehdrbytes + sizeof(std::uint64_t) * (std::size_t) numwords;
+
+    // extending with ftruncate leaves a sparse file that reads back as zero, so voxels start empty
+    fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, (off_t) len) != 0)
+    {
+        if(fd >= 0)
+            close(fd);
+        cerr << "Error VoxelVolume::createMapped: unable to create " << filename << endl;
+        clear();
+        return false;
+    }
+    if(!mapFile(fd, len))
+    {
+        cerr << "Error VoxelVolume::createMapped: unable to map " << filename << endl;
+        clear();
+        return false;
+    }
+    origin = corner;
+    diagonal = diag;
+    calcCellDiag();
+    writeHeader();
+    return true;
+}
+
+bool VoxelVolume::openMapped(const std::string &filename)
+{
+    VoxelFileHeader hdr;
+    struct stat info;
+    int fd;
+
+    clear();
+    fd = open(filename.c_str(), O_RDWR);
+    if(fd < 0)
+    {
+        cerr << "Error VoxelVolume::openMapped: unable to open " << filename << endl;
+        return false;
+    }
+
+    // validate the header against the file before trusting any of it
+    if(fstat(fd, &info) != 0 || info.st_size < voxfilehdrbytes || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)
+       || memcmp(hdr.magic, voxfilemagic, sizeof(voxfilemagic)) != 0 || hdr.dim[0] <= 0 || hdr.dim[1] <= 0 || hdr.dim[2] <= 0)
+    {
+        cerr << "Error VoxelVolume::openMapped: " << filename << " is not a voxel volume file" << endl;
+        close(fd);
+        return false;
+    }
+    xdim = hdr.dim[0]; ydim = hdr.dim[1]; zdim = hdr.dim[2];
+    calcPacking();
+    if(hdr.zwords != zwords || hdr.numwords != numwords
+       || (std::size_t) info.st_size != (std::size_t) voxfilehdrbytes + sizeof(std::uint64_t) * (std::size_t) numwords)
+    {
+        cerr << "Error VoxelVolume::openMapped: " << filename << " is truncated or has an inconsistent header" << endl;
+        close(fd);
+        clear();
+        return false;
+    }
+    if(!mapFile(fd, (std::size_t) info.st_size))
+    {
+        cerr << "Error VoxelVolume::openMapped: unable to map " << filename << endl;
+        clear();
+        return false;
+    }
+    origin = cgp::Point(hdr.origin[0], hdr.origin[1], hdr.origin[2]);
+    diagonal = cgp::Vector(hdr.diagonal[0], hdr.diagonal[1], hdr.diagonal[2]);
+    calcCellDiag();
+    return true;
+}
+
+bool VoxelVolume::sync()
+{
+    if(mapbase == NULL)
+        return true;
+    if(msync(mapbase, maplen, MS_SYNC) != 0)
+    {
+        cerr << "Error VoxelVolume::sync: unable to write back mapped voxels" << endl;
+        return false;
+    }
+    return true;
 }
 
-// did bitpacking, but it made the voxels look too far apart so there was probably a slight issue in my implementation
-// Decided to cut my losses and just do normal int array instead
 bool VoxelVolume::set(int x, int y, int z, bool setval)
 {
-    // stub, needs completing
-   	if (voxgrid == NULL){
-   		return false;
-   	}
-   	
-   	int coordinates = (xdim*ydim*x+ydim*y+z);
-   	//int bitIndex = coordinates%32;
-   	//int mask = 0x32 >> bitIndex;
-   	
-   	/*if (setval==true) {
-   		voxgrid[coordinates] |= mask;
-   	}
-   	else{
-   		mask = ~mask;
-   		voxgrid[coordinates] &= mask;
-   	}*/
-   	
-   	if (setval==true) {
-   		voxgrid[coordinates] = 1;
-   	}
-   	else{
-   		//mask = ~mask;
-   		voxgrid[coordinates] = 0;
-   	}
-   	
-   	if (x > xdim || y > ydim || z > zdim){
-   		return false;
-   	}
-   	else{
-   		return true;
-   	}
+    std::uint64_t mask;
+    long w;
+
+    if(voxgrid == NULL || !inBounds(x, y, z))
+        return false;
+
+    w = getWordIndex(x, y, z);
+    mask = ((std::uint64_t) 1) << (z & 63);
+    if(setval)
+        voxgrid[w] |= mask;
+    else
+        voxgrid[w] &= ~mask;
+    return true;
 }
 
 bool VoxelVolume::get(int x, int y, int z)
 {
-    // stub, needs completing
-    if (voxgrid == NULL){
-   		return false;
-   	}
-   	
-   	int coordinates = (xdim*ydim*x+ydim*y+z);
-   	//int bitIndex = coordinates%32;
-   	//int mask = 0x32 >> bitIndex;
-   	//bool flag = (mask & voxgrid[coordinates]) > 0;
-   	bool flag;
-   	if (voxgrid[coordinates] == 0){
-   		flag = false;
-   		//cerr << "33" << endl;
-   	}
-   	else{
-   		flag = true;
-   		//cerr << "22" << endl;
-   	}
-   	return flag;
+    if(voxgrid == NULL || !inBounds(x, y, z))
+        return false;
+
+    return ((voxgrid[getWordIndex(x, y, z)] >> (z & 63)) & 1) != 0;
 }
 
 cgp::Point VoxelVolume::getVoxelPos(int x, int y, int z)
@@ -164,6 +332,40 @@ cgp::Point VoxelVolume::getVoxelPos(int x, int y, int z)
     return pnt;
 }
 
+bool VoxelVolume::getBoxRange(cgp::BoundBox box, int lo[3], int hi[3])
+{
+    float bmin[3], bmax[3], org[3], cw[3];
+    double l, h;
+    int dim[3], a;
+
+    bmin[0] = box.min.x; bmin[1] = box.min.y; bmin[2] = box.min.z;
+    bmax[0] = box.max.x; bmax[1] = box.max.y; bmax[2] = box.max.z;
+    org[0] = origin.x; org[1] = origin.y; org[2] = origin.z;
+    cw[0] = cell.i; cw[1] = cell.j; cw[2] = cell.k;
+    dim[0] = xdim; dim[1] = ydim; dim[2] = zdim;
+
+    for(a = 0; a < 3; a++)
+    {
+        if(dim[a] <= 0 || bmin[a] > bmax[a])
+            return false;
+        if(cw[a] <= 0.0f)
+        {
+            lo[a] = 0; hi[a] = dim[a]-1;
+            continue;
+        }
+
+        // voxel i has its centre at origin + (i + 0.5) * cell, clamp in double before converting to int
+        l = floor(((double) bmin[a] - (double) org[a]) / (double) cw[a] - 0.5) - 1.0;
+        h = ceil(((double) bmax[a] - (double) org[a]) / (double) cw[a] - 0.5) + 1.0;
+        l = std::max(l, 0.0);
+        h = std::min(h, (double) (dim[a]-1));
+        if(l > h)
+            return false;
+        lo[a] = (int) l; hi[a] = (int) h;
+    }
+    return true;
+}
+
 // following 3 methods for testing purposes only
 int VoxelVolume::getdimX(){
 	return xdim;
@@ -176,3 +378,1352 @@ int VoxelVolume::getdimY(){
 int VoxelVolume::getdimZ(){
 	return zdim;
 }
+
+long VoxelVolume::count()
+{
+    long w, total = 0;
+
+    for(w = 0; w < numwords; w++)
+        total += (long) __builtin_popcountll(voxgrid[w]);
+    return total;
+}
+
+void VoxelVolume::surfaceColumn(int x, int y, std::uint64_t * out)
+{
+    const std::uint64_t * col = getColumn(x, y);
+    const std::uint64_t * side[4];
+    std::uint64_t below, above, inner;
+    int k;
+
+    // a column on the volume faces has an empty neighbour column, so all of it is surface
+    if(x == 0 || x == xdim-1 || y == 0 || y == ydim-1)
+    {
+        for(k = 0; k < zwords; k++)
+            out[k] = col[k];
+        return;
+    }
+
+    side[0] = getColumn(x-1, y); side[1] = getColumn(x+1, y);
+    side[2] = getColumn(x, y-1); side[3] = getColumn(x, y+1);
+    for(k = 0; k < zwords; k++)
+    {
+        // bit z of below and above holds voxel z-1 and z+1, with empty voxels shifted in beyond the column ends.
+        // Padding bits are empty, so the last voxel of the column sees an empty voxel above.
+        below = (col[k] << 1) | ((k > 0) ? col[k-1] >> 63 : 0);
+        above = (col[k] >> 1) | ((k < zwords-1) ? col[k+1] << 63 : 0);
+        inner = col[k] & below & above & side[0][k] & side[1][k] & side[2][k] & side[3][k];
+        out[k] = col[k] & ~inner;
+    }
+}
+
+bool VoxelVolume::boundary(VoxelVolume * surf, ThreadPool * pool)
+{
+    if(surf == this)
+    {
+        cerr << "Error VoxelVolume::boundary: cannot write the surface over its own volume" << endl;
+        return false;
+    }
+    surf->setDim(xdim, ydim, zdim);
+    surf->setFrame(origin, diagonal);
+    if(numwords == 0)
+        return true;
+
+    auto slab = [&](int xstart, int xend)
+    {
+        for(int x = xstart; x < xend; x++)
+            for(int y = 0; y < ydim; y++)
+                surfaceColumn(x, y, surf->getColumn(x, y));
+    };
+
+    if(pool == NULL)
+        slab(0, xdim);
+    else
+        pool->parallelFor(0, xdim, 0, slab);
+    return true;
+}
+
+long VoxelVolume::boundaryList(std::vector<int> &coords, ThreadPool * pool)
+{
+    std::vector<long> slabstart(xdim+1, 0);
+    int x;
+
+    coords.clear();
+    if(numwords == 0)
+        return 0;
+
+    // count the surface voxels of each x-slab
+    auto countSlab = [&](int xstart, int xend)
+    {
+        std::vector<std::uint64_t> surf(zwords);
+        long n;
+        int k;
+
+        for(int x = xstart; x < xend; x++)
+        {
+            n = 0;
+            for(int y = 0; y < ydim; y++)
+            {
+                surfaceColumn(x, y, surf.data());
+                for(k = 0; k < zwords; k++)
+                    n += (long) __builtin_popcountll(surf[k]);
+            }
+            slabstart[x+1] = n;
+        }
+    };
+
+    // write each slab from its offset, recomputing its surface words rather than storing them
+    auto writeSlab = [&](int xstart, int xend)
+    {
+        std::vector<std::uint64_t> surf(zwords);
+        std::uint64_t bits;
+        long pos;
+        int k, z;
+
+        for(int x = xstart; x < xend; x++)
+        {
+            pos = slabstart[x] * 3;
+            for(int y = 0; y < ydim; y++)
+            {
+                surfaceColumn(x, y, surf.data());
+                for(k = 0; k < zwords; k++)
+                {
+                    bits = surf[k];
+                    while(bits != 0)
+                    {
+                        z = k * 64 + __builtin_ctzll(bits);
+                        bits &= bits - 1;
+                        coords[pos] = x; coords[pos+1] = y; coords[pos+2] = z;
+                        pos += 3;
+                    }
+                }
+            }
+        }
+    };
+
+    if(pool == NULL)
+        countSlab(0, xdim);
+    else
+        pool->parallelFor(0, xdim, 0, countSlab);
+    for(x = 0; x < xdim; x++)
+        slabstart[x+1] += slabstart[x];
+    coords.resize(slabstart[xdim] * 3);
+    if(pool == NULL)
+        writeSlab(0, xdim);
+    else
+        pool->parallelFor(0, xdim, 0, writeSlab);
+    return slabstart[xdim];
+}
+
+void voxWordOp(SetOp op, std::uint64_t * dst, const std::uint64_t * src, long numwords)
+{
+    long w = 0;
+
+#if defined(__AVX2__)
+    // 4 words per register, unaligned loads since volumes are allocated with new
+    __m256i a, b;
+    switch(op)
+    {
+    case SetOp::UNION:
+        for(; w + 4 <= numwords; w += 4)
+        {
+            a = _mm256_loadu_si256((const __m256i *) &dst[w]); b = _mm256_loadu_si256((const __m256i *) &src[w]);
+            _mm256_storeu_si256((__m256i *) &dst[w], _mm256_or_si256(a, b));
+        }
+        break;
+    case SetOp::INTERSECTION:
+        for(; w + 4 <= numwords; w += 4)
+        {
+            a = _mm256_loadu_si256((const __m256i *) &dst[w]); b = _mm256_loadu_si256((const __m256i *) &src[w]);
+            _mm256_storeu_si256((__m256i *) &dst[w], _mm256_and_si256(a, b));
+        }
+        break;
+    case SetOp::DIFFERENCE:
+        for(; w + 4 <= numwords; w += 4)
+        {
+            a = _mm256_loadu_si256((const __m256i *) &dst[w]); b = _mm256_loadu_si256((const __m256i *) &src[w]);
+            _mm256_storeu_si256((__m256i *) &dst[w], _mm256_andnot_si256(b, a)); // ~b & a
+        }
+        break;
+    }
+#elif defined(__SSE2__)
+    // 2 words per register
+    __m128i a, b;
+    switch(op)
+    {
+    case SetOp::UNION:
+        for(; w + 2 <= numwords; w += 2)
+        {
+            a = _mm_loadu_si128((const __m128i *) &dst[w]); b = _mm_loadu_si128((const __m128i *) &src[w]);
+            _mm_storeu_si128((__m128i *) &dst[w], _mm_or_si128(a, b));
+        }
+        break;
+    case SetOp::INTERSECTION:
+        for(; w + 2 <= numwords; w += 2)
+        {
+            a = _mm_loadu_si128((const __m128i *) &dst[w]); b = _mm_loadu_si128((const __m128i *) &src[w]);
+            _mm_storeu_si128((__m128i *) &dst[w], _mm_and_si128(a, b));
+        }
+        break;
+    case SetOp::DIFFERENCE:
+        for(; w + 2 <= numwords; w += 2)
+        {
+            a = _mm_loadu_si128((const __m128i *) &dst[w]); b = _mm_loadu_si128((const __m128i *) &src[w]);
+            _mm_storeu_si128((__m128i *) &dst[w], _mm_andnot_si128(b, a)); // ~b & a
+        }
+        break;
+    }
+#endif
+
+    // scalar fallback, also picks up any tail left by the vector loops
+    switch(op)
+    {
+    case SetOp::UNION:
+        for(; w < numwords; w++)
+            dst[w] |= src[w];
+        break;
+    case SetOp::INTERSECTION:
+        for(; w < numwords; w++)
+            dst[w] &= src[w];
+        break;
+    case SetOp::DIFFERENCE:
+        for(; w < numwords; w++)
+            dst[w] &= ~src[w];
+        break;
+    }
+}
+
+void setColumnSpan(std::uint64_t * col, int zstart, int zend)
+{
+    int wstart, wend, w;
+    std::uint64_t full = ~((std::uint64_t) 0), lomask, himask;
+
+    if(zend < zstart)
+        return;
+    wstart = zstart >> 6; wend = zend >> 6;
+    lomask = full << (zstart & 63);             // bits from zstart upwards
+    himask = full >> (63 - (zend & 63));        // bits up to and including zend
+    if(wstart == wend)
+    {
+        col[wstart] |= lomask & himask;
+    }
+    else
+    {
+        col[wstart] |= lomask;
+        for(w = wstart+1; w < wend; w++)
+            col[w] = full;
+        col[wend] |= himask;
+    }
+}
+
+//
+// SparseVoxelVolume
+//
+
+SparseVoxelVolume::SparseVoxelVolume()
+{
+    setDim(0, 0, 0);
+    setFrame(cgp::Point(0.0f, 0.0f, 0.0f), cgp::Vector(0.0f, 0.0f, 0.0f));
+}
+
+SparseVoxelVolume::SparseVoxelVolume(int xsize, int ysize, int zsize, cgp::Point corner, cgp::Vector diag)
+{
+    setDim(xsize, ysize, zsize);
+    setFrame(corner, diag);
+}
+
+SparseVoxelVolume::~SparseVoxelVolume()
+{
+    clear();
+}
+
+void SparseVoxelVolume::clear()
+{
+    mixed.clear();
+    full.clear();
+}
+
+void SparseVoxelVolume::brickMask(long key, VoxelBrick &mask)
+{
+    int bx, by, bz, lx, ly, xlim, ylim, zlim;
+    std::uint64_t zrun;
+
+    // unflatten brick index
+    bz = (int) (key % (long) bzdim);
+    by = (int) ((key / (long) bzdim) % (long) bydim);
+    bx = (int) (key / ((long) bzdim * (long) bydim));
+
+    // number of in-bounds voxels along each axis of this brick
+    xlim = min(bricksize, xdim - bx * bricksize);
+    ylim = min(bricksize, ydim - by * bricksize);
+    zlim = min(bricksize, zdim - bz * bricksize);
+
+    zrun = (((std::uint64_t) 1) << zlim) - 1;
+    for(lx = 0; lx < brickwords; lx++)
+    {
+        mask.w[lx] = 0;
+        if(lx < xlim)
+            for(ly = 0; ly < ylim; ly++)
+                mask.w[lx] |= zrun << (ly * bricksize);
+    }
+}
+
+void SparseVoxelVolume::collapse(long key)
+{
+    VoxelBrick mask;
+    bool empty = true, isfull = true;
+    int i;
+
+    std::unordered_map<long, VoxelBrick>::iterator it = mixed.find(key);
+    if(it == mixed.end())
+        return;
+
+    brickMask(key, mask);
+    for(i = 0; i < brickwords; i++)
+    {
+        if(it->second.w[i] != 0)
+            empty = false;
+        if(it->second.w[i] != mask.w[i])
+            isfull = false;
+    }
+
+    if(empty)
+        mixed.erase(it);
+    else if(isfull)
+    {
+        mixed.erase(it);
+        full.insert(key);
+    }
+}
+
+void SparseVoxelVolume::fill(bool setval)
+{
+    long key, numbricks;
+
+    clear();
+    if(setval)
+    {
+        numbricks = (long) bxdim * (long) bydim * (long) bzdim;
+        full.reserve(numbricks);
+        for(key = 0; key < numbricks; key++)
+            full.insert(key);
+    }
+}
+
+void SparseVoxelVolume::calcCellDiag()
+{
+    if(xdim > 0 && ydim > 0 && zdim > 0)
+        cell = cgp::Vector(diagonal.i / (float) xdim, diagonal.j / (float) ydim, diagonal.k / (float) zdim);
+    else
+        cell = cgp::Vector(0.0f, 0.0f, 0.0f);
+}
+
+void SparseVoxelVolume::getDim(int &dimx, int &dimy, int &dimz)
+{
+    dimx = xdim; dimy = ydim; dimz = zdim;
+}
+
+void SparseVoxelVolume::setDim(int dimx, int dimy, int dimz)
+{
+    clear();
+    xdim = dimx;
+    ydim = dimy;
+    zdim = dimz;
+    bxdim = (xdim + bricksize - 1) / bricksize;
+    bydim = (ydim + bricksize - 1) / bricksize;
+    bzdim = (zdim + bricksize - 1) / bricksize;
+    calcCellDiag();
+}
+
+void SparseVoxelVolume::getFrame(cgp::Point &corner, cgp::Vector &diag)
+{
+    corner = origin;
+    diag = diagonal;
+}
+
+void SparseVoxelVolume::setFrame(cgp::Point corner, cgp::Vector diag)
+{
+    origin = corner;
+    diagonal = diag;
+    calcCellDiag();
+}
+
+bool SparseVoxelVolume::set(int x, int y, int z, bool setval)
+{
+    long key;
+    int bit, lx;
+    std::uint64_t mask;
+    VoxelBrick brick;
+
+    if(x < 0 || x >= xdim || y < 0 || y >= ydim || z < 0 || z >= zdim)
+        return false;
+
+    key = brickKey(x >> brickbits, y >> brickbits, z >> brickbits);
+    lx = x & (bricksize-1);
+    bit = (y & (bricksize-1)) * bricksize + (z & (bricksize-1));
+    mask = ((std::uint64_t) 1) << bit;
+
+    std::unordered_map<long, VoxelBrick>::iterator it = mixed.find(key);
+    if(it != mixed.end())
+    {
+        if(setval)
+            it->second.w[lx] |= mask;
+        else
+            it->second.w[lx] &= ~mask;
+        collapse(key);
+    }
+    else if(full.count(key) > 0)
+    {
+        if(!setval) // break full brick back out into voxels
+        {
+            brickMask(key, brick);
+            brick.w[lx] &= ~mask;
+            full.erase(key);
+            mixed[key] = brick;
+            collapse(key);
+        }
+    }
+    else if(setval) // empty brick gains its first voxel
+    {
+        memset(brick.w, 0, sizeof(brick.w));
+        brick.w[lx] = mask;
+        mixed[key] = brick;
+        collapse(key);
+    }
+    return true;
+}
+
+bool SparseVoxelVolume::get(int x, int y, int z)
+{
+    long key;
+    int bit;
+
+    if(x < 0 || x >= xdim || y < 0 || y >= ydim || z < 0 || z >= zdim)
+        return false;
+
+    key = brickKey(x >> brickbits, y >> brickbits, z >> brickbits);
+    std::unordered_map<long, VoxelBrick>::iterator it = mixed.find(key);
+    if(it != mixed.end())
+    {
+        bit = (y & (bricksize-1)) * bricksize + (z & (bricksize-1));
+        return ((it->second.w[x & (bricksize-1)] >> bit) & 1) != 0;
+    }
+    return (full.count(key) > 0);
+}
+
+cgp::Point SparseVoxelVolume::getVoxelPos(int x, int y, int z)
+{
+    return cgp::Point(origin.x + ((float) x + 0.5f) * cell.i, origin.y + ((float) y + 0.5f) * cell.j, origin.z + ((float) z + 0.5f) * cell.k);
+}
+
+BrickState SparseVoxelVolume::getBrickState(int x, int y, int z)
+{
+    long key = brickKey(x >> brickbits, y >> brickbits, z >> brickbits);
+
+    if(mixed.find(key) != mixed.end())
+        return BrickState::MIXED;
+    if(full.count(key) > 0)
+        return BrickState::FULL;
+    return BrickState::EMPTY;
+}
+
+long SparseVoxelVolume::memUsage()
+{
+    // hash nodes carry a next pointer and cached hash alongside the key and payload
+    long mixednode = (long) (sizeof(long) + sizeof(VoxelBrick) + 2 * sizeof(void *));
+    long fullnode = (long) (sizeof(long) + 2 * sizeof(void *));
+    long buckets = (long) ((mixed.bucket_count() + full.bucket_count()) * sizeof(void *));
+
+    return (long) mixed.size() * mixednode + (long) full.size() * fullnode + buckets;
+}
+
+long SparseVoxelVolume::count()
+{
+    long total = 0;
+    int i;
+    VoxelBrick mask;
+
+    for(auto it = mixed.begin(); it != mixed.end(); it++)
+        for(i = 0; i < brickwords; i++)
+            total += (long) __builtin_popcountll(it->second.w[i]);
+
+    for(auto it = full.begin(); it != full.end(); it++)
+    {
+        brickMask((* it), mask);
+        for(i = 0; i < brickwords; i++)
+            total += (long) __builtin_popcountll(mask.w[i]);
+    }
+    return total;
+}
+
+void SparseVoxelVolume::combine(SetOp op, SparseVoxelVolume *rightarg)
+{
+    std::vector<long> keys;
+    VoxelBrick mask;
+    int i;
+
+    switch(op)
+    {
+    case SetOp::UNION:
+        // full on the right dominates whatever is on the left
+        for(auto it = rightarg->full.begin(); it != rightarg->full.end(); it++)
+        {
+            mixed.erase((* it));
+            full.insert((* it));
+        }
+        for(auto it = rightarg->mixed.begin(); it != rightarg->mixed.end(); it++)
+        {
+            if(full.count(it->first) > 0)
+                continue;
+            auto lit = mixed.find(it->first);
+            if(lit == mixed.end())
+                mixed[it->first] = it->second;
+            else
+            {
+                for(i = 0; i < brickwords; i++)
+                    lit->second.w[i] |= it->second.w[i];
+                collapse(it->first);
+            }
+        }
+        break;
+
+    case SetOp::INTERSECTION:
+        // left full bricks take on the right brick as is
+        keys.assign(full.begin(), full.end());
+        for(long key: keys)
+        {
+            if(rightarg->full.count(key) > 0)
+                continue;
+            full.erase(key);
+            auto rit = rightarg->mixed.find(key);
+            if(rit != rightarg->mixed.end())
+                mixed[key] = rit->second;
+        }
+        // left mixed bricks survive only where the right is non-empty
+        keys.clear();
+        for(auto it = mixed.begin(); it != mixed.end(); )
+        {
+            if(rightarg->full.count(it->first) > 0)
+            {
+                it++;
+                continue;
+            }
+            auto rit = rightarg->mixed.find(it->first);
+            if(rit == rightarg->mixed.end())
+                it = mixed.erase(it);
+            else
+            {
+                for(i = 0; i < brickwords; i++)
+                    it->second.w[i] &= rit->second.w[i];
+                keys.push_back(it->first);
+                it++;
+            }
+        }
+        for(long key: keys)
+            collapse(key);
+        break;
+
+    case SetOp::DIFFERENCE:
+        for(auto it = rightarg->full.begin(); it != rightarg->full.end(); it++)
+        {
+            mixed.erase((* it));
+            full.erase((* it));
+        }
+        for(auto it = rightarg->mixed.begin(); it != rightarg->mixed.end(); it++)
+        {
+            auto lit = mixed.find(it->first);
+            if(lit != mixed.end())
+            {
+                for(i = 0; i < brickwords; i++)
+                    lit->second.w[i] &= ~it->second.w[i];
+            }
+            else if(full.count(it->first) > 0)
+            {
+                full.erase(it->first);
+                brickMask(it->first, mask);
+                for(i = 0; i < brickwords; i++)
+                    mask.w[i] &= ~it->second.w[i];
+                mixed[it->first] = mask;
+            }
+            else
+                continue;
+            collapse(it->first);
+        }
+        break;
+    }
+}
+
+void SparseVoxelVolume::toDense(VoxelVolume *vox)
+{
+    int bx, by, bz, lx, ly, x, y;
+    long key;
+    std::uint64_t * col, bits;
+    VoxelBrick brick;
+
+    vox->setDim(xdim, ydim, zdim);
+    vox->setFrame(origin, diagonal);
+
+    // a brick's z-run of 8 voxels always falls within a single column word, so copy a byte at a time
+    for(bx = 0; bx < bxdim; bx++)
+        for(by = 0; by < bydim; by++)
+            for(bz = 0; bz < bzdim; bz++)
+            {
+                key = brickKey(bx, by, bz);
+                auto it = mixed.find(key);
+                if(it != mixed.end())
+                    brick = it->second;
+                else if(full.count(key) > 0)
+                    brickMask(key, brick);
+                else
+                    continue;
+
+                for(lx = 0; lx < bricksize && bx * bricksize + lx < xdim; lx++)
+                    for(ly = 0; ly < bricksize && by * bricksize + ly < ydim; ly++)
+                    {
+                        x = bx * bricksize + lx; y = by * bricksize + ly;
+                        bits = (brick.w[lx] >> (ly * bricksize)) & 0xff;
+                        col = vox->getColumn(x, y);
+                        col[(bz * bricksize) >> 6] |= bits << ((bz * bricksize) & 63);
+                    }
+            }
+}
+
+void SparseVoxelVolume::fromDense(VoxelVolume *vox)
+{
+    int bx, by, bz, lx, ly, x, y;
+    long key;
+    std::uint64_t * col, bits;
+    VoxelBrick brick;
+    bool nonempty;
+
+    vox->getDim(xdim, ydim, zdim);
+    setDim(xdim, ydim, zdim);
+    vox->getFrame(origin, diagonal);
+    calcCellDiag();
+
+    for(bx = 0; bx < bxdim; bx++)
+        for(by = 0; by < bydim; by++)
+            for(bz = 0; bz < bzdim; bz++)
+            {
+                memset(brick.w, 0, sizeof(brick.w));
+                nonempty = false;
+                for(lx = 0; lx < bricksize && bx * bricksize + lx < xdim; lx++)
+                    for(ly = 0; ly < bricksize && by * bricksize + ly < ydim; ly++)
+                    {
+                        x = bx * bricksize + lx; y = by * bricksize + ly;
+                        col = vox->getColumn(x, y);
+                        bits = (col[(bz * bricksize) >> 6] >> ((bz * bricksize) & 63)) & 0xff;
+                        brick.w[lx] |= bits << (ly * bricksize);
+                        if(bits != 0)
+                            nonempty = true;
+                    }
+                if(nonempty)
+                {
+                    key = brickKey(bx, by, bz);
+                    mixed[key] = brick;
+                    collapse(key);
+                }
+            }
+}
+
+//
+// MortonVoxelVolume
+//
+
+MortonVoxelVolume::MortonVoxelVolume()
+{
+    voxgrid = NULL;
+    setDim(0, 0, 0);
+    setFrame(cgp::Point(0.0f, 0.0f, 0.0f), cgp::Vector(0.0f, 0.0f, 0.0f));
+}
+
+MortonVoxelVolume::MortonVoxelVolume(int xsize, int ysize, int zsize, cgp::Point corner, cgp::Vector diag)
+{
+    voxgrid = NULL;
+    setDim(xsize, ysize, zsize);
+    setFrame(corner, diag);
+}
+
+MortonVoxelVolume::~MortonVoxelVolume()
+{
+    clear();
+}
+
+void MortonVoxelVolume::clear()
+{
+    if(voxgrid != NULL)
+    {
+        delete [] voxgrid;
+        voxgrid = NULL;
+    }
+    xdim = ydim = zdim = 0;
+    side = 0;
+    numwords = 0;
+}
+
+std::uint64_t MortonVoxelVolume::blockMask(long block)
+{
+    int bx, by, bz, x, y, z, b;
+    std::uint64_t mask = 0;
+
+    getBlockCorner(block, bx, by, bz);
+    if(bx + mortonblockside <= xdim && by + mortonblockside <= ydim && bz + mortonblockside <= zdim)
+        return ~((std::uint64_t) 0);
+    for(b = 0; b < 64; b++)
+    {
+        mortonDecode((std::uint64_t) b, x, y, z);
+        if(inBounds(bx + x, by + y, bz + z))
+            mask |= ((std::uint64_t) 1) << b;
+    }
+    return mask;
+}
+
+void MortonVoxelVolume::fill(bool setval)
+{
+    long b;
+
+    if(voxgrid == NULL)
+        return;
+    if(!setval)
+    {
+        memset(voxgrid, 0, sizeof(std::uint64_t) * numwords);
+        return;
+    }
+    for(b = 0; b < numwords; b++)
+        voxgrid[b] = blockMask(b);
+}
+
+void MortonVoxelVolume::calcCellDiag()
+{
+    if(xdim > 0 && ydim > 0 && zdim > 0)
+        cell = cgp::Vector(diagonal.i / (float) xdim, diagonal.j / (float) ydim, diagonal.k / (float) zdim);
+    else
+        cell = cgp::Vector(0.0f, 0.0f, 0.0f);
+}
+
+void MortonVoxelVolume::getDim(int &dimx, int &dimy, int &dimz)
+{
+    dimx = xdim; dimy = ydim; dimz = zdim;
+}
+
+void MortonVoxelVolume::setDim(int dimx, int dimy, int dimz)
+{
+    clear();
+    xdim = dimx;
+    ydim = dimy;
+    zdim = dimz;
+
+    if(xdim > 0 && ydim > 0 && zdim > 0)
+    {
+        // pad to a power-of-two cube no smaller than a single block
+        side = mortonblockside;
+        while(side < xdim || side < ydim || side < zdim)
+            side *= 2;
+        numwords = (long) side * (long) side * (long) side / 64;
+        voxgrid = new std::uint64_t[numwords];
+        memset(voxgrid, 0, sizeof(std::uint64_t) * numwords);
+    }
+    calcCellDiag();
+}
+
+void MortonVoxelVolume::getFrame(cgp::Point &corner, cgp::Vector &diag)
+{
+    corner = origin;
+    diag = diagonal;
+}
+
+void MortonVoxelVolume::setFrame(cgp::Point corner, cgp::Vector diag)
+{
+    origin = corner;
+    diagonal = diag;
+    calcCellDiag();
+}
+
+bool MortonVoxelVolume::set(int x, int y, int z, bool setval)
+{
+    std::uint64_t code, mask;
+
+    if(voxgrid == NULL || !inBounds(x, y, z))
+        return false;
+    code = mortonEncode(x, y, z);
+    mask = ((std::uint64_t) 1) << (code & 63);
+    if(setval)
+        voxgrid[code >> 6] |= mask;
+    else
+        voxgrid[code >> 6] &= ~mask;
+    return true;
+}
+
+cgp::Point MortonVoxelVolume::getVoxelPos(int x, int y, int z)
+{
+    return cgp::Point(origin.x + ((float) x + 0.5f) * cell.i, origin.y + ((float) y + 0.5f) * cell.j, origin.z + ((float) z + 0.5f) * cell.k);
+}
+
+long MortonVoxelVolume::count()
+{
+    long total = 0, b;
+
+    for(b = 0; b < numwords; b++)
+        total += (long) __builtin_popcountll(voxgrid[b]);
+    return total;
+}
+
+void MortonVoxelVolume::forEachBlock(std::function<void(int x, int y, int z, std::uint64_t &bits)> body, bool skipempty)
+{
+    int x, y, z;
+    long b;
+
+    for(b = 0; b < numwords; b++)
+    {
+        if(skipempty && voxgrid[b] == 0)
+            continue;
+        getBlockCorner(b, x, y, z);
+        if(x >= xdim || y >= ydim || z >= zdim) // wholly in the padding
+            continue;
+        body(x, y, z, voxgrid[b]);
+    }
+}
+
+void MortonVoxelVolume::toDense(VoxelVolume *vox)
+{
+    int x, y, z, lx, ly, lz;
+    long b;
+    std::uint64_t * col, bits;
+
+    vox->setDim(xdim, ydim, zdim);
+    vox->setFrame(origin, diagonal);
+
+    // a block's z-run of 4 voxels always falls within a single column word
+    for(b = 0; b < numwords; b++)
+    {
+        if(voxgrid[b] == 0)
+            continue;
+        getBlockCorner(b, x, y, z);
+        for(lx = 0; lx < mortonblockside && x + lx < xdim; lx++)
+            for(ly = 0; ly < mortonblockside && y + ly < ydim; ly++)
+            {
+                bits = 0;
+                for(lz = 0; lz < mortonblockside; lz++)
+                    bits |= ((voxgrid[b] >> mortonEncode(lx, ly, lz)) & 1) << lz;
+                col = vox->getColumn(x + lx, y + ly);
+                col[z >> 6] |= bits << (z & 63);
+            }
+    }
+}
+
+void MortonVoxelVolume::fromDense(VoxelVolume *vox)
+{
+    int x, y, z, lx, ly, lz;
+    long b;
+    std::uint64_t * col, bits;
+
+    vox->getDim(xdim, ydim, zdim);
+    setDim(xdim, ydim, zdim);
+    vox->getFrame(origin, diagonal);
+    calcCellDiag();
+
+    for(b = 0; b < numwords; b++)
+    {
+        getBlockCorner(b, x, y, z);
+        if(x >= xdim || y >= ydim || z >= zdim)
+            continue;
+        for(lx = 0; lx < mortonblockside && x + lx < xdim; lx++)
+            for(ly = 0; ly < mortonblockside && y + ly < ydim; ly++)
+            {
+                col = vox->getColumn(x + lx, y + ly);
+                bits = (col[z >> 6] >> (z & 63)) & 0xf; // padding bits of the dense column are empty
+                for(lz = 0; lz < mortonblockside; lz++)
+                    voxgrid[b] |= ((bits >> lz) & 1) << mortonEncode(lx, ly, lz);
+            }
+    }
+}
+
+void copyVolume(VoxelVolume * src, VoxelVolume * dst)
+{
+    int xdim, ydim, zdim;
+    cgp::Point corner;
+    cgp::Vector diag;
+
+    src->getDim(xdim, ydim, zdim);
+    src->getFrame(corner, diag);
+    dst->setDim(xdim, ydim, zdim);
+    dst->setFrame(corner, diag);
+    if(src->getNumWords() > 0)
+        memcpy(dst->getWords(), src->getWords(), sizeof(std::uint64_t) * src->getNumWords());
+}
+
+VoxelCache::VoxelCache(long bytes)
+{
+    budget = bytes;
+    used = 0;
+    hits = misses = evictions = 0;
+}
+
+VoxelCache::~VoxelCache()
+{
+    clear();
+}
+
+bool VoxelCache::find(std::uint64_t key, VoxelVolume * vox)
+{
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator>::iterator it;
+
+    it = index.find(key);
+    if(it == index.end())
+    {
+        misses++;
+        return false;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second); // iterators stay valid when moved to the front
+    copyVolume(it->second->second, vox);
+    return true;
+}
+
+void VoxelCache::insert(std::uint64_t key, VoxelVolume * vox)
+{
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator>::iterator it;
+    VoxelVolume * copy;
+
+    if(volumeBytes(vox) > budget)
+        return;
+    it = index.find(key);
+    if(it != index.end()) // replace the old entry
+    {
+        used -= volumeBytes(it->second->second);
+        delete it->second->second;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+    copy = new VoxelVolume();
+    copyVolume(vox, copy);
+    lru.push_front(Entry(key, copy));
+    index[key] = lru.begin();
+    used += volumeBytes(copy);
+    trim();
+}
+
+void VoxelCache::trim()
+{
+    while(used > budget && !lru.empty())
+    {
+        used -= volumeBytes(lru.back().second);
+        index.erase(lru.back().first);
+        delete lru.back().second;
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+void VoxelCache::clear()
+{
+    std::list<Entry>::iterator it;
+
+    for(it = lru.begin(); it != lru.end(); it++)
+        delete it->second;
+    lru.clear();
+    index.clear();
+    used = 0;
+}
+
+static const char voxzipmagic[8] = {'T', 'E', 'S', 'V', 'O', 'X', 'Z', '1'}; ///< identifies a compressed voxel file
+
+/**
+ * Header at the start of a compressed voxel file
+ */
+struct VoxelZipHeader
+{
+    char magic[8];              ///< voxzipmagic
+    std::int32_t dim[3];        ///< number of voxels in x, y, z
+    float origin[3];            ///< corner point in world space
+    float diagonal[3];          ///< diagonal extent in world space
+};
+
+/**
+ * Header preceding each block of x-planes in a compressed voxel file
+ */
+struct VoxelZipBlock
+{
+    std::uint32_t xstart;       ///< first x-plane of the block
+    std::uint32_t xend;         ///< one past the last x-plane of the block
+    std::uint32_t runbytes;     ///< length of the run length encoding
+    std::uint32_t packedbytes;  ///< length of its LZ compression, which follows
+};
+
+/// Append an unsigned value as a little-endian base 128 varint
+static inline void putVarint(std::vector<unsigned char> &out, std::uint32_t v)
+{
+    while(v >= 0x80)
+    {
+        out.push_back((unsigned char) (v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((unsigned char) v);
+}
+
+/// Find the first voxel at or after pos in a packed column with the given value, or zdim if there is none
+static inline int nextVoxel(const std::uint64_t * col, int pos, int zdim, bool val)
+{
+    int w, zwords = (zdim + 63) >> 6;
+    std::uint64_t bits;
+
+    if(pos >= zdim)
+        return zdim;
+    w = pos >> 6;
+    bits = (val ? col[w] : ~col[w]) & (~((std::uint64_t) 0) << (pos & 63));
+    while(bits == 0)
+    {
+        if(++w == zwords)
+            return zdim;
+        bits = val ? col[w] : ~col[w];
+    }
+    return min(zdim, (w << 6) + __builtin_ctzll(bits)); // padding reads as a run of empty voxels beyond zdim
+}
+
+void voxRunEncode(VoxelVolume * vox, int xstart, int xend, std::vector<unsigned char> &out)
+{
+    int x, y, pos, next, xdim, ydim, zdim;
+    std::uint64_t * col;
+    bool val;
+
+    vox->getDim(xdim, ydim, zdim);
+    for(x = xstart; x < xend; x++)
+        for(y = 0; y < ydim; y++)
+        {
+            col = vox->getColumn(x, y);
+            pos = 0;
+            val = false;
+            while(pos < zdim)
+            {
+                next = nextVoxel(col, pos, zdim, !val);
+                putVarint(out, (std::uint32_t) (next - pos));
+                pos = next;
+                val = !val;
+            }
+        }
+}
+
+bool voxRunDecode(VoxelVolume * vox, int xstart, int xend, const unsigned char * in, std::size_t len)
+{
+    const unsigned char * ip = in, * iend = in + len;
+    int x, y, pos, shift, xdim, ydim, zdim;
+    std::uint32_t run;
+    std::uint64_t * col;
+    bool val;
+
+    vox->getDim(xdim, ydim, zdim);
+    for(x = xstart; x < xend; x++)
+        for(y = 0; y < ydim; y++)
+        {
+            col = vox->getColumn(x, y);
+            pos = 0;
+            val = false;
+            while(pos < zdim)
+            {
+                run = 0;
+                shift = 0;
+                do
+                {
+                    if(ip == iend || shift > 28)
+                        return false;
+                    run |= (std::uint32_t) (*ip & 0x7f) << shift;
+                    shift += 7;
+                } while(*ip++ & 0x80);
+                if(run > (std::uint32_t) (zdim - pos))
+                    return false;
+                if(val && run > 0)
+                    setColumnSpan(col, pos, pos + (int) run - 1);
+                pos += (int) run;
+                val = !val;
+            }
+        }
+    return ip == iend;
+}
+
+const int lzminmatch = 4;       ///< shortest back reference emitted by lzCompress
+const int lzhashbits = 14;      ///< log2 of the number of entries in the lzCompress match table
+const long lzmaxoffset = 65535; ///< furthest back reference, limited by its two byte encoding
+
+/// Append an LZ sequence length beyond its token nibble as a run of 255 bytes and a remainder
+static inline void putLzLength(std::vector<unsigned char> &out, std::size_t len)
+{
+    while(len >= 255)
+    {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back((unsigned char) len);
+}
+
+/// Append a sequence of literals followed by a back reference, or by nothing when mlen is zero
+static void putLzSequence(std::vector<unsigned char> &out, const unsigned char * lit, std::size_t litlen, std::size_t offset, std::size_t mlen)
+{
+    std::size_t mcode = (mlen > 0) ? mlen - lzminmatch : 0;
+
+    out.push_back((unsigned char) ((min(litlen, (std::size_t) 15) << 4) | min(mcode, (std::size_t) 15)));
+    if(litlen >= 15)
+        putLzLength(out, litlen - 15);
+    out.insert(out.end(), lit, lit + litlen);
+    if(mlen > 0)
+    {
+        out.push_back((unsigned char) (offset & 0xff));
+        out.push_back((unsigned char) (offset >> 8));
+        if(mcode >= 15)
+            putLzLength(out, mcode - 15);
+    }
+}
+
+/// Hash the four bytes at p into the match table
+static inline std::uint32_t lzHash(const unsigned char * p)
+{
+    std::uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - lzhashbits);
+}
+
+void lzCompress(const unsigned char * in, std::size_t len, std::vector<unsigned char> &out)
+{
+    std::vector<long> table(1 << lzhashbits, -1);
+    std::size_t i, anchor, mlen;
+    std::uint32_t h;
+    long cand;
+
+    out.clear();
+    i = anchor = 0;
+    while(i + lzminmatch <= len)
+    {
+        h = lzHash(in + i);
+        cand = table[h];
+        table[h] = (long) i;
+        if(cand >= 0 && (long) i - cand <= lzmaxoffset && memcmp(in + cand, in + i, lzminmatch) == 0)
+        {
+            mlen = lzminmatch;
+            while(i + mlen < len && in[cand + mlen] == in[i + mlen])
+                mlen++;
+            putLzSequence(out, in + anchor, i - anchor, i - (std::size_t) cand, mlen);
+            i += mlen;
+            anchor = i;
+        }
+        else
+            i++;
+    }
+    if(anchor < len || out.empty())
+        putLzSequence(out, in + anchor, len - anchor, 0, 0);
+}
+
+/// Read an LZ sequence length beyond its token nibble, returning false if the input runs out
+static inline bool getLzLength(const unsigned char * &ip, const unsigned char * iend, std::size_t &len)
+{
+    unsigned char b;
+
+    do
+    {
+        if(ip == iend)
+            return false;
+        b = *ip++;
+        len += b;
+    } while(b == 255);
+    return true;
+}
+
+bool lzDecompress(const unsigned char * in, std::size_t len, unsigned char * out, std::size_t outlen)
+{
+    const unsigned char * ip = in, * iend = in + len;
+    unsigned char * op = out, * oend = out + outlen;
+    std::size_t litlen, mlen, offset, done, n, period;
+    unsigned char token;
+
+    while(ip < iend)
+    {
+        token = *ip++;
+        litlen = token >> 4;
+        if(litlen == 15 && !getLzLength(ip, iend, litlen))
+            return false;
+        if(litlen > (std::size_t) (iend - ip) || litlen > (std::size_t) (oend - op))
+            return false;
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+        if(ip == iend) // final sequence has no back reference
+            break;
+
+        if(iend - ip < 2)
+            return false;
+        offset = (std::size_t) ip[0] | ((std::size_t) ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if(mlen == 15 && !getLzLength(ip, iend, mlen))
+            return false;
+        mlen += lzminmatch;
+        if(offset == 0 || offset > (std::size_t) (op - out) || mlen > (std::size_t) (oend - op))
+            return false;
+
+        // overlapping references repeat with period offset, so copy in doubling chunks that never overlap
+        period = offset;
+        for(done = 0; done < mlen; done += n)
+        {
+            n = min(period, mlen - done);
+            memcpy(op + done, op + done - period, n);
+            period *= 2;
+        }
+        op += mlen;
+    }
+    return op == oend;
+}
+
+bool VoxelWriter::open(const std::string &filename, VoxelVolume * vox)
+{
+    VoxelZipHeader hdr;
+    cgp::Point corner;
+    cgp::Vector diag;
+
+    outfile.open(filename.c_str(), ios_base::out | ios_base::binary | ios_base::trunc);
+    if(!outfile.is_open())
+    {
+        cerr << "Error VoxelWriter::open: unable to open " << filename << endl;
+        return false;
+    }
+    vox->getDim(xdim, ydim, zdim);
+    vox->getFrame(corner, diag);
+    xnext = 0;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, voxzipmagic, sizeof(voxzipmagic));
+    hdr.dim[0] = xdim; hdr.dim[1] = ydim; hdr.dim[2] = zdim;
+    hdr.origin[0] = corner.x; hdr.origin[1] = corner.y; hdr.origin[2] = corner.z;
+    hdr.diagonal[0] = diag.i; hdr.diagonal[1] = diag.j; hdr.diagonal[2] = diag.k;
+    outfile.write((const char *) &hdr, sizeof(hdr));
+    return outfile.good();
+}
+
+bool VoxelWriter::writeSlab(VoxelVolume * vox, int xstart, int xend)
+{
+    VoxelZipBlock block;
+    int x, y, z;
+
+    vox->getDim(x, y, z);
+    if(!outfile.is_open() || x != xdim || y != ydim || z != zdim || xstart != xnext || xend <= xstart || xend > xdim)
+    {
+        cerr << "Error VoxelWriter::writeSlab: planes " << xstart << " to " << xend << " out of sequence" << endl;
+        return false;
+    }
+    runs.clear();
+    voxRunEncode(vox, xstart, xend, runs);
+    lzCompress(runs.data(), runs.size(), packed);
+
+    block.xstart = (std::uint32_t) xstart;
+    block.xend = (std::uint32_t) xend;
+    block.runbytes = (std::uint32_t) runs.size();
+    block.packedbytes = (std::uint32_t) packed.size();
+    outfile.write((const char *) &block, sizeof(block));
+    outfile.write((const char *) packed.data(), packed.size());
+    xnext = xend;
+    return outfile.good();
+}
+
+bool VoxelWriter::close()
+{
+    bool complete = (xnext == xdim);
+
+    if(!outfile.is_open())
+        return false;
+    outfile.close();
+    if(!complete)
+        cerr << "Error VoxelWriter::close: only " << xnext << " of " << xdim << " planes written" << endl;
+    return complete && !outfile.fail();
+}
+
+bool VoxelReader::open(const std::string &filename, VoxelVolume * vox)
+{
+    VoxelZipHeader hdr;
+    int x, y, z;
+
+    infile.open(filename.c_str(), ios_base::in | ios_base::binary);
+    if(!infile.is_open())
+    {
+        cerr << "Error VoxelReader::open: unable to open " << filename << endl;
+        return false;
+    }
+    infile.read((char *) &hdr, sizeof(hdr));
+    if(!infile.good() || memcmp(hdr.magic, voxzipmagic, sizeof(voxzipmagic)) != 0 || hdr.dim[0] <= 0 || hdr.dim[1] <= 0 || hdr.dim[2] <= 0)
+    {
+        cerr << "Error VoxelReader::open: " << filename << " is not a compressed voxel file" << endl;
+        infile.close();
+        return false;
+    }
+    xdim = hdr.dim[0]; ydim = hdr.dim[1]; zdim = hdr.dim[2];
+    xnext = 0;
+
+    vox->getDim(x, y, z);
+    if(x == xdim && y == ydim && z == zdim)
+        vox->fill(false);
+    else
+        vox->setDim(xdim, ydim, zdim);
+    vox->setFrame(cgp::Point(hdr.origin[0], hdr.origin[1], hdr.origin[2]), cgp::Vector(hdr.diagonal[0], hdr.diagonal[1], hdr.diagonal[2]));
+    return true;
+}
+
+bool VoxelReader::readSlab(VoxelVolume * vox, int &xstart, int &xend)
+{
+    VoxelZipBlock block;
+    std::size_t maxruns;
+
+    if(!infile.is_open() || xnext >= xdim)
+        return false;
+    infile.read((char *) &block, sizeof(block));
+
+    // every column needs at most one varint per voxel plus one, of up to five bytes, so larger blocks are corrupt
+    maxruns = (std::size_t) (block.xend - block.xstart) * (std::size_t) ydim * (std::size_t) (zdim + 1) * 5;
+    if(!infile.good() || (int) block.xstart != xnext || block.xend <= block.xstart || (int) block.xend > xdim
+       || block.runbytes > maxruns || block.packedbytes > block.runbytes + block.runbytes / 4 + 16)
+    {
+        cerr << "Error VoxelReader::readSlab: corrupt block header at plane " << xnext << endl;
+        infile.close();
+        return false;
+    }
+    packed.resize(block.packedbytes);
+    runs.resize(block.runbytes);
+    infile.read((char *) packed.data(), packed.size());
+    if(!infile.good() || !lzDecompress(packed.data(), packed.size(), runs.data(), runs.size())
+       || !voxRunDecode(vox, (int) block.xstart, (int) block.xend, runs.data(), runs.size()))
+    {
+        cerr << "Error VoxelReader::readSlab: corrupt block at plane " << xnext << endl;
+        infile.close();
+        return false;
+    }
+    xstart = (int) block.xstart;
+    xend = (int) block.xend;
+    xnext = xend;
+    if(xnext == xdim)
+        infile.close();
+    return true;
+}
+
+bool writeVoxels(const std::string &filename, VoxelVolume * vox)
+{
+    VoxelWriter writer;
+    int x, xdim, ydim, zdim;
+
+    vox->getDim(xdim, ydim, zdim);
+    if(xdim <= 0 || ydim <= 0 || zdim <= 0)
+    {
+        cerr << "Error writeVoxels: volume is empty" << endl;
+        return false;
+    }
+    if(!writer.open(filename, vox))
+        return false;
+    for(x = 0; x < xdim; x += voxfileslab)
+        if(!writer.writeSlab(vox, x, min(xdim, x + voxfileslab)))
+            return false;
+    return writer.close();
+}
+
+bool readVoxels(const std::string &filename, VoxelVolume * vox)
+{
+    VoxelReader reader;
+    int xstart, xend;
+
+    if(!reader.open(filename, vox))
+        return false;
+    while(reader.readSlab(vox, xstart, xend));
+    return reader.done();
+}
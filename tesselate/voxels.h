@@ -10,18 +10,50 @@
 #include <vector>
 #include <stdio.h>
 #include <iostream>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <list>
+#include <string>
+#include <fstream>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
 #include "vecpnt.h"
+#include "threadpool.h"
+
+/**
+ * Different types of binary set operations on shapes
+ */
+enum class SetOp
+{
+    UNION,        ///< combine two shapes together
+    INTERSECTION, ///< create a shape in the region where the arguments overlap
+    DIFFERENCE,   ///< subtract second shape from the first
+};
+
+const long voxfilehdrbytes = 4096; ///< bytes reserved for the header of a mapped volume file, one page
 
 /**
- * A cuboid volume regularly subdivided into uniformly sized cubes (voxels). A bit packing approach can used to compress storage.
+ * A cuboid volume regularly subdivided into uniformly sized cubes (voxels). Storage is bit packed with 64 voxels
+ * to a word. Voxels are flattened with z varying fastest and each z-column is padded to a whole number of words,
+ * so that a column occupies a contiguous run of words and an x-slab a contiguous run of columns.
  */
 class VoxelVolume
 {
 private:
-    int * voxgrid;  ///< flattened voxel volume, bit packed to save memory
+    std::uint64_t * voxgrid;  ///< flattened voxel volume, bit packed to save memory
     int xdim;       ///< number of voxels in x dimension
     int ydim;       ///< number of voxels in y dimension
     int zdim;       ///< number of voxels in z dimension
+    int zwords;     ///< number of words in a single z-column
+    long numwords;  ///< total number of words in the flattened volume
+    std::uint64_t colmask; ///< valid bits in the last word of a z-column, padding bits are kept empty
+
+    int mapfd;          ///< descriptor of the backing file for a mapped volume, -1 for heap storage
+    void * mapbase;     ///< start of the file mapping, header first and voxel words after voxfilehdrbytes
+    std::size_t maplen; ///< length of the file mapping in bytes
 
     cgp::Point origin;     ///< corner point in world space
     cgp::Vector diagonal;  ///< diagonal extent of the volume in world space
@@ -30,13 +62,46 @@ private:
     /// Calculate the diagonal extent of a single cell and store internally
     void calcCellDiag();
 
+    /**
+     * Find the surface voxels of one z-column, by intersecting each word with its z neighbours, shifted in from
+     * the adjacent words, and with the matching words of the four lateral neighbour columns
+     * @param x, y      column location, zero indexed and assumed to be in bounds
+     * @param[out] out  getColumnWords() words receiving the surface voxels of the column
+     */
+    void surfaceColumn(int x, int y, std::uint64_t * out);
+
+    /// Set zwords, numwords and colmask to match the current dimensions
+    void calcPacking();
+
+    /// Copy dimensions and frame into the header of a mapped volume
+    void writeHeader();
+
+    /**
+     * Map the whole of an open backing file and point the voxel words past its header
+     * @param fd        descriptor of the backing file, owned by the volume from now on
+     * @param len       length of the file in bytes
+     * @retval true if the mapping succeeded,
+     * @retval false otherwise, in which case fd is closed
+     */
+    bool mapFile(int fd, std::size_t len);
+
+    /// Test whether a voxel location falls within the volume
+    inline bool inBounds(int x, int y, int z)
+    {
+        return (x >= 0 && x < xdim && y >= 0 && y < ydim && z >= 0 && z < zdim);
+    }
+
+    // the volume owns its words, file descriptor and mapping, so copies go through copyVolume or swap
+    VoxelVolume(const VoxelVolume &) = delete;
+    VoxelVolume &operator=(const VoxelVolume &) = delete;
+
 public:
 
     /// Default constructor
     VoxelVolume();
 
     /**
-     * Create voxel volume with specified dimensions. x dimension is padded to be divisible by 32
+     * Create voxel volume with specified dimensions. z-columns are padded to be divisible by 64
      * @param xsize, ysize, zsize      number of voxels in x, y, z dimensions
      * @param corner  origin position of the volume
      * @param diag     diagonal extent of the volume
@@ -47,14 +112,52 @@ public:
     ~VoxelVolume();
 
     /**
-     * Delete voxel volume grid
+     * Delete voxel volume grid and reset dimensions to zero. A mapped volume is unmapped, leaving its file intact.
      */
     void clear();
 
+    /**
+     * Create a volume backed by a file rather than the heap, so that it can exceed physical memory and be reopened
+     * later without parsing. The file holds a fixed header of voxfilehdrbytes with the dimensions and frame,
+     * followed by the packed words in the usual layout, so each x-slab is a contiguous byte range. Only the first
+     * word is page aligned; later slabs start on a page boundary only when a slab is a whole number of pages.
+     * Voxels start empty and the file is sparse until written. Any existing file is overwritten.
+     * @param filename  path of the backing file
+     * @param xsize, ysize, zsize      number of voxels in x, y, z dimensions
+     * @param corner    origin position of the volume
+     * @param diag      diagonal extent of the volume
+     * @retval true if the file was created and mapped,
+     * @retval false otherwise, leaving the volume cleared
+     */
+    bool createMapped(const std::string &filename, int xsize, int ysize, int zsize, cgp::Point corner, cgp::Vector diag);
+
+    /**
+     * Reopen a volume previously created with createMapped. Changes are written back to the file.
+     * @param filename  path of the backing file
+     * @retval true if the file has a valid header and was mapped,
+     * @retval false otherwise, leaving the volume cleared
+     */
+    bool openMapped(const std::string &filename);
+
+    /// Test whether the voxels are held in a mapped file rather than on the heap
+    bool isMapped(){ return mapbase != NULL; }
+
+    /**
+     * Write any modified voxels of a mapped volume through to its file, blocking until done
+     * @retval true if the volume is on the heap or the write succeeded,
+     * @retval false otherwise
+     */
+    bool sync();
+
+    /**
+     * Exchange contents, dimensions and frame with another volume without copying voxels
+     * @param other     volume to exchange with
+     */
+    void swap(VoxelVolume &other);
+
     /**
      * Set all voxel elements in volume to empty or occupied
      * @param setval    new value for all voxel elements, either empty (false) or occupied (true)
-     * @todo VoxelVolume::fill to be completed for CGP Assignment2
      */
     void fill(bool setval);
 
@@ -65,9 +168,9 @@ public:
     void getDim(int &dimx, int &dimy, int &dimz);
 
     /**
-     * Set the dimensions of the voxel volume and allocate memory accordingly
+     * Set the dimensions of the voxel volume and allocate memory accordingly. All voxels are initially empty.
+     * A mapped volume is detached from its file and moves to the heap.
      * @param dimx, dimy, dimz     number of voxels in x, y, z dimensions
-     * @todo VoxelVolume::setDim to be completed for CGP Assignment2
      */
     void setDim(int dimx, int dimy, int dimz);
 
@@ -79,7 +182,7 @@ public:
     void getFrame(cgp::Point &corner, cgp::Vector &diag);
 
     /**
-     * Setter for the placement and dimensions of the volume in 3d space
+     * Setter for the placement and dimensions of the volume in 3d space, also recorded in the file of a mapped volume
      * @param corner    bottom, front, left corner of the volume
      * @param diag      diagonal vector across the volume
      */
@@ -91,7 +194,6 @@ public:
      * @param setval    new voxel value, either empty (false) or occupied (true)
      * @retval true if the voxel is within volume bounds,
      * @retval false otherwise.
-     * @todo VoxelVolume::set to be completed for CGP Assignment2
      */
     bool set(int x, int y, int z, bool setval);
 
@@ -100,7 +202,6 @@ public:
      * @param x, y, z   3D location, zero indexed
      * @retval true if the voxel is occupied,
      * @retval false if the voxel is empty.
-     * @todo VoxelVolume::get to be completed for CGP Assignment2
      */
     bool get(int x, int y, int z);
 
@@ -110,12 +211,739 @@ public:
      * @returns voxel centre point 
      */
     cgp::Point getVoxelPos(int x, int y, int z);
+
+    /**
+     * Find the range of voxels whose centres might fall inside a world-space box. The range is padded by a
+     * voxel on each side to absorb rounding, and clamped to the volume.
+     * @param box       world-space axis-aligned box
+     * @param[out] lo, hi   inclusive voxel index ranges, indexed by axis
+     * @retval true if the range is non-empty,
+     * @retval false if the box misses the volume entirely
+     */
+    bool getBoxRange(cgp::BoundBox box, int lo[3], int hi[3]);
     
     int getdimX();
     
     int getdimY();
     
     int getdimZ();
+
+    /**
+     * Count the number of occupied voxels in the volume
+     * @returns number of voxels set to occupied
+     */
+    long count();
+
+    /**
+     * Find the surface voxels, those occupied with at least one empty 6-neighbour. Voxels outside the volume count
+     * as empty, so occupied voxels on the volume faces are always on the surface. Works a word at a time, with
+     * x-slabs spread across threads.
+     * @param[out] surf     resized to match this volume, with its frame, and set to the surface voxels
+     * @param pool          threads to use, or NULL to run on the calling thread
+     * @retval true if the surface was found,
+     * @retval false if surf is this volume, which cannot be overwritten while it is read
+     */
+    bool boundary(VoxelVolume * surf, ThreadPool * pool = NULL);
+
+    /**
+     * Find the surface voxels as in boundary, but as a list of voxel coordinates without an intermediate volume.
+     * The list is sorted by x, then y, then z, which is storage order. Surface voxels are counted per x-slab
+     * first, so that each slab writes straight to its place in the list.
+     * @param[out] coords   x, y, z index triples of the surface voxels, replacing any existing contents
+     * @param pool          threads to use, or NULL to run on the calling thread
+     * @returns number of surface voxels
+     */
+    long boundaryList(std::vector<int> &coords, ThreadPool * pool = NULL);
+
+    /// Number of 64-bit words in a single z-column
+    int getColumnWords(){ return zwords; }
+
+    /// Total number of 64-bit words in the volume
+    long getNumWords(){ return numwords; }
+
+    /**
+     * Index of the word holding a particular voxel. The voxel is stored at bit (z % 64) of this word.
+     * @param x, y, z   3D location, zero indexed and assumed to be in bounds
+     * @returns offset into the word array
+     */
+    inline long getWordIndex(int x, int y, int z)
+    {
+        return ((long) x * (long) ydim + (long) y) * (long) zwords + (long) (z >> 6);
+    }
+
+    /**
+     * Raw access to the packed voxel words for bulk operations. Bits beyond zdim in the last word of each column
+     * must be left empty.
+     * @param start     index of first word in the range
+     * @returns pointer to the word at start, or NULL if the volume is unallocated
+     */
+    std::uint64_t * getWords(long start = 0){ return (voxgrid == NULL) ? NULL : voxgrid + start; }
+
+    /**
+     * Raw access to the words of a single z-column
+     * @param x, y      column location, zero indexed and assumed to be in bounds
+     * @returns pointer to getColumnWords() consecutive words, or NULL if the volume is unallocated
+     */
+    std::uint64_t * getColumn(int x, int y){ return getWords(getWordIndex(x, y, 0)); }
+
+    /// Mask of valid bits in the last word of every z-column
+    std::uint64_t getColumnMask(){ return colmask; }
+};
+
+/**
+ * Apply a boolean set operation across a run of packed voxel words, as dst = dst op src. Uses AVX2 or SSE2
+ * when the compiler targets them, with a scalar fallback for other targets and for the tail of the run.
+ * @param op            boolean set operation being applied
+ * @param[out] dst      first operand, overwritten with the result
+ * @param src           second operand
+ * @param numwords      number of 64-bit words in each run
+ */
+void voxWordOp(SetOp op, std::uint64_t * dst, const std::uint64_t * src, long numwords);
+
+/**
+ * Set a contiguous run of voxels within a packed z-column, writing whole words where the run covers them
+ * @param[out] col          first word of the column
+ * @param zstart, zend      inclusive range of z indices to set
+ */
+void setColumnSpan(std::uint64_t * col, int zstart, int zend);
+
+const int brickbits = 3;                    ///< log2 of the side length of a sparse brick
+const int bricksize = 1 << brickbits;       ///< side length of a sparse brick in voxels
+const int brickwords = bricksize * bricksize * bricksize / 64; ///< number of 64-bit words in a sparse brick
+
+/**
+ * Occupancy classification of a single brick in a sparse volume
+ */
+enum class BrickState
+{
+    EMPTY,  ///< no voxels occupied, not stored
+    FULL,   ///< every voxel occupied, stored as a flag only
+    MIXED,  ///< partially occupied, stored as a bit packed brick
+};
+
+/**
+ * Bit packed storage for a single 8x8x8 brick. Bit (ly*8 + lz) of word lx holds local voxel (lx, ly, lz).
+ */
+struct VoxelBrick
+{
+    std::uint64_t w[brickwords]; ///< packed voxel bits
+};
+
+/**
+ * A sparse alternative to VoxelVolume for scenes that occupy a small part of their bounding volume. The volume
+ * is divided into 8x8x8 bricks held in a hash table. Empty bricks are not stored at all and fully occupied
+ * bricks are collapsed to a flag, so memory and set operation cost scale with surface area rather than volume.
+ */
+class SparseVoxelVolume
+{
+private:
+    int xdim;       ///< number of voxels in x dimension
+    int ydim;       ///< number of voxels in y dimension
+    int zdim;       ///< number of voxels in z dimension
+    int bxdim;      ///< number of bricks in x dimension
+    int bydim;      ///< number of bricks in y dimension
+    int bzdim;      ///< number of bricks in z dimension
+
+    std::unordered_map<long, VoxelBrick> mixed; ///< partially occupied bricks, keyed on flattened brick index
+    std::unordered_set<long> full;              ///< flattened indices of fully occupied bricks
+
+    cgp::Point origin;     ///< corner point in world space
+    cgp::Vector diagonal;  ///< diagonal extent of the volume in world space
+    cgp::Vector cell;      ///< diagonal extent of a single voxel cell
+
+    /// Calculate the diagonal extent of a single cell and store internally
+    void calcCellDiag();
+
+    /// Flatten brick coordinates into a hash key
+    inline long brickKey(int bx, int by, int bz)
+    {
+        return ((long) bx * (long) bydim + (long) by) * (long) bzdim + (long) bz;
+    }
+
+    /**
+     * Mask of voxels within a brick that fall inside the volume. Only bricks on the upper boundary are partial.
+     * @param key       flattened brick index
+     * @param[out] mask brick with every in-bounds voxel set
+     */
+    void brickMask(long key, VoxelBrick &mask);
+
+    /**
+     * Reclassify a mixed brick after modification, removing it if empty or collapsing it to a flag if full
+     * @param key   flattened brick index of a brick currently in the mixed table
+     */
+    void collapse(long key);
+
+public:
+
+    /// Default constructor
+    SparseVoxelVolume();
+
+    /**
+     * Create sparse voxel volume with specified dimensions
+     * @param xsize, ysize, zsize      number of voxels in x, y, z dimensions
+     * @param corner  origin position of the volume
+     * @param diag     diagonal extent of the volume
+     */
+    SparseVoxelVolume(int xsize, int ysize, int zsize, cgp::Point corner, cgp::Vector diag);
+
+    /// Destructor
+    ~SparseVoxelVolume();
+
+    /// Delete all bricks, leaving every voxel empty
+    void clear();
+
+    /**
+     * Set all voxel elements in volume to empty or occupied. Takes time proportional to the number of bricks.
+     * @param setval    new value for all voxel elements, either empty (false) or occupied (true)
+     */
+    void fill(bool setval);
+
+    /**
+     * Obtain the dimensions of the voxel volume
+     * @param dimx, dimy, dimz     number of voxels in x, y, z dimensions
+     */
+    void getDim(int &dimx, int &dimy, int &dimz);
+
+    /**
+     * Set the dimensions of the voxel volume. All voxels are initially empty.
+     * @param dimx, dimy, dimz     number of voxels in x, y, z dimensions
+     */
+    void setDim(int dimx, int dimy, int dimz);
+
+    /**
+     * Getter for the placement and dimensions of the volume in 3d space
+     * @param corner    bottom, front, left corner of the volume
+     * @param diag      diagonal vector across the volume
+     */
+    void getFrame(cgp::Point &corner, cgp::Vector &diag);
+
+    /**
+     * Setter for the placement and dimensions of the volume in 3d space
+     * @param corner    bottom, front, left corner of the volume
+     * @param diag      diagonal vector across the volume
+     */
+    void setFrame(cgp::Point corner, cgp::Vector diag);
+
+    /**
+     * Set a single voxel element to either empty or occupied
+     * @param x, y, z   3D location, zero indexed
+     * @param setval    new voxel value, either empty (false) or occupied (true)
+     * @retval true if the voxel is within volume bounds,
+     * @retval false otherwise.
+     */
+    bool set(int x, int y, int z, bool setval);
+
+    /**
+     * Get the status of a single voxel element at the specified position
+     * @param x, y, z   3D location, zero indexed
+     * @retval true if the voxel is occupied,
+     * @retval false if the voxel is empty.
+     */
+    bool get(int x, int y, int z);
+
+    /**
+     * Find the world-space position of the centre of a voxel
+     * @param x, y, z   3D location, zero indexed
+     * @returns voxel centre point
+     */
+    cgp::Point getVoxelPos(int x, int y, int z);
+
+    /**
+     * Classify the brick containing a particular voxel
+     * @param x, y, z   3D location, zero indexed
+     * @returns occupancy state of the enclosing brick
+     */
+    BrickState getBrickState(int x, int y, int z);
+
+    /// Number of partially occupied bricks stored
+    long numMixed(){ return (long) mixed.size(); }
+
+    /// Number of fully occupied bricks stored as flags
+    long numFull(){ return (long) full.size(); }
+
+    /// Approximate memory used by the brick tables in bytes
+    long memUsage();
+
+    /**
+     * Count the number of occupied voxels in the volume
+     * @returns number of voxels set to occupied
+     */
+    long count();
+
+    /**
+     * Apply a boolean set operation in place, brick by brick. Empty and full bricks are resolved from their flags
+     * without touching voxel data.
+     * @param op        boolean set operation, applied as this = this op rightarg
+     * @param rightarg  second operand, which must have the same dimensions
+     */
+    void combine(SetOp op, SparseVoxelVolume *rightarg);
+
+    /**
+     * Expand into a dense voxel volume with the same dimensions and frame
+     * @param[out] vox  dense volume, reallocated to match
+     */
+    void toDense(VoxelVolume *vox);
+
+    /**
+     * Replace contents with those of a dense voxel volume, adopting its dimensions and frame
+     * @param vox   dense volume to convert
+     */
+    void fromDense(VoxelVolume *vox);
+};
+
+const std::uint64_t mortonxmask = 0x4924924924924924ULL; ///< bits of a Morton code taken by x
+const std::uint64_t mortonymask = 0x2492492492492492ULL; ///< bits of a Morton code taken by y
+const std::uint64_t mortonzmask = 0x1249249249249249ULL; ///< bits of a Morton code taken by z
+const int mortonblockside = 4;  ///< side length of the block of voxels held in one word of a Morton volume
+
+#if !defined(__BMI2__)
+/// Spread the low 21 bits of v so that bit i moves to bit 3i
+inline std::uint64_t mortonSpread(std::uint64_t v)
+{
+    v &= 0x1fffffULL;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+/// Inverse of mortonSpread, gathering every third bit of v into the low 21 bits
+inline std::uint64_t mortonCompact(std::uint64_t v)
+{
+    v &= 0x1249249249249249ULL;
+    v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ULL;
+    v = (v ^ (v >> 4)) & 0x100f00f00f00f00fULL;
+    v = (v ^ (v >> 8)) & 0x1f0000ff0000ffULL;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffffULL;
+    v = (v ^ (v >> 32)) & 0x1fffffULL;
+    return v;
+}
+#endif
+
+/**
+ * Interleave the bits of a voxel location into a Morton (Z-order) code, z taking the lowest bit. Uses the BMI2
+ * pdep instruction when the compiler targets it and bit spreading otherwise.
+ * @param x, y, z   3D location, each less than 2^21
+ * @returns Morton code
+ */
+inline std::uint64_t mortonEncode(int x, int y, int z)
+{
+#if defined(__BMI2__)
+    return _pdep_u64((std::uint64_t) x, mortonxmask) | _pdep_u64((std::uint64_t) y, mortonymask) | _pdep_u64((std::uint64_t) z, mortonzmask);
+#else
+    return (mortonSpread((std::uint64_t) x) << 2) | (mortonSpread((std::uint64_t) y) << 1) | mortonSpread((std::uint64_t) z);
+#endif
+}
+
+/**
+ * Recover a voxel location from its Morton code, using pext where available
+ * @param code      Morton code
+ * @param[out] x, y, z  3D location
+ */
+inline void mortonDecode(std::uint64_t code, int &x, int &y, int &z)
+{
+#if defined(__BMI2__)
+    x = (int) _pext_u64(code, mortonxmask);
+    y = (int) _pext_u64(code, mortonymask);
+    z = (int) _pext_u64(code, mortonzmask);
+#else
+    x = (int) mortonCompact(code >> 2);
+    y = (int) mortonCompact(code >> 1);
+    z = (int) mortonCompact(code);
+#endif
+}
+
+/**
+ * A bit packed alternative to VoxelVolume that stores voxels in Morton order, so that voxels close together in
+ * space are close together in memory along every axis rather than only along z. Each word holds a 4x4x4 block,
+ * with voxel (x, y, z) at bit (code % 64) of word (code / 64). Storage is padded out to a power-of-two cube, so
+ * the layout suits roughly cubic volumes. Padding voxels are kept empty.
+ */
+class MortonVoxelVolume
+{
+private:
+    std::uint64_t * voxgrid;  ///< voxel words in Morton order
+    int xdim;       ///< number of voxels in x dimension
+    int ydim;       ///< number of voxels in y dimension
+    int zdim;       ///< number of voxels in z dimension
+    int side;       ///< side length of the padded power-of-two cube
+    long numwords;  ///< total number of words, one per 4x4x4 block
+
+    cgp::Point origin;     ///< corner point in world space
+    cgp::Vector diagonal;  ///< diagonal extent of the volume in world space
+    cgp::Vector cell;      ///< diagonal extent of a single voxel cell
+
+    /// Calculate the diagonal extent of a single cell and store internally
+    void calcCellDiag();
+
+    /// Test whether a voxel location falls within the volume
+    inline bool inBounds(int x, int y, int z)
+    {
+        return (x >= 0 && x < xdim && y >= 0 && y < ydim && z >= 0 && z < zdim);
+    }
+
+    /**
+     * Mask of the voxels of a block that fall within the volume
+     * @param block     index of the block in Morton order
+     * @returns word with every in-bounds voxel set
+     */
+    std::uint64_t blockMask(long block);
+
+public:
+
+    /// Default constructor
+    MortonVoxelVolume();
+
+    /**
+     * Create Morton-ordered voxel volume with specified dimensions
+     * @param xsize, ysize, zsize      number of voxels in x, y, z dimensions
+     * @param corner  origin position of the volume
+     * @param diag     diagonal extent of the volume
+     */
+    MortonVoxelVolume(int xsize, int ysize, int zsize, cgp::Point corner, cgp::Vector diag);
+
+    /// Destructor
+    ~MortonVoxelVolume();
+
+    /// Delete voxel storage and reset dimensions to zero
+    void clear();
+
+    /**
+     * Set all voxel elements in volume to empty or occupied
+     * @param setval    new value for all voxel elements, either empty (false) or occupied (true)
+     */
+    void fill(bool setval);
+
+    /**
+     * Obtain the dimensions of the voxel volume
+     * @param dimx, dimy, dimz     number of voxels in x, y, z dimensions
+     */
+    void getDim(int &dimx, int &dimy, int &dimz);
+
+    /**
+     * Set the dimensions of the voxel volume and allocate memory accordingly. All voxels are initially empty.
+     * @param dimx, dimy, dimz     number of voxels in x, y, z dimensions
+     */
+    void setDim(int dimx, int dimy, int dimz);
+
+    /**
+     * Getter for the placement and dimensions of the volume in 3d space
+     * @param corner    bottom, front, left corner of the volume
+     * @param diag      diagonal vector across the volume
+     */
+    void getFrame(cgp::Point &corner, cgp::Vector &diag);
+
+    /**
+     * Setter for the placement and dimensions of the volume in 3d space
+     * @param corner    bottom, front, left corner of the volume
+     * @param diag      diagonal vector across the volume
+     */
+    void setFrame(cgp::Point corner, cgp::Vector diag);
+
+    /**
+     * Set a single voxel element to either empty or occupied
+     * @param x, y, z   3D location, zero indexed
+     * @param setval    new voxel value, either empty (false) or occupied (true)
+     * @retval true if the voxel is within volume bounds,
+     * @retval false otherwise.
+     */
+    bool set(int x, int y, int z, bool setval);
+
+    /**
+     * Get the status of a single voxel element at the specified position
+     * @param x, y, z   3D location, zero indexed
+     * @retval true if the voxel is occupied,
+     * @retval false if the voxel is empty or out of bounds.
+     */
+    inline bool get(int x, int y, int z)
+    {
+        std::uint64_t code;
+
+        if(voxgrid == NULL || !inBounds(x, y, z))
+            return false;
+        code = mortonEncode(x, y, z);
+        return ((voxgrid[code >> 6] >> (code & 63)) & 1) != 0;
+    }
+
+    /**
+     * Find the world-space position of the centre of a voxel
+     * @param x, y, z   3D location, zero indexed
+     * @returns voxel centre point
+     */
+    cgp::Point getVoxelPos(int x, int y, int z);
+
+    /**
+     * Count the number of occupied voxels in the volume
+     * @returns number of voxels set to occupied
+     */
+    long count();
+
+    /// Number of 4x4x4 blocks, and so of 64-bit words, in the padded volume
+    long getNumBlocks(){ return numwords; }
+
+    /**
+     * Raw access to the block words, in Morton order of their blocks
+     * @returns pointer to the first word, or NULL if the volume is unallocated
+     */
+    std::uint64_t * getWords(){ return voxgrid; }
+
+    /**
+     * Find the voxel location of the lowest corner of a block
+     * @param block         index of the block in Morton order
+     * @param[out] x, y, z  3D location of the block corner
+     */
+    void getBlockCorner(long block, int &x, int &y, int &z){ mortonDecode((std::uint64_t) block << 6, x, y, z); }
+
+    /**
+     * Visit blocks in Morton order, which keeps successive blocks and their neighbours close in memory.
+     * Bit i of a block word holds the voxel at the block corner offset by mortonDecode(i).
+     * @param body      called with the block corner and a reference to its word, which may be modified
+     *                  provided out of bounds voxels are left empty
+     * @param skipempty if true, blocks with no occupied voxels are not visited
+     */
+    void forEachBlock(std::function<void(int x, int y, int z, std::uint64_t &bits)> body, bool skipempty);
+
+    /**
+     * Expand into a linear voxel volume with the same dimensions and frame
+     * @param[out] vox  linear volume, reallocated to match
+     */
+    void toDense(VoxelVolume *vox);
+
+    /**
+     * Replace contents with those of a linear voxel volume, adopting its dimensions and frame
+     * @param vox   linear volume to convert
+     */
+    void fromDense(VoxelVolume *vox);
+};
+
+/**
+ * A memory bounded cache of voxel volumes keyed by 64-bit content hashes, discarding the least recently used
+ * entries first once the budget is exceeded. Volumes are copied on the way in and out, so entries are never
+ * aliased by callers.
+ */
+class VoxelCache
+{
+private:
+    typedef std::pair<std::uint64_t, VoxelVolume *> Entry;
+
+    std::list<Entry> lru;   ///< entries, most recently used first
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index;    ///< position of each key in lru
+    long budget;            ///< maximum bytes of voxel storage held
+    long used;              ///< bytes of voxel storage currently held
+    long hits, misses, evictions;   ///< lookup and eviction statistics
+
+    /// Bytes of voxel storage taken by a volume
+    long volumeBytes(VoxelVolume * vox){ return vox->getNumWords() * (long) sizeof(std::uint64_t); }
+
+    /// Discard least recently used entries until the storage held is within the budget
+    void trim();
+
+public:
+
+    /**
+     * Constructor
+     * @param bytes     memory budget for cached voxel storage
+     */
+    VoxelCache(long bytes = 256L << 20);
+
+    /// Destructor
+    ~VoxelCache();
+
+    /**
+     * Look up a volume, counting a hit or miss and marking the entry as most recently used
+     * @param key           content hash
+     * @param[out] vox      receives a copy of the cached volume on a hit, reallocated to match
+     * @retval @c true  if the key was found
+     * @retval @c false otherwise, in which case vox is unchanged
+     */
+    bool find(std::uint64_t key, VoxelVolume * vox);
+
+    /**
+     * Store a copy of a volume, replacing any entry with the same key. Volumes larger than the whole budget are
+     * not stored.
+     * @param key   content hash
+     * @param vox   volume to copy
+     */
+    void insert(std::uint64_t key, VoxelVolume * vox);
+
+    /// Discard every entry, keeping the statistics
+    void clear();
+
+    /**
+     * Change the memory budget, discarding entries as necessary
+     * @param bytes     memory budget for cached voxel storage
+     */
+    void setBudget(long bytes){ budget = bytes; trim(); }
+
+    /// Getter for the memory budget in bytes
+    long getBudget(){ return budget; }
+
+    /// Getter for the bytes of voxel storage currently held
+    long getUsed(){ return used; }
+
+    /// Getter for the number of entries
+    int size(){ return (int) lru.size(); }
+
+    /// Getter for the number of successful lookups
+    long getHits(){ return hits; }
+
+    /// Getter for the number of failed lookups
+    long getMisses(){ return misses; }
+
+    /// Getter for the number of entries discarded to stay within the budget
+    long getEvictions(){ return evictions; }
+
+    /// Reset hit, miss and eviction counts to zero
+    void resetStats(){ hits = misses = evictions = 0; }
 };
 
+/**
+ * Copy the contents of one volume into another, including dimensions and frame
+ * @param src       volume to copy
+ * @param[out] dst  receives the copy, reallocated to match
+ */
+void copyVolume(VoxelVolume * src, VoxelVolume * dst);
+
+const int voxfileslab = 16; ///< x-planes per compressed block written by writeVoxels
+
+/**
+ * Run length encode the z-columns of a range of x-planes. Each column becomes alternating run lengths of empty and
+ * occupied voxels, starting with empty, written as little-endian base 128 varints that sum to the column height.
+ * @param vox           volume to encode
+ * @param xstart, xend  range of x-planes, xend exclusive
+ * @param[out] out      receives the encoding, appended to any existing contents
+ */
+void voxRunEncode(VoxelVolume * vox, int xstart, int xend, std::vector<unsigned char> &out);
+
+/**
+ * Decode runs produced by voxRunEncode back into a range of x-planes, which must start empty
+ * @param[out] vox      volume receiving the voxels
+ * @param xstart, xend  range of x-planes, xend exclusive
+ * @param in, len       encoded runs
+ * @retval true if the runs exactly cover the planes,
+ * @retval false if they are malformed
+ */
+bool voxRunDecode(VoxelVolume * vox, int xstart, int xend, const unsigned char * in, std::size_t len);
+
+/**
+ * Compress bytes with a small LZ77 coder in the style of LZ4: sequences of literals followed by a back reference
+ * of at least four bytes within the previous 64 KB, with greedy hash matching.
+ * @param in, len       bytes to compress
+ * @param[out] out      receives the compressed bytes, replacing any existing contents
+ */
+void lzCompress(const unsigned char * in, std::size_t len, std::vector<unsigned char> &out);
+
+/**
+ * Reverse lzCompress
+ * @param in, len       compressed bytes
+ * @param[out] out      buffer of exactly the uncompressed length
+ * @param outlen        uncompressed length
+ * @retval true if the input decodes to exactly outlen bytes,
+ * @retval false if it is malformed
+ */
+bool lzDecompress(const unsigned char * in, std::size_t len, unsigned char * out, std::size_t outlen);
+
+/**
+ * Streaming writer for compressed voxel files. The header records dimensions and frame, then each block holds
+ * a run of x-planes, run length encoded by column and then LZ compressed, so only one slab is ever buffered.
+ * A typical part shrinks to well under 1% of its packed size.
+ */
+class VoxelWriter
+{
+private:
+    std::ofstream outfile;              ///< destination file
+    int xdim, ydim, zdim;               ///< dimensions of the volume being written
+    int xnext;                          ///< first x-plane not yet written
+    std::vector<unsigned char> runs;    ///< run length encoding of the current block
+    std::vector<unsigned char> packed;  ///< LZ compression of runs
+
+public:
+
+    VoxelWriter(){ xdim = ydim = zdim = xnext = 0; }
+
+    /**
+     * Create the file and write its header
+     * @param filename  path of the file to create, overwritten if it exists
+     * @param vox       volume providing dimensions and frame
+     * @retval true if the header was written,
+     * @retval false otherwise
+     */
+    bool open(const std::string &filename, VoxelVolume * vox);
+
+    /**
+     * Append the next block of x-planes. Blocks must follow on from each other starting at plane zero.
+     * @param vox           volume holding the planes, with the dimensions passed to open
+     * @param xstart, xend  range of x-planes, xend exclusive
+     * @retval true if the block was written,
+     * @retval false if it is out of sequence or the write failed
+     */
+    bool writeSlab(VoxelVolume * vox, int xstart, int xend);
+
+    /**
+     * Finish the file
+     * @retval true if every plane was written and the file closed cleanly,
+     * @retval false otherwise
+     */
+    bool close();
+};
+
+/**
+ * Streaming reader for files produced by VoxelWriter, decoding one block of x-planes at a time.
+ */
+class VoxelReader
+{
+private:
+    std::ifstream infile;               ///< source file
+    int xdim, ydim, zdim;               ///< dimensions of the volume being read
+    int xnext;                          ///< first x-plane not yet read
+    std::vector<unsigned char> runs;    ///< run length encoding of the current block
+    std::vector<unsigned char> packed;  ///< compressed bytes of the current block
+
+public:
+
+    VoxelReader(){ xdim = ydim = zdim = xnext = 0; }
+
+    /**
+     * Open a file and read its header. The volume takes the recorded dimensions and frame and is emptied, keeping
+     * its storage if the dimensions already match, so a mapped volume can receive the voxels.
+     * @param filename  path of the file
+     * @param[out] vox  volume to receive the voxels
+     * @retval true if the header is valid,
+     * @retval false otherwise
+     */
+    bool open(const std::string &filename, VoxelVolume * vox);
+
+    /**
+     * Decode the next block of x-planes into the volume
+     * @param[out] vox      volume passed to open
+     * @param[out] xstart, xend     range of x-planes decoded, xend exclusive
+     * @retval true if a block was decoded,
+     * @retval false at the end of the volume or if the block is corrupt, see done
+     */
+    bool readSlab(VoxelVolume * vox, int &xstart, int &xend);
+
+    /// Test whether every x-plane has been read
+    bool done(){ return xdim > 0 && xnext == xdim; }
+};
+
+/**
+ * Write a whole volume as a compressed voxel file
+ * @param filename  path of the file to create
+ * @param vox       volume to save
+ * @retval true if successful,
+ * @retval false otherwise
+ */
+bool writeVoxels(const std::string &filename, VoxelVolume * vox);
+
+/**
+ * Read a whole volume from a compressed voxel file
+ * @param filename  path of the file
+ * @param[out] vox  volume to load into
+ * @retval true if successful,
+ * @retval false otherwise
+ */
+bool readVoxels(const std::string &filename, VoxelVolume * vox);
+
 #endif
@@ -163,9 +163,8 @@ void Window::showParamOptions()
 
 void Window::voxPress()
 {
-    perspectiveView->getScene()->voxelise(0.05f);
-    perspectiveView->setGeometryUpdate(true);
-    repaintAllGL();
+    // runs in the background, the view repaints itself once the result is ready
+    perspectiveView->voxeliseScene(0.05f);
 }
 
 void Window::createActions()
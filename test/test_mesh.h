@@ -25,6 +25,33 @@ class TestMesh : public CppUnit::TestFixture
     CPPUNIT_TEST(testClear);
     CPPUNIT_TEST(testTraverse);
     CPPUNIT_TEST(testOps);
+    CPPUNIT_TEST(testBitPack);
+    CPPUNIT_TEST(testSparse);
+    CPPUNIT_TEST(testWordOps);
+    CPPUNIT_TEST(testParallelVox);
+    CPPUNIT_TEST(testStreamVox);
+    CPPUNIT_TEST(testBounds);
+    CPPUNIT_TEST(testColumnSpans);
+    CPPUNIT_TEST(testMeshSpans);
+    CPPUNIT_TEST(testMorton);
+    CPPUNIT_TEST(testCellClass);
+    CPPUNIT_TEST(testOctreeVox);
+    CPPUNIT_TEST(testProgramVox);
+    CPPUNIT_TEST(testSignedDistance);
+    CPPUNIT_TEST(testCSGProgram);
+    CPPUNIT_TEST(testFusedProgram);
+    CPPUNIT_TEST(testOptimiseTree);
+    CPPUNIT_TEST(testCachedVox);
+    CPPUNIT_TEST(testProgressiveVox);
+    CPPUNIT_TEST(testBackgroundVox);
+    CPPUNIT_TEST(testMappedVolume);
+    CPPUNIT_TEST(testVoxelFile);
+    CPPUNIT_TEST(testMarchingCubes);
+    CPPUNIT_TEST(testSurfaceNets);
+    CPPUNIT_TEST(testVoxelFaces);
+    CPPUNIT_TEST(testInstanceBuffer);
+    CPPUNIT_TEST(testBoundary);
+    CPPUNIT_TEST(testDecimate);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -108,6 +135,87 @@ public:
     void testTraverse();
     
     void testOps();
+
+    /// Check set, get and fill across word boundaries of the bit packed voxel store
+    void testBitPack();
+
+    /// Check brick collapsing and set operations on the sparse voxel volume against a dense equivalent
+    void testSparse();
+
+    /// Check the word-parallel set operation kernels, including the scalar tail
+    void testWordOps();
+
+    /// Check that threaded voxelisation gives exactly the same grid as serial voxelisation
+    void testParallelVox();
+
+    /// Check that slab-streamed csg evaluation matches combining whole leaf grids
+    void testStreamVox();
+
+    /// Check that shape bounds enclose every contained point, including transformed meshes
+    void testBounds();
+
+    /// Check analytic column spans of spheres and cylinders against point containment
+    void testColumnSpans();
+
+    /// Check column parity spans of meshes, including lines through vertices and edges and open meshes
+    void testMeshSpans();
+
+    /// Check Morton encoding and the Morton-ordered volume against the linear layout
+    void testMorton();
+
+    /// Check that box classification is conservative for every shape type
+    void testCellClass();
+
+    /// Check that octree csg evaluation matches slab streaming
+    void testOctreeVox();
+
+    /// Check that voxelising through a compiled CSGProgram matches slab streaming, and falls back on the tree walk
+    void testProgramVox();
+
+    /// Check signed distances of each shape type and of a csg tree
+    void testSignedDistance();
+
+    /// Check that a compiled csg program agrees with the recursive tree walk
+    void testCSGProgram();
+
+    /// Check that trees of the fused form are recognised and agree with the generic program
+    void testFusedProgram();
+
+    /// Check that tree optimisation shares, prunes, flattens and reorders without changing the voxelisation
+    void testOptimiseTree();
+
+    /// Check that cached voxelisation reuses unchanged subtrees and respects its memory budget
+    void testCachedVox();
+
+    /// Check that progressive voxelisation publishes coarse levels first, ends at the streamed result and can be cancelled
+    void testProgressiveVox();
+
+    /// Check that background voxelisation reports progress, keeps the previous result until done and can be cancelled
+    void testBackgroundVox();
+
+    /// Check that file backed volumes combine like heap volumes and reopen with their contents intact
+    void testMappedVolume();
+
+    /// Check that compressed voxel files round trip exactly, stream by slab and reject corruption
+    void testVoxelFile();
+
+    /// Check that marching cubes gives closed manifold meshes without duplicate vertices, independent of thread count
+    void testMarchingCubes();
+
+    /// Check that surface nets gives closed manifold meshes, including where a cell surface is split, independent of thread count
+    void testSurfaceNets();
+
+    /// Check that the greedy voxel preview covers every exposed voxel face exactly once with far fewer vertices
+    void testVoxelFaces();
+
+    /// Check that instanced primitives reproduce the tessellated shapes, with per-instance data of a transform only
+    void testInstanceBuffer();
+
+    /// Check word-parallel surface voxels and coordinate lists against a per-voxel neighbour test, at any thread count
+    void testBoundary();
+
+    /// Check that decimation meets triangle targets and error bounds, keeps closed meshes manifold and pins open boundaries
+    void testDecimate();
 };
 
 #endif /* !TILER_TEST_MESH_H */
@@ -0,0 +1,474 @@
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <test/testutil.h>
+#include "test_voxperf.h"
+#include <tesselate/timer.h>
+#include <stdio.h>
+#include <cstdint>
+#include <sstream>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+void TestVoxPerf::setUp()
+{
+    dim = 402;
+    scene = new Scene();
+    left = new VoxelVolume();
+    right = new VoxelVolume();
+    left->setDim(dim, dim, dim);
+    right->setDim(dim, dim, dim);
+}
+
+void TestVoxPerf::tearDown()
+{
+    delete left;
+    delete right;
+    delete scene;
+}
+
+void TestVoxPerf::randomFill(VoxelVolume * vox, unsigned int seed)
+{
+    int x, y, z;
+
+    srand(seed);
+    for(x = 0; x < dim; x++)
+        for(y = 0; y < dim; y++)
+            for(z = 0; z < dim; z++)
+                vox->set(x, y, z, (rand() % 3) == 0);
+}
+
+void TestVoxPerf::testSetOpSpeed()
+{
+    SetOp ops[3] = {SetOp::UNION, SetOp::INTERSECTION, SetOp::DIFFERENCE};
+    const char * names[3] = {"union", "intersection", "difference"};
+    VoxelVolume loopres;
+    Timer t;
+    float tloop, tword;
+    int o, x, y, z;
+    bool l, r;
+    double gb;
+
+    randomFill(left, 11);
+    randomFill(right, 23);
+    loopres.setDim(dim, dim, dim);
+
+    // bytes streamed by the word kernel: two reads and one write of every word
+    gb = 3.0 * (double) left->getNumWords() * sizeof(std::uint64_t) / 1.0e9;
+
+    for(o = 0; o < 3; o++)
+    {
+        // original triple loop with the operator branch in the innermost loop
+        t.start();
+        for(x = 0; x < dim; x++)
+            for(y = 0; y < dim; y++)
+                for(z = 0; z < dim; z++)
+                {
+                    l = left->get(x, y, z);
+                    r = right->get(x, y, z);
+                    if(ops[o] == SetOp::UNION)
+                        loopres.set(x, y, z, l | r);
+                    else if(ops[o] == SetOp::INTERSECTION)
+                        loopres.set(x, y, z, l & r);
+                    else
+                        loopres.set(x, y, z, l & !r);
+                }
+        t.stop();
+        tloop = t.peek();
+
+        // word-parallel kernel, applied in place to a copy of the left operand
+        VoxelVolume wordres(dim, dim, dim, cgp::Point(0.0f, 0.0f, 0.0f), cgp::Vector(1.0f, 1.0f, 1.0f));
+        memcpy(wordres.getWords(), left->getWords(), sizeof(std::uint64_t) * left->getNumWords());
+        t.start();
+        scene->voxSetOp2(ops[o], &wordres, right);
+        t.stop();
+        tword = t.peek();
+
+        CPPUNIT_ASSERT(memcmp(wordres.getWords(), loopres.getWords(), sizeof(std::uint64_t) * left->getNumWords()) == 0);
+        cerr << "voxSetOp " << names[o] << ": per voxel loop " << tloop << "s, word kernel " << tword << "s";
+        if(tword > 0.0f)
+            cerr << " (" << tloop / tword << "x, " << gb / tword << " GB/s)";
+        cerr << endl;
+    }
+    cerr << "VOX SET OP BENCHMARK PASSED" << endl << endl;
+}
+
+void TestVoxPerf::testMortonNeighbours()
+{
+    const int nx[6] = {-1, 1, 0, 0, 0, 0}, ny[6] = {0, 0, -1, 1, 0, 0}, nz[6] = {0, 0, 0, 0, -1, 1};
+    const char * names[2] = {"ball", "random"};
+    MortonVoxelVolume morton, mortonerode;
+    VoxelVolume linerode, check;
+    int d, x, y, z, n, lx[64], ly[64], lz[64], b;
+    long linsurf, mortsurf;
+    float tlinsurf, tmortsurf, tlinerode, tmorterode;
+    double r2, c;
+    bool inner;
+    Timer t;
+
+    // offsets of each bit within a Morton block
+    for(b = 0; b < 64; b++)
+        mortonDecode((std::uint64_t) b, lx[b], ly[b], lz[b]);
+
+    linerode.setDim(dim, dim, dim);
+    for(d = 0; d < 2; d++)
+    {
+        if(d == 0)
+        {
+            left->fill(false);
+            c = 0.5 * dim; r2 = 0.45 * dim * 0.45 * dim;
+            for(x = 0; x < dim; x++)
+                for(y = 0; y < dim; y++)
+                    for(z = 0; z < dim; z++)
+                        left->set(x, y, z, (x-c)*(x-c) + (y-c)*(y-c) + (z-c)*(z-c) <= r2);
+        }
+        else
+            randomFill(left, 11);
+        morton.fromDense(left);
+        CPPUNIT_ASSERT(morton.count() == left->count());
+
+        // surface voxels: occupied with at least one empty 6-neighbour, traversing the linear layout in index order
+        t.start();
+        linsurf = 0;
+        for(x = 0; x < dim; x++)
+            for(y = 0; y < dim; y++)
+                for(z = 0; z < dim; z++)
+                    if(left->get(x, y, z))
+                    {
+                        inner = true;
+                        for(n = 0; n < 6 && inner; n++)
+                            inner = left->get(x+nx[n], y+ny[n], z+nz[n]);
+                        if(!inner)
+                            linsurf++;
+                    }
+        t.stop();
+        tlinsurf = t.peek();
+
+        // the same test visiting occupied voxels block by block in Morton order
+        t.start();
+        mortsurf = 0;
+        morton.forEachBlock([&](int bx, int by, int bz, std::uint64_t &bits)
+        {
+            std::uint64_t rest = bits;
+            int i, k;
+            bool in;
+            while(rest != 0)
+            {
+                i = __builtin_ctzll(rest);
+                rest &= rest - 1;
+                in = true;
+                for(k = 0; k < 6 && in; k++)
+                    in = morton.get(bx+lx[i]+nx[k], by+ly[i]+ny[k], bz+lz[i]+nz[k]);
+                if(!in)
+                    mortsurf++;
+            }
+        }, true);
+        t.stop();
+        tmortsurf = t.peek();
+        CPPUNIT_ASSERT(linsurf == mortsurf);
+
+        // erosion: keep voxels whose 6-neighbours are all occupied
+        linerode.fill(false);
+        t.start();
+        for(x = 0; x < dim; x++)
+            for(y = 0; y < dim; y++)
+                for(z = 0; z < dim; z++)
+                    if(left->get(x, y, z))
+                    {
+                        inner = true;
+                        for(n = 0; n < 6 && inner; n++)
+                            inner = left->get(x+nx[n], y+ny[n], z+nz[n]);
+                        if(inner)
+                            linerode.set(x, y, z, true);
+                    }
+        t.stop();
+        tlinerode = t.peek();
+
+        mortonerode.setDim(dim, dim, dim);
+        t.start();
+        morton.forEachBlock([&](int bx, int by, int bz, std::uint64_t &bits)
+        {
+            std::uint64_t rest = bits, out = 0;
+            int i, k;
+            bool in;
+            while(rest != 0)
+            {
+                i = __builtin_ctzll(rest);
+                rest &= rest - 1;
+                in = true;
+                for(k = 0; k < 6 && in; k++)
+                    in = morton.get(bx+lx[i]+nx[k], by+ly[i]+ny[k], bz+lz[i]+nz[k]);
+                if(in)
+                    out |= ((std::uint64_t) 1) << i;
+            }
+            // blocks are visited in storage order, so the output block has the same index
+            mortonerode.getWords()[mortonEncode(bx, by, bz) >> 6] = out;
+        }, true);
+        t.stop();
+        tmorterode = t.peek();
+
+        mortonerode.toDense(&check);
+        CPPUNIT_ASSERT(memcmp(check.getWords(), linerode.getWords(), sizeof(std::uint64_t) * linerode.getNumWords()) == 0);
+
+        cerr << "6-neighbourhood " << names[d] << " " << dim << "^3: surface linear " << tlinsurf << "s, Morton " << tmortsurf << "s";
+        if(tmortsurf > 0.0f)
+            cerr << " (" << tlinsurf / tmortsurf << "x)";
+        cerr << "; erosion linear " << tlinerode << "s, Morton " << tmorterode << "s";
+        if(tmorterode > 0.0f)
+            cerr << " (" << tlinerode / tmorterode << "x)";
+        cerr << endl;
+    }
+    cerr << "MORTON NEIGHBOURHOOD BENCHMARK PASSED" << endl << endl;
+}
+
+void TestVoxPerf::testProgramSpeed()
+{
+    const int res = 160;
+    std::vector<cgp::Point> pnts;
+    std::vector<std::uint64_t> walkres, progres, fusedres;
+    CSGProgram prog;
+    Timer t;
+    float twalk, tprog, tfused, step;
+    int x, y, z, i, n;
+
+    // voxel centers over the sample scene bounds, z fastest as in a voxel column
+    scene->sampleScene();
+    step = 16.0f / (float) res;
+    for(x = 0; x < res; x++)
+        for(y = 0; y < res; y++)
+            for(z = 0; z < res; z++)
+                pnts.push_back(cgp::Point(-8.0f + (x + 0.5f) * step, -8.0f + (y + 0.5f) * step, -8.0f + (z + 0.5f) * step));
+    n = (int) pnts.size();
+    walkres.assign((n + 63) / 64, 0);
+    progres.assign((n + 63) / 64, 0);
+    fusedres.assign((n + 63) / 64, 0);
+
+    t.start();
+    for(i = 0; i < n; i++)
+        if(scene->pointContainment(pnts[i]))
+            walkres[i / 64] |= 1ull << (i % 64);
+    t.stop();
+    twalk = t.peek();
+
+    CPPUNIT_ASSERT(prog.compile(scene->getRoot(), false));
+    t.start();
+    prog.evaluate(&pnts[0], n, &progres[0]);
+    t.stop();
+    tprog = t.peek();
+    CPPUNIT_ASSERT(walkres == progres);
+
+    // the sample scene also matches the fused kernel, which shares the shape containment tests and so agrees exactly
+    CPPUNIT_ASSERT(prog.compile(scene->getRoot()) && prog.isFused());
+    t.start();
+    prog.evaluate(&pnts[0], n, &fusedres[0]);
+    t.stop();
+    tfused = t.peek();
+    CPPUNIT_ASSERT(walkres == fusedres);
+
+    cerr << "csg containment " << n << " points: recursive walk " << twalk << "s, compiled program " << tprog << "s";
+    if(tprog > 0.0f)
+        cerr << " (" << twalk / tprog << "x, " << (float) n / tprog / 1.0e6f << " Mpoints/s)";
+    cerr << ", fused kernel " << tfused << "s";
+    if(tfused > 0.0f)
+        cerr << " (" << twalk / tfused << "x, " << (float) n / tfused / 1.0e6f << " Mpoints/s, "
+             << (float) n * sizeof(cgp::Point) / tfused / 1.0e9f << " GB/s of points)";
+    cerr << endl;
+    cerr << "CSG PROGRAM BENCHMARK PASSED" << endl << endl;
+}
+
+void TestVoxPerf::testVoxelFileSpeed()
+{
+    std::vector<std::vector<unsigned char>> runs, packed;
+    std::vector<unsigned char> unpacked;
+    VoxelVolume * vox;
+    VoxelVolume loaded;
+    Timer t;
+    float tenc, tdec;
+    int s, x, y, z, numslabs;
+    long packedbytes;
+    double rawbytes;
+
+    scene->sampleScene();
+    scene->voxelise(0.05f);
+    vox = scene->getVoxels();
+    vox->getDim(x, y, z);
+    numslabs = (x + voxfileslab - 1) / voxfileslab;
+    runs.resize(numslabs);
+    packed.resize(numslabs);
+    rawbytes = (double) vox->getNumWords() * sizeof(std::uint64_t);
+
+    // in memory, so that disk speed does not enter into it
+    t.start();
+    packedbytes = 0;
+    for(s = 0; s < numslabs; s++)
+    {
+        voxRunEncode(vox, s * voxfileslab, min(x, (s + 1) * voxfileslab), runs[s]);
+        lzCompress(&runs[s][0], runs[s].size(), packed[s]);
+        packedbytes += (long) packed[s].size();
+    }
+    t.stop();
+    tenc = t.peek();
+
+    loaded.setDim(x, y, z);
+    t.start();
+    for(s = 0; s < numslabs; s++)
+    {
+        unpacked.resize(runs[s].size());
+        CPPUNIT_ASSERT(lzDecompress(&packed[s][0], packed[s].size(), &unpacked[0], unpacked.size()));
+        CPPUNIT_ASSERT(voxRunDecode(&loaded, s * voxfileslab, min(x, (s + 1) * voxfileslab), &unpacked[0], unpacked.size()));
+    }
+    t.stop();
+    tdec = t.peek();
+    CPPUNIT_ASSERT(std::equal(vox->getWords(), vox->getWords() + vox->getNumWords(), loaded.getWords()));
+    CPPUNIT_ASSERT(packedbytes * 100 < (long) rawbytes);
+
+    cerr << "voxel file " << x << "x" << y << "x" << z << ": " << rawbytes / 1.0e6 << " MB packed to " << packedbytes / 1.0e3
+         << " KB (" << 100.0 * packedbytes / rawbytes << "%), encode " << tenc << "s";
+    if(tenc > 0.0f)
+        cerr << " (" << rawbytes / tenc / 1.0e9 << " GB/s)";
+    cerr << ", decode " << tdec << "s";
+    if(tdec > 0.0f)
+        cerr << " (" << rawbytes / tdec / 1.0e9 << " GB/s)";
+    cerr << endl << "VOXEL FILE BENCHMARK PASSED" << endl << endl;
+}
+
+void TestVoxPerf::testExtractSpeed()
+{
+    Mesh cubes, nets;
+    Timer t;
+    float tcubes, tnets, tserial, tdecimate;
+    int x, y, z, fulltris;
+
+    scene->sampleScene();
+    scene->voxelise(0.05f);
+    scene->getVoxels()->getDim(x, y, z);
+
+    t.start();
+    scene->marchingCubes(scene->getVoxels(), &cubes);
+    t.stop();
+    tcubes = t.peek();
+    t.start();
+    scene->surfaceNets(scene->getVoxels(), &nets);
+    t.stop();
+    tnets = t.peek();
+    scene->setThreads(1);
+    t.start();
+    scene->surfaceNets(scene->getVoxels(), &nets);
+    t.stop();
+    tserial = t.peek();
+    scene->setThreads(0);
+
+    CPPUNIT_ASSERT(cubes.manifoldValidity());
+    CPPUNIT_ASSERT(nets.manifoldValidity());
+
+    // memory held by vertices, their normals and triangles
+    auto meshBytes = [](Mesh &m){ return (double) m.getNumVerts() * (sizeof(cgp::Point) + sizeof(cgp::Vector)) + (double) m.getNumTris() * sizeof(Triangle); };
+    cerr << "surface extraction " << x << "x" << y << "x" << z << ": marching cubes " << cubes.getNumTris() << " triangles on "
+         << cubes.getNumVerts() << " vertices, " << meshBytes(cubes) / 1.0e6 << " MB in " << tcubes << "s; surface nets "
+         << nets.getNumTris() << " triangles (" << 100.0f * (float) nets.getNumTris() / (float) cubes.getNumTris() << "%) on "
+         << nets.getNumVerts() << " vertices, " << meshBytes(nets) / 1.0e6 << " MB in " << tnets << "s, " << tserial
+         << "s on one thread" << endl;
+
+    // triangle reduction is left to decimation, here within a quarter of a voxel
+    fulltris = nets.getNumTris();
+    t.start();
+    nets.decimate(0, 0.25f * 0.05f);
+    t.stop();
+    tdecimate = t.peek();
+    CPPUNIT_ASSERT(nets.manifoldValidity());
+    cerr << "surface nets decimated to " << nets.getNumTris() << " triangles ("
+         << 100.0f * (float) nets.getNumTris() / (float) fulltris << "%) in " << tdecimate << "s" << endl;
+    cerr << "SURFACE EXTRACTION BENCHMARK PASSED" << endl << endl;
+}
+
+void TestVoxPerf::testBoundarySpeed()
+{
+    const int nx[6] = {-1, 1, 0, 0, 0, 0}, ny[6] = {0, 0, -1, 1, 0, 0}, nz[6] = {0, 0, 0, 0, -1, 1};
+    VoxelVolume ball, surf;
+    std::vector<int> coords;
+    ThreadPool pool;
+    int s, side, x, y, z, n;
+    long loopsurf, listsurf;
+    float tloop, tserial, tpar, tlist, tsize[2];
+    double c, r2;
+    bool inner;
+    Timer t;
+
+    for(s = 0; s < 2; s++)
+    {
+        side = (s == 0) ? dim / 2 : dim;
+        ball.setDim(side, side, side);
+        c = 0.5 * side; r2 = 0.45 * side * 0.45 * side;
+        for(x = 0; x < side; x++)
+            for(y = 0; y < side; y++)
+                for(z = 0; z < side; z++)
+                    ball.set(x, y, z, (x-c)*(x-c) + (y-c)*(y-c) + (z-c)*(z-c) <= r2);
+
+        // per voxel neighbour test, as in testMortonNeighbours
+        t.start();
+        loopsurf = 0;
+        for(x = 0; x < side; x++)
+            for(y = 0; y < side; y++)
+                for(z = 0; z < side; z++)
+                    if(ball.get(x, y, z))
+                    {
+                        inner = true;
+                        for(n = 0; n < 6 && inner; n++)
+                            inner = ball.get(x+nx[n], y+ny[n], z+nz[n]);
+                        if(!inner)
+                            loopsurf++;
+                    }
+        t.stop();
+        tloop = t.peek();
+
+        t.start();
+        ball.boundary(&surf);
+        t.stop();
+        tserial = t.peek();
+        CPPUNIT_ASSERT(surf.count() == loopsurf);
+        t.start();
+        ball.boundary(&surf, &pool);
+        t.stop();
+        tpar = t.peek();
+        CPPUNIT_ASSERT(surf.count() == loopsurf);
+        t.start();
+        listsurf = ball.boundaryList(coords, &pool);
+        t.stop();
+        tlist = t.peek();
+        CPPUNIT_ASSERT(listsurf == loopsurf);
+        tsize[s] = tserial;
+
+        cerr << "surface voxels of a " << side << "^3 ball: " << loopsurf << " found per voxel in " << tloop << "s, word-parallel in "
+             << tserial << "s (" << tloop / tserial << "x), on " << pool.getNumThreads() << " threads in " << tpar
+             << "s, as a list in " << tlist << "s" << endl;
+    }
+
+    // eight times the voxels, and so close to eight times the work
+    cerr << "doubling the side multiplies boundary time by " << tsize[1] / tsize[0] << endl;
+    cerr << "BOUNDARY BENCHMARK PASSED" << endl << endl;
+}
+
+void TestVoxPerf::testDecimateSpeed()
+{
+    Mesh mesh;
+    Timer t;
+    int full;
+
+    scene->sampleScene();
+    scene->voxelise(0.025f);
+    scene->marchingCubes(scene->getVoxels(), &mesh);
+    full = mesh.getNumTris();
+
+    t.start();
+    mesh.decimate(full / 10);
+    t.stop();
+
+    CPPUNIT_ASSERT(mesh.getNumTris() <= full / 10);
+    CPPUNIT_ASSERT(mesh.manifoldValidity());
+    cerr << "quadric decimation of " << full << " triangles to " << mesh.getNumTris() << " in " << t.peek() << "s ("
+         << (float) full / t.peek() / 1.0e6f << " million triangles/s)" << endl;
+    cerr << "DECIMATION BENCHMARK PASSED" << endl << endl;
+}
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestVoxPerf, TestSet::perNightly());
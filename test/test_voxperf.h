@@ -0,0 +1,89 @@
+#ifndef TILER_TEST_VOXPERF_H
+#define TILER_TEST_VOXPERF_H
+
+
+#include <string>
+#include <cppunit/extensions/HelperMacros.h>
+#include "tesselate/voxels.h"
+#include "tesselate/csg.h"
+
+/// Timing comparisons for voxel kernels. Registered with the nightly tests because of their running time.
+class TestVoxPerf : public CppUnit::TestFixture
+{
+
+    CPPUNIT_TEST_SUITE(TestVoxPerf);
+    CPPUNIT_TEST(testSetOpSpeed);
+    CPPUNIT_TEST(testMortonNeighbours);
+    CPPUNIT_TEST(testProgramSpeed);
+    CPPUNIT_TEST(testVoxelFileSpeed);
+    CPPUNIT_TEST(testExtractSpeed);
+    CPPUNIT_TEST(testBoundarySpeed);
+    CPPUNIT_TEST(testDecimateSpeed);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    Scene * scene;
+    VoxelVolume * left;
+    VoxelVolume * right;
+    int dim;                ///< side length of the benchmark volumes
+
+    /**
+     * Populate a volume with a repeatable pseudo-random pattern
+     * @param vox   volume to fill
+     * @param seed  random seed
+     */
+    void randomFill(VoxelVolume * vox, unsigned int seed);
+
+public:
+
+    /// Initialization before unit tests
+    void setUp();
+
+    /// Tidying up after unit tests
+    void tearDown();
+
+    /**
+     * Compare word-parallel union, intersection and difference against the original per voxel get/set loop
+     * on a 402^3 volume, the size produced by voxelising the default scene at 0.05
+     */
+    void testSetOpSpeed();
+
+    /**
+     * Compare linear and Morton layouts on 6-neighbourhood kernels, counting surface voxels and eroding the
+     * volume, for both a solid ball and a random fill
+     */
+    void testMortonNeighbours();
+
+    /**
+     * Compare point containment throughput of a compiled csg program and the fused kernel against the recursive
+     * tree walk, over the voxel centers of the sample scene
+     */
+    void testProgramSpeed();
+
+    /**
+     * Measure compression ratio and encode and decode throughput of the compressed voxel file format on the sample
+     * scene voxelised at 0.05
+     */
+    void testVoxelFileSpeed();
+
+    /**
+     * Compare marching cubes with surface nets on triangle count, extraction time and mesh memory, over the sample
+     * scene voxelised at 0.05, check that both meshes are manifold, and report the count after decimating the
+     * surface nets mesh
+     */
+    void testExtractSpeed();
+
+    /**
+     * Compare word-parallel surface voxel extraction, to a volume and to a coordinate list, against a per voxel
+     * neighbour test on a solid ball, and check that time grows linearly with grid size from half to full size
+     */
+    void testBoundarySpeed();
+
+    /**
+     * Measure quadric decimation of a multi-million triangle marching cubes mesh of the sample scene voxelised at
+     * 0.025, down to a tenth of its triangles, and check that the result is manifold
+     */
+    void testDecimateSpeed();
+};
+
+#endif /* !TILER_TEST_VOXPERF_H */